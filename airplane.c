@@ -1,90 +1,348 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include "linkedList.h"
 #include "airplane.h"
+#include "idKey.h"
+
+#define INITIAL_CAPACITY 64
+
+// An airplane id with its key
+typedef struct {
+    uint64_t head;
+    uint64_t tail;
+    const char* id;
+} KeyedId;
 
 // Initialise an airplane list and return it.
-struct LinkedList* init_airplane_list(void) {
-    return init_linked_list();
+AirplaneList init_airplane_list(void) {
+
+    AirplaneLog* list = malloc(sizeof(AirplaneLog));
+    pthread_key_create(&list->key, NULL);
+    pthread_mutex_init(&list->lock, NULL);
+    list->buffers = NULL;
+    list->ids = init_intern_table();
+    list->sorted = NULL;
+    list->heads = NULL;
+    list->tails = NULL;
+    list->count = 0;
+    return list;
 }
 
-// Print the given list to the given file.
-void print_airplane_list(LinkedList* list, FILE* file) {
+// Return the calling thread's arrival buffer, creating it the first time.
+static ArrivalBuffer* own_buffer(AirplaneList list) {
 
-    Node* node = list->head;
+    ArrivalBuffer* buffer = pthread_getspecific(list->key);
+    if (buffer) {
+        return buffer;
+    }
 
-    while (node->next != NULL) {
-        Airplane* this = node->data;
-        if (this) {
-            fprintf(file, "%s\n", this->id);
-        }
-        node = node->next;
+    buffer = malloc(sizeof(ArrivalBuffer));
+    pthread_mutex_init(&buffer->lock, NULL);
+    buffer->cap = INITIAL_CAPACITY;
+    buffer->planes = malloc(sizeof(Airplane) * buffer->cap);
+    buffer->count = 0;
+
+    pthread_mutex_lock(&list->lock);
+    buffer->next = list->buffers;
+    list->buffers = buffer;
+    pthread_mutex_unlock(&list->lock);
+
+    pthread_setspecific(list->key, buffer);
+    return buffer;
+}
+
+// Set keyed to id with its key.
+static void key_id(KeyedId* keyed, const char* id) {
+    keyed->head = id_key(id);
+    keyed->tail = id_key_tail(id);
+    keyed->id = id;
+}
+
+// Return sorted airplane i with its key. Call with list->lock held.
+static KeyedId sorted_id(AirplaneList list, size_t i) {
+    KeyedId keyed = {list->heads[i], list->tails[i], list->sorted[i].id};
+    return keyed;
+}
+
+// Order keyed ids lexicographically by id, which is by key unless they
+// share one - for use with qsort.
+static int compare_keyed(const void* a, const void* b) {
+
+    const KeyedId* first = a;
+    const KeyedId* second = b;
+    if (first->head != second->head) {
+        return first->head < second->head ? -1 : 1;
+    } else if (first->tail != second->tail) {
+        return first->tail < second->tail ? -1 : 1;
     }
-    fprintf(file, ".\n");
-    fflush(file);
+    // interned, so visits by the same airplane share one pointer
+    return first->id == second->id ? 0 : strcmp(first->id, second->id);
 }
 
-// Add the given airplane to given list in lexicographic order.
-void add_airplane(LinkedList* list, Airplane airplane) {
+// Append keyed to the sorted airplanes, keys and all, at k.
+static void put_keyed(Airplane* sorted, uint64_t* heads, uint64_t* tails,
+        size_t k, const KeyedId* keyed) {
+    sorted[k].id = keyed->id;
+    heads[k] = keyed->head;
+    tails[k] = keyed->tail;
+}
 
-    Airplane* data = malloc(sizeof(Airplane));
-    *data = airplane;
-    Node* this = list->head;
+// Merge the sorted run of n airplanes into list's sorted airplanes.
+static void merge_run(AirplaneList list, const KeyedId* run, size_t n) {
 
-    // search for right position to insert the airplane
-    while (this && this->next) {
+    size_t cap = list->count + n + 1;
+    Airplane* merged = malloc(sizeof(Airplane) * cap);
+    uint64_t* heads = malloc(sizeof(uint64_t) * cap);
+    uint64_t* tails = malloc(sizeof(uint64_t) * cap);
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
 
-        // case - are we at end of list?
-        Node* next = this->next;
-        if (next->data == NULL) {
-            insert_item(this, data);
-            return;
+    while (i < list->count && j < n) {
+        KeyedId this = sorted_id(list, i);
+        if (compare_keyed(&this, &run[j]) <= 0) {
+            put_keyed(merged, heads, tails, k++, &this);
+            i++;
+        } else {
+            put_keyed(merged, heads, tails, k++, &run[j++]);
         }
+    }
+    for (; i < list->count; ++i) {
+        KeyedId this = sorted_id(list, i);
+        put_keyed(merged, heads, tails, k++, &this);
+    }
+    while (j < n) {
+        put_keyed(merged, heads, tails, k++, &run[j++]);
+    }
+
+    free(list->sorted);
+    free(list->heads);
+    free(list->tails);
+    list->sorted = merged;
+    list->heads = heads;
+    list->tails = tails;
+    list->count = k;
+}
 
-        Airplane* nextAirplane = next->data;
+// Take every thread's pending arrivals, sort them together as one run and
+// merge that into the sorted list, so the list is copied once however many
+// threads have arrivals. Call with list->lock held.
+static void merge_arrivals(AirplaneList list) {
 
-        // compare airplane id to insert and next one in list
-        int compare = strcmp(nextAirplane->id, airplane.id);
-        if (compare >= 0) {
-            insert_item(this, data);
-            return;
+    KeyedId* run = NULL;
+    size_t n = 0;
+    size_t cap = 0;
+    for (ArrivalBuffer* buffer = list->buffers; buffer;
+            buffer = buffer->next) {
 
-        } else if (compare < 0) {
-            this = this->next;
+        // copy the arrivals out so the owner can carry on appending into
+        // the same array
+        pthread_mutex_lock(&buffer->lock);
+        if (n + buffer->count > cap) {
+            cap = (n + buffer->count) * 2;
+            run = realloc(run, sizeof(KeyedId) * cap);
         }
+        for (size_t i = 0; i < buffer->count; ++i) {
+            key_id(&run[n++], buffer->planes[i].id);
+        }
+        buffer->count = 0;
+        pthread_mutex_unlock(&buffer->lock);
+    }
+
+    if (n > 0) {
+        qsort(run, n, sizeof(KeyedId), compare_keyed);
+        merge_run(list, run, n);
     }
+    free(run);
 }
 
-// Remove the airplane with the given id from the list.
-void remove_airplane(LinkedList* list, const char* id) {
-    Node* node = list->head;
+// Add n airplanes with the given ids to the list in one go, as when
+// rebuilding it on startup. If sorted is true the ids are already in
+// lexicographic order and aren't sorted again.
+void restore_airplanes(AirplaneList list, char** ids, size_t n, bool sorted) {
 
-    while (node->next != NULL) {
+    if (n == 0) {
+        return;
+    }
+    KeyedId* run = malloc(sizeof(KeyedId) * n);
 
-        Airplane* this = node->data;
+    pthread_mutex_lock(&list->lock);
+    for (size_t i = 0; i < n; ++i) {
+        key_id(&run[i], intern_id(list->ids, ids[i]));
+    }
+    if (!sorted) {
+        qsort(run, n, sizeof(KeyedId), compare_keyed);
+    }
+    merge_run(list, run, n);
+    pthread_mutex_unlock(&list->lock);
 
-        if (this && !strcmp(id, this->id)) {
-            remove_item(node);
-            return;
-        }
-        node = node->next;
+    free(run);
+}
+
+// Append the given list to buffer in lexicographic order, followed by the
+// terminating ".". Only builds the text under the lock, so the caller can
+// send it without holding anything.
+void append_airplane_list(AirplaneList list, Buffer* buffer) {
+
+    pthread_mutex_lock(&list->lock);
+    merge_arrivals(list);
+
+    for (size_t i = 0; i < list->count; ++i) {
+        append_str(buffer, list->sorted[i].id);
+        append_buffer(buffer, "\n", 1);
     }
+    pthread_mutex_unlock(&list->lock);
+
+    append_buffer(buffer, ".\n", 2);
 }
 
-// Given a list & an id, find the id & return a pointer that airplane.
-Airplane* get_airplane(LinkedList* list, const char* id) {
+// Print the given list to the given file.
+void print_airplane_list(AirplaneList list, FILE* file) {
 
-    Node* node = list->head;
+    Buffer buffer;
+    init_buffer(&buffer, INITIAL_CAPACITY);
+    append_airplane_list(list, &buffer);
 
-    while (node->next) {
+    fwrite(buffer.data, 1, buffer.len, file);
+    fflush(file);
+    free_buffer(&buffer);
+}
 
-        Airplane* this = node->data;
+// Record that the given airplane has visited. O(1) - it is appended to the
+// calling thread's arrivals and only sorted when the list is next read. The
+// log keeps the interned copy of its id, so an airplane's id is only copied
+// on its first visit.
+void add_airplane(AirplaneList list, Airplane airplane) {
 
-        if (this && !strcmp(id, this->id)) {
-            return this;
+    ArrivalBuffer* buffer = own_buffer(list);
+    const char* id = intern_id(list->ids, airplane.id);
+
+    pthread_mutex_lock(&buffer->lock);
+    if (buffer->count == buffer->cap) {
+        buffer->cap *= 2;
+        buffer->planes = realloc(buffer->planes,
+                sizeof(Airplane) * buffer->cap);
+    }
+    buffer->planes[buffer->count].id = id;
+    buffer->count++;
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+// Return the index of the first sorted airplane whose id is not less than
+// wanted's. Call with list->lock held.
+static size_t lower_bound(AirplaneList list, const KeyedId* wanted) {
+
+    size_t low = rank_id_key(list->heads, list->tails, list->count,
+            wanted->head, wanted->tail);
+    if (id_key_whole(wanted->id)) {
+        return low;
+    }
+
+    // ids too long for their key can share it, then only the ids can say
+    size_t high = list->count;
+    if (wanted->tail != UINT64_MAX) {
+        high = rank_id_key(list->heads, list->tails, list->count,
+                wanted->head, wanted->tail + 1);
+    } else if (wanted->head != UINT64_MAX) {
+        high = rank_id_key(list->heads, list->tails, list->count,
+                wanted->head + 1, 0);
+    }
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(list->sorted[mid].id, wanted->id) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-        node = node->next;
     }
-    return NULL;
+    return low;
+}
+
+// Return true if sorted airplane i, found by lower_bound, is wanted. Call
+// with list->lock held.
+static bool airplane_at(AirplaneList list, size_t i,
+        const KeyedId* wanted) {
+    return i < list->count && list->heads[i] == wanted->head &&
+            list->tails[i] == wanted->tail &&
+            (id_key_whole(wanted->id) || !strcmp(list->sorted[i].id,
+            wanted->id));
+}
+
+// Remove one visit of the airplane with the given id from the list. Its id
+// stays interned for its other visits and any later ones.
+void remove_airplane(AirplaneList list, const char* id) {
+
+    pthread_mutex_lock(&list->lock);
+    merge_arrivals(list);
+
+    KeyedId wanted;
+    key_id(&wanted, id);
+    size_t i = lower_bound(list, &wanted);
+    if (airplane_at(list, i, &wanted)) {
+        size_t after = list->count - i - 1;
+        memmove(&list->sorted[i], &list->sorted[i + 1],
+                sizeof(Airplane) * after);
+        memmove(&list->heads[i], &list->heads[i + 1],
+                sizeof(uint64_t) * after);
+        memmove(&list->tails[i], &list->tails[i + 1],
+                sizeof(uint64_t) * after);
+        list->count--;
+    }
+    pthread_mutex_unlock(&list->lock);
+}
+
+// Forget every airplane that has visited, including arrivals not yet
+// merged. Their ids stay interned, as an arrival racing the reset may
+// already hold one, and are shared again when those airplanes come back.
+void reset_airplane_list(AirplaneList list) {
+
+    pthread_mutex_lock(&list->lock);
+    for (ArrivalBuffer* buffer = list->buffers; buffer;
+            buffer = buffer->next) {
+        pthread_mutex_lock(&buffer->lock);
+        buffer->count = 0;
+        pthread_mutex_unlock(&buffer->lock);
+    }
+
+    free(list->sorted);
+    free(list->heads);
+    free(list->tails);
+    list->sorted = NULL;
+    list->heads = NULL;
+    list->tails = NULL;
+    list->count = 0;
+    pthread_mutex_unlock(&list->lock);
+}
+
+// Return the allocation counters of the log's ids.
+ArenaStats get_airplane_stats(AirplaneList list) {
+
+    ArenaStats total;
+    memset(&total, 0, sizeof(ArenaStats));
+    add_intern_stats(list->ids, &total);
+    return total;
+}
+
+// Return the number of distinct airplanes that have visited.
+size_t count_airplane_ids(AirplaneList list) {
+    return count_interned(list->ids);
+}
+
+// Given a list & an id, find the id & return a pointer that airplane. The
+// pointer is valid until the list is next read or changed.
+Airplane* get_airplane(AirplaneList list, const char* id) {
+
+    pthread_mutex_lock(&list->lock);
+    merge_arrivals(list);
+
+    KeyedId wanted;
+    key_id(&wanted, id);
+    size_t i = lower_bound(list, &wanted);
+    Airplane* airplane = NULL;
+    if (airplane_at(list, i, &wanted)) {
+        airplane = &list->sorted[i];
+    }
+    pthread_mutex_unlock(&list->lock);
+
+    return airplane;
 }
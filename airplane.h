@@ -2,20 +2,59 @@
 #define SRC_AIRPLANE_H
 
 #include <stdio.h>
-#include "linkedList.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "arena.h"
+#include "buffer.h"
+#include "internTable.h"
 
-typedef struct LinkedList* AirplaneList;
+typedef struct AirplaneLog* AirplaneList;
 
 typedef struct {
     const char* id;
 } Airplane;
 
+// Arrivals recorded by one thread, in arrival order. Only that thread
+// appends to it, so its lock is only ever contended by a log request
+// taking the arrivals away. The ids are the log's interned copies.
+typedef struct ArrivalBuffer {
+    pthread_mutex_t lock;
+    Airplane* planes;
+    size_t count;
+    size_t cap;
+    struct ArrivalBuffer* next;
+} ArrivalBuffer;
 
-struct LinkedList* init_airplane_list(void);
-void add_airplane(LinkedList* list, Airplane airplane);
-Airplane* get_airplane(LinkedList* list, const char* id);
-void remove_airplane(LinkedList* list, const char* id);
-void print_airplane_list(LinkedList* list, FILE* file);
+// The airplanes that have visited, kept as a sorted run plus the unsorted
+// arrivals of each thread. Arrivals are only sorted and merged into the run
+// when something needs the list in order. The sorted airplanes' keys are
+// kept in arrays alongside, so searching and merging the run mostly
+// compares keys and only follows an id where keys tie. Every visit of an
+// airplane shares one interned copy of its id.
+typedef struct AirplaneLog {
+    pthread_key_t key; // the calling thread's ArrivalBuffer
+    pthread_mutex_t lock; // guards sorted and the buffers list
+    ArrivalBuffer* buffers;
+    InternTable* ids; // one copy of each id that has visited
+    Airplane* sorted;
+    uint64_t* heads; // id_key of each sorted airplane
+    uint64_t* tails; // id_key_tail of each
+    size_t count;
+} AirplaneLog;
+
+
+AirplaneList init_airplane_list(void);
+void add_airplane(AirplaneList list, Airplane airplane);
+Airplane* get_airplane(AirplaneList list, const char* id);
+void remove_airplane(AirplaneList list, const char* id);
+void print_airplane_list(AirplaneList list, FILE* file);
+void append_airplane_list(AirplaneList list, Buffer* buffer);
+void restore_airplanes(AirplaneList list, char** ids, size_t n, bool sorted);
+void reset_airplane_list(AirplaneList list);
+ArenaStats get_airplane_stats(AirplaneList list);
+size_t count_airplane_ids(AirplaneList list);
 
 
 #endif //SRC_AIRPLANE_H
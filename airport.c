@@ -1,93 +1,933 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include "linkedList.h"
 #include "airport.h"
+#include "idKey.h"
+#include "rcu.h"
+
+#define INITIAL_CAPACITY 64
+#define MAX_LOAD_PERCENT 70
+#define MAX_PORT_NO 65535
+#define RADIX_BITS 11
+#define RADIX_DIGITS (1 << RADIX_BITS)
+#define BATCH_PREFETCH 8 // airports fetched ahead while building
+#define INDEX_SEED 2463534242u
+#define DUMP_PAGE 1024 // airports listed to a read side section
+
+// Marks a slot whose airport was removed so probe sequences continue past it
+static Airport tombstone;
+
+// Return the hash of the given id that the table places it by. Stores
+// persist it, so changing it needs a new STORE_FORMAT.
+uint32_t hash_airport_id(const char* id) {
+    return id_hash(id);
+}
+
+// Return port as a number, or 0 if it isn't a valid port number. Done once
+// per airport so binary lookups are answered without any conversion.
+static uint16_t port_number(const char* port) {
+
+    char* end;
+    unsigned long portNo = strtoul(port, &end, 10);
+    return *port && *end == '\0' && portNo <= MAX_PORT_NO ? portNo : 0;
+}
+
+// Allocate an empty slot array with the given capacity.
+static AirportSlots* init_slots(uint32_t capacity) {
+
+    AirportSlots* slots = calloc(1,
+            sizeof(AirportSlots) + sizeof(AirportSlot) * capacity);
+    slots->capacity = capacity;
+    slots->used = 0;
+    return slots;
+}
+
+// Return the slot holding id, or the empty slot where it would be inserted.
+// Tombstones are skipped but the first one seen is reused for insertion.
+// For writers only - readers use find_airport.
+static AirportSlot* find_slot(AirportSlots* slots, const char* id,
+        uint32_t hash) {
+
+    uint32_t mask = slots->capacity - 1;
+    AirportSlot* reusable = NULL;
+
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        AirportSlot* slot = &slots->slot[i];
+
+        if (slot->airport == NULL) {
+            return reusable ? reusable : slot;
+
+        } else if (slot->airport == &tombstone) {
+            if (!reusable) {
+                reusable = slot;
+            }
+
+        } else if (slot->hash == hash && !strcmp(slot->airport->id, id)) {
+            return slot;
+        }
+    }
+}
+
+// Return the airport with the given id or NULL. Safe to run concurrently
+// with a writer - each slot's airport is loaded once with acquire ordering,
+// which also makes the hash stored before it visible.
+static Airport* find_airport(AirportSlots* slots, const char* id,
+        uint32_t hash) {
+
+    uint32_t mask = slots->capacity - 1;
+
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        AirportSlot* slot = &slots->slot[i];
+        Airport* airport = __atomic_load_n(&slot->airport, __ATOMIC_ACQUIRE);
+
+        if (airport == NULL) {
+            return NULL;
+
+        } else if (airport != &tombstone &&
+                __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == hash &&
+                !strcmp(airport->id, id)) {
+            return airport;
+        }
+    }
+}
+
+// Build a slot array of the given capacity (dropping any tombstones),
+// publish it and free the old one once no reader can still be using it.
+static void grow_table(AirportTable* table, uint32_t capacity) {
+
+    AirportSlots* old = table->slots;
+    AirportSlots* grown = init_slots(capacity);
+    grown->used = table->count;
+
+    uint32_t mask = grown->capacity - 1;
+    for (uint32_t i = 0; i < old->capacity; ++i) {
+        AirportSlot slot = old->slot[i];
+        if (slot.airport == NULL || slot.airport == &tombstone) {
+            continue;
+        }
+
+        uint32_t j = slot.hash & mask;
+        while (grown->slot[j].airport != NULL) {
+            j = (j + 1) & mask;
+        }
+        grown->slot[j] = slot;
+    }
+
+    __atomic_store_n(&table->slots, grown, __ATOMIC_RELEASE);
+    rcu_synchronize();
+    free(old);
+}
+
+// Return the size of an index node with the given number of levels.
+static size_t node_size(int levels) {
+    return sizeof(AirportNode) + sizeof(AirportNode*) * levels;
+}
+
+// Return the number of levels for a new index node: one, and each further
+// level with probability 1/4, up to INDEX_LEVELS.
+static int node_levels(AirportList list) {
+
+    // xorshift32 - the sentinel bit caps the run of zero bit pairs
+    uint32_t x = list->indexSeed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    list->indexSeed = x;
+    return 1 + __builtin_ctz(x | 1u << (2 * (INDEX_LEVELS - 1))) / 2;
+}
+
+// Return true if node's id orders before id, whose id_key is key. Most
+// nodes are told apart by key without reaching their airport.
+static bool node_before(const AirportNode* node, const char* id,
+        uint64_t key) {
+    return node->key != key ? node->key < key
+            : strcmp(node->airport->id, id) < 0;
+}
+
+// Point every one of preds at the head of list's index.
+static void start_preds(AirportList list, AirportNode** preds) {
+    for (int level = 0; level < INDEX_LEVELS; ++level) {
+        preds[level] = list->index;
+    }
+}
+
+// Set preds[level] to the last node on each level of the index with an id
+// below id, whose id_key is key, and return the node after preds[0], which
+// has id if any does. The search carries on from the nodes already in
+// preds, which must be below id too, so a run of ascending ids costs a few
+// steps each. For writers only - readers use seek_index.
+static AirportNode* find_preds(AirportList list, const char* id,
+        uint64_t key, AirportNode** preds) {
+
+    AirportNode* node = list->index;
+    for (int level = INDEX_LEVELS - 1; level >= 0; --level) {
+        // start from whichever of the two is further on
+        AirportNode* pred = preds[level];
+        if (pred != node && pred != list->index && (node == list->index ||
+                node_before(node, pred->airport->id, pred->key))) {
+            node = pred;
+        }
+        while (node->next[level] && node_before(node->next[level], id, key)) {
+            node = node->next[level];
+        }
+        preds[level] = node;
+    }
+    return node->next[0];
+}
+
+// Return the first node of the index with an id not below id, the first
+// of all if id is NULL, or NULL if there is none. Safe to run concurrently
+// with a writer - nodes are fully formed before they are linked in.
+static AirportNode* seek_index(AirportList list, const char* id) {
+
+    AirportNode* node = list->index;
+    uint64_t key = id ? id_key(id) : 0;
+    for (int level = INDEX_LEVELS - 1; id && level >= 0; --level) {
+        AirportNode* next;
+        while ((next = __atomic_load_n(&node->next[level],
+                __ATOMIC_ACQUIRE)) && node_before(next, id, key)) {
+            node = next;
+        }
+    }
+    return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+// Link airport, which must not already be there and has id_key key, into
+// the index after preds, which find_preds set for its id, and move preds on
+// to it.
+static void link_airport(AirportList list, Airport* airport, uint64_t key,
+        AirportNode** preds) {
+
+    int levels = node_levels(list);
+    AirportNode* node = arena_alloc(&list->arena, node_size(levels));
+    node->key = key;
+    node->airport = airport;
+    node->levels = levels;
+    for (int level = 0; level < levels; ++level) {
+        node->next[level] = preds[level]->next[level];
+    }
+    // a reader that finds the node on any level can carry on along level 0
+    for (int level = 0; level < levels; ++level) {
+        __atomic_store_n(&preds[level]->next[level], node, __ATOMIC_RELEASE);
+        preds[level] = node;
+    }
+}
+
+// Link airport, which must not already be there, into the index.
+static void index_airport(AirportList list, Airport* airport) {
+
+    AirportNode* preds[INDEX_LEVELS];
+    uint64_t key = id_key(airport->id);
+    start_preds(list, preds);
+    find_preds(list, airport->id, key, preds);
+    link_airport(list, airport, key, preds);
+}
+
+// Unlink airport from the index and return its node, to be freed once no
+// reader can still be on it. Its own links are left for such readers.
+static AirportNode* unindex_airport(AirportList list, Airport* airport) {
+
+    AirportNode* preds[INDEX_LEVELS];
+    start_preds(list, preds);
+    AirportNode* node = find_preds(list, airport->id, id_key(airport->id),
+            preds);
+    for (int level = node->levels - 1; level >= 0; --level) {
+        __atomic_store_n(&preds[level]->next[level], node->next[level],
+                __ATOMIC_RELEASE);
+    }
+    return node;
+}
+
+// Drop a reference to dump, freeing it with the last one.
+void release_airport_dump(AirportDump* dump) {
+    if (__atomic_sub_fetch(&dump->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(dump);
+    }
+}
+
+// Build the listing of the table as it is now and publish it as the
+// current dump, releasing the table's reference to the old one once no
+// reader can still be picking it up. The listing is taken DUMP_PAGE
+// airports to a read side section, so a writer waiting out readers never
+// waits for a whole one. Only the background rebuild calls this, so there
+// is one at a time.
+static void rebuild_dump(AirportList list) {
+
+    Buffer buffer;
+    init_buffer(&buffer, 4096);
+
+    // read the version first - a change that lands while we list makes the
+    // dump look stale, never newer than it is
+    uint64_t version = __atomic_load_n(&list->version, __ATOMIC_ACQUIRE);
+    AirportRange page = {NULL, NULL, NULL, DUMP_PAGE};
+    char* from = NULL;
+    do {
+        rcu_read_lock();
+        page.from = from;
+        Airport* rest = append_airport_range(list, &page, &buffer);
+        char* next = rest ? strdup(rest->id) : NULL;
+        rcu_read_unlock();
+        free(from);
+        from = next;
+    } while (from);
+
+    AirportDump* dump = malloc(sizeof(AirportDump) + buffer.len);
+    dump->version = version;
+    dump->refs = 1;
+    dump->len = buffer.len;
+    memcpy(dump->data, buffer.data, buffer.len);
+    free_buffer(&buffer);
+
+    AirportDump* old = list->dump;
+    __atomic_store_n(&list->dump, dump, __ATOMIC_RELEASE);
+    rcu_synchronize();
+    release_airport_dump(old);
+}
+
+// Thread function - rebuild the table's dump whenever it has fallen behind
+// the table, until the table is freed. Changes that land during a rebuild
+// are all picked up by the next one.
+static void* run_dump_rebuilds(void* arg) {
+
+    AirportList list = arg;
+    pthread_mutex_lock(&list->dumpLock);
+    while (!list->closing) {
+        if (list->dump->version ==
+                __atomic_load_n(&list->version, __ATOMIC_ACQUIRE)) {
+            list->idle = true;
+            pthread_cond_wait(&list->changed, &list->dumpLock);
+            continue;
+        }
+        pthread_mutex_unlock(&list->dumpLock);
+        rebuild_dump(list);
+        pthread_mutex_lock(&list->dumpLock);
+    }
+    pthread_mutex_unlock(&list->dumpLock);
+    return NULL;
+}
+
+// Wake the dump rebuilds of list if they are waiting for a change. A busy
+// one checks the version again before it waits.
+static void wake_dump_rebuilds(AirportList list) {
+
+    if (!list->dumping) {
+        return;
+    }
+    pthread_mutex_lock(&list->dumpLock);
+    if (list->idle) {
+        list->idle = false;
+        pthread_cond_signal(&list->changed);
+    }
+    pthread_mutex_unlock(&list->dumpLock);
+}
 
 // Initialise an airport list and return it.
-struct LinkedList* init_airport_list(void) {
-    return init_linked_list();
+AirportList init_airport_list(void) {
+
+    AirportTable* table = malloc(sizeof(AirportTable));
+    table->slots = init_slots(INITIAL_CAPACITY);
+    table->count = 0;
+    table->index = calloc(1, node_size(INDEX_LEVELS));
+    table->index->levels = INDEX_LEVELS;
+    table->indexSeed = INDEX_SEED;
+    table->version = 0;
+    table->journal = NULL;
+    table->journalCap = 0;
+    table->journalFrom = 0;
+    pthread_mutex_init(&table->journalLock, NULL);
+    table->dump = calloc(1, sizeof(AirportDump)); // empty listing
+    table->dump->refs = 1;
+    pthread_mutex_init(&table->dumpLock, NULL);
+    pthread_cond_init(&table->changed, NULL);
+    table->dumping = false;
+    table->idle = false;
+    table->closing = false;
+    init_arena(&table->arena);
+    table->store = NULL;
+    return table;
+}
+
+// Free list and everything it owns but its store, once its dump rebuilds
+// have stopped. Nothing else may be using it.
+void free_airport_list(AirportList list) {
+
+    if (list->dumping) {
+        pthread_mutex_lock(&list->dumpLock);
+        list->closing = true;
+        pthread_cond_signal(&list->changed);
+        pthread_mutex_unlock(&list->dumpLock);
+        pthread_join(list->rebuilder, NULL);
+    }
+
+    for (uint32_t i = 0; i < list->journalCap; ++i) {
+        free(list->journal[i].id);
+        free(list->journal[i].port);
+    }
+    free(list->journal);
+    pthread_mutex_destroy(&list->journalLock);
+    pthread_mutex_destroy(&list->dumpLock);
+    pthread_cond_destroy(&list->changed);
+    release_airport_dump(list->dump);
+    free_arena(&list->arena);
+    free(list->index);
+    free(list->slots);
+    free(list);
+}
+
+// Grow list's journal so it can hold the changes after journalFrom up to
+// version, or the last JOURNAL_CHANGES of them, moving those it has. Call
+// with journalLock held.
+static void grow_journal(AirportList list, uint64_t version) {
+
+    uint64_t needed = version - list->journalFrom;
+    uint32_t capacity = list->journalCap ? list->journalCap : 64;
+    while (capacity < needed && capacity < JOURNAL_CHANGES) {
+        capacity *= 2;
+    }
+    if (capacity == list->journalCap) {
+        return;
+    }
+
+    AirportChange* grown = calloc(capacity, sizeof(AirportChange));
+    for (uint64_t v = list->journalFrom + 1; v <= list->version; ++v) {
+        grown[v % capacity] = list->journal[v % list->journalCap];
+    }
+    free(list->journal);
+    list->journal = grown;
+    list->journalCap = capacity;
 }
 
-// Print the given list to the given file.
-void print_airport_list(LinkedList* list, FILE* file) {
+// Journal count changes to the table - the airports added, or removed if
+// removed - publish the version after them and have the dump rebuilt. Only
+// the last JOURNAL_CHANGES of them are kept, older changes making way.
+static void journal_changes(AirportList list, Airport* const* airports,
+        int count, bool removed) {
 
-    Node* node = list->head;
+    pthread_mutex_lock(&list->journalLock);
+    uint64_t version = list->version + count;
+    grow_journal(list, version);
+    uint32_t capacity = list->journalCap;
+    int first = count > capacity ? count - capacity : 0;
+    for (int i = first; i < count; ++i) {
+        uint64_t changed = list->version + 1 + i;
+        AirportChange* change = &list->journal[changed % capacity];
+        free(change->id);
+        free(change->port);
+        change->id = strdup(airports[i]->id);
+        change->port = removed ? NULL : strdup(airports[i]->port);
+    }
+    if (version > capacity && version - capacity > list->journalFrom) {
+        list->journalFrom = version - capacity;
+    }
+    __atomic_store_n(&list->version, version, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&list->journalLock);
+    wake_dump_rebuilds(list);
+}
+
+// If the journal holds every change to list since version since, append
+// them to out in order - +id:port for an airport added, -id for one
+// removed - set *version to the version they bring a client up to and
+// return true. Otherwise return false, and the client needs a full
+// listing. Safe to run alongside a writer.
+bool append_airport_changes(AirportList list, uint64_t since, Buffer* out,
+        uint64_t* version) {
 
-    while (node->next != NULL) {
-        Airport* this = node->data;
-        if (this) {
-            fprintf(file, "%s:%s\n", this->id, this->port);
+    pthread_mutex_lock(&list->journalLock);
+    *version = list->version;
+    // a version from the future is from before a restart
+    if (since < list->journalFrom || since > *version) {
+        pthread_mutex_unlock(&list->journalLock);
+        return false;
+    }
+    for (uint64_t v = since + 1; v <= *version; ++v) {
+        AirportChange* change = &list->journal[v % list->journalCap];
+        append_buffer(out, change->port ? "+" : "-", 1);
+        append_str(out, change->id);
+        if (change->port) {
+            append_buffer(out, ":", 1);
+            append_str(out, change->port);
         }
-        node = node->next;
+        append_buffer(out, "\n", 1);
+    }
+    pthread_mutex_unlock(&list->journalLock);
+    return true;
+}
+
+// Return the node after node on level 0 of the index, for readers.
+static AirportNode* next_node(AirportNode* node) {
+    return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+// Print the given list to the given file in lexicographic order. Reads the
+// table like get_airport so must be called inside an RCU read side section.
+void print_airport_list(AirportList list, FILE* file) {
+
+    for (AirportNode* node = seek_index(list, NULL); node;
+            node = next_node(node)) {
+        fprintf(file, "%s:%s\n", node->airport->id, node->airport->port);
     }
     fflush(file);
 }
 
-// Adds an airport to the linked list in lexicographic order.
-void add_airport(LinkedList* list, Airport airport) {
+// Append airport to buffer as a line of a listing.
+static void append_airport(Buffer* buffer, const Airport* airport) {
+    append_str(buffer, airport->id);
+    append_buffer(buffer, ":", 1);
+    append_str(buffer, airport->port);
+    append_buffer(buffer, "\n", 1);
+}
+
+// Append the given list to buffer in the same format as print_airport_list.
+// Must be called inside an RCU read side section.
+void append_airport_list(AirportList list, Buffer* buffer) {
 
-    Airport* data = malloc(sizeof(Airport));
-    *data = airport;
-    Node* this = list->head;
+    for (AirportNode* node = seek_index(list, NULL); node;
+            node = next_node(node)) {
+        append_airport(buffer, node->airport);
+    }
+}
 
-    // search for right spot to insert the airport
-    while (this && this->next) {
+// Append the airports in range to buffer in the same format as
+// print_airport_list, stopping after range->limit of them. Returns the
+// airport it stopped short of, to ask for the rest from, or NULL if it
+// listed them all. Costs one search of the index and a step per airport.
+// Must be called inside an RCU read side section, and the airport returned
+// is only valid until rcu_read_unlock.
+Airport* append_airport_range(AirportList list, const AirportRange* range,
+        Buffer* buffer) {
 
-        // case - are we at end of list?
-        Node* next = this->next;
-        if (next->data == NULL) {
-            insert_item(this, data);
-            return;
+    const char* from = range->from;
+    size_t prefixLen = 0;
+    if (range->prefix) {
+        prefixLen = strlen(range->prefix);
+        if (!from || strcmp(from, range->prefix) < 0) {
+            from = range->prefix;
         }
+    }
+
+    uint32_t listed = 0;
+    for (AirportNode* node = seek_index(list, from); node;
+            node = next_node(node)) {
+        Airport* airport = node->airport;
+        // ids with the prefix sit together, so the first without ends them
+        if ((range->to && strcmp(airport->id, range->to) >= 0) ||
+                (prefixLen && strncmp(airport->id, range->prefix,
+                prefixLen))) {
+            break;
+        }
+        if (range->limit && listed == range->limit) {
+            return airport;
+        }
+        append_airport(buffer, airport);
+        listed++;
+    }
+    return NULL;
+}
+
+// Grow the table, once, so extra more airports keep the load factor
+// (counting tombstones) below MAX_LOAD_PERCENT.
+static void reserve_slots(AirportList list, uint32_t extra) {
+
+    uint64_t used = (uint64_t)list->slots->used + extra;
+    uint32_t capacity = list->slots->capacity;
+    while (used * 100 > (uint64_t)capacity * MAX_LOAD_PERCENT) {
+        capacity *= 2;
+    }
+    if (capacity != list->slots->capacity) {
+        grow_table(list, capacity);
+    }
+}
+
+// Return a copy of airport for the table. The record comes from the
+// table's arena so airports sit together and removed airports' space is
+// reused. If record is a committed store record the strings are the
+// store's, else they are copied into the arena.
+static Airport* copy_airport(AirportList list, Airport airport,
+        int64_t record) {
+
+    Airport* data = arena_alloc(&list->arena, sizeof(Airport));
+    data->record = record;
+    if (record >= 0) {
+        StoreRecord* stored = &list->store->records[record];
+        data->id = list->store->heap + stored->id;
+        data->port = list->store->heap + stored->port;
+    } else {
+        data->id = arena_strdup(&list->arena, airport.id);
+        data->port = arena_strdup(&list->arena, airport.port);
+    }
+    data->portNo = port_number(data->port);
+    data->info = airport.info ? arena_strdup(&list->arena, airport.info)
+            : NULL;
+    return data;
+}
+
+// Make airport visible to readers in slot, which find_slot gave for hash.
+static void publish_airport(AirportList list, AirportSlot* slot,
+        Airport* airport, uint32_t hash) {
+
+    if (slot->airport == NULL) {
+        list->slots->used++;
+    }
+    // the hash must be in place before a reader can see the airport
+    __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->airport, airport, __ATOMIC_RELEASE);
+    list->count++;
+}
+
+// Adds a copy of an airport to the table. If the id is already present the
+// existing airport is kept. Returns true if it was added. Writers must be
+// serialised by the caller.
+bool add_airport(AirportList list, Airport airport) {
+
+    reserve_slots(list, 1);
+    uint32_t hash = hash_airport_id(airport.id);
+    AirportSlot* slot = find_slot(list->slots, airport.id, hash);
+
+    if (slot->airport != NULL && slot->airport != &tombstone) {
+        return false;
+    }
 
-        Airport* nextAirport = next->data;
+    int64_t record = -1;
+    if (list->store) {
+        record = store_airport(list->store, airport.id, airport.port, hash);
+    }
+    // one that couldn't be committed is dropped from the store, so it is
+    // kept in the arena like an airport with no store at all
+    if (record >= 0 && !commit_store(list->store)) {
+        record = -1;
+    }
+    Airport* data = copy_airport(list, airport, record);
+    publish_airport(list, slot, data, hash);
+    index_airport(list, data);
+    journal_changes(list, &data, 1, false);
+    return true;
+}
+
+// An airport of a batch, with where it goes
+typedef struct {
+    const char* id;
+    uint32_t hash;
+    uint64_t order; // what it is sorted by, e.g. the slot it probes from
+    int index; // position in the batch
+    int64_t record;
+} BatchEntry;
 
-        // compare airport id to insert and next one in list
-        int compare = strcmp(nextAirport->id, airport.id);
-        if (compare == 0) {
-            //todo double check how to handle case when airports match
-            return;
+// Sort count batch entries by order, keeping batch order between entries
+// with the same one, for orders below 1 << bits. A radix sort, RADIX_BITS
+// of the order a pass.
+static void sort_batch(BatchEntry* entries, int count, int bits) {
 
-        } else if (compare > 0) {
-            insert_item(this, data);
-            return;
+    BatchEntry* scratch = malloc(sizeof(BatchEntry) * count);
+    size_t* starts = malloc(sizeof(size_t) * RADIX_DIGITS);
+    BatchEntry* from = entries;
+    BatchEntry* to = scratch;
 
-        } else if (compare < 0) {
-            this = this->next;
+    for (int shift = 0; shift < bits; shift += RADIX_BITS) {
+        memset(starts, 0, sizeof(size_t) * RADIX_DIGITS);
+        for (int i = 0; i < count; ++i) {
+            starts[(from[i].order >> shift) & (RADIX_DIGITS - 1)]++;
         }
+        size_t at = 0;
+        for (int d = 0; d < RADIX_DIGITS; ++d) {
+            size_t n = starts[d];
+            starts[d] = at;
+            at += n;
+        }
+        for (int i = 0; i < count; ++i) {
+            to[starts[(from[i].order >> shift) & (RADIX_DIGITS - 1)]++] =
+                    from[i];
+        }
+        BatchEntry* swap = from;
+        from = to;
+        to = swap;
     }
+
+    if (from != entries) {
+        memcpy(entries, from, sizeof(BatchEntry) * count);
+    }
+    free(starts);
+    free(scratch);
 }
 
-// Remove the airport with the given id from the list.
-void remove_airport(LinkedList* list, const char* id) {
-    Node* node = list->head;
+// Return true if one of the fresh entries already taken from a sorted
+// batch has entry's id. Any with its home slot are the last ones taken.
+static bool taken_already(const BatchEntry* entries, int fresh,
+        const BatchEntry* entry) {
 
-    while (node->next != NULL) {
+    for (int i = fresh - 1; i >= 0 && entries[i].order == entry->order;
+            --i) {
+        if (entries[i].hash == entry->hash &&
+                !strcmp(entries[i].id, entry->id)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-        Airport* this = node->data;
+// Start fetching the airport entries[i + BATCH_PREFETCH] of count is for.
+// In slot order the airports are scattered, so they are fetched ahead.
+static void prefetch_batch(const Airport* airports,
+        const BatchEntry* entries, int i, int count) {
 
-        if (this && !strcmp(id, this->id)) {
-            remove_item(node);
-            return;
+    if (i + BATCH_PREFETCH < count) {
+        const BatchEntry* ahead = &entries[i + BATCH_PREFETCH];
+        __builtin_prefetch(&airports[ahead->index]);
+        __builtin_prefetch(ahead->id);
+    }
+}
+
+// Order batch entries by id - for use with qsort.
+static int compare_entries(const void* a, const void* b) {
+    return strcmp(((const BatchEntry*)a)->id, ((const BatchEntry*)b)->id);
+}
+
+// Link count airports, none already there, into the index. They go in in
+// id order, each searched for from where the last went, so a batch bound
+// for an empty index (or one end of it) costs a few steps an airport. The
+// airports themselves are scattered, so only the batch entries are read
+// unless ids share their keys.
+static void index_airports(AirportList list, Airport* const* airports,
+        int count) {
+
+    BatchEntry* entries = malloc(sizeof(BatchEntry) * (count ? count : 1));
+    for (int i = 0; i < count; ++i) {
+        entries[i].id = airports[i]->id;
+        entries[i].order = id_key(airports[i]->id);
+        entries[i].index = i;
+    }
+    sort_batch(entries, count, 64);
+
+    // ids that share a key still need putting in order
+    for (int i = 0, run; i < count; i += run) {
+        for (run = 1; i + run < count &&
+                entries[i + run].order == entries[i].order; ++run) {
+        }
+        if (run > 1) {
+            qsort(entries + i, run, sizeof(BatchEntry), compare_entries);
         }
-        node = node->next;
     }
+
+    AirportNode* preds[INDEX_LEVELS];
+    start_preds(list, preds);
+    for (int i = 0; i < count; ++i) {
+        find_preds(list, entries[i].id, entries[i].order, preds);
+        link_airport(list, airports[entries[i].index], entries[i].order,
+                preds);
+    }
+    free(entries);
 }
 
-// Given an airport id, find it & return a pointer to that airport in the list
-Airport* get_airport(LinkedList* list, const char* id) {
+// Adds copies of count airports to the table as add_airport would, setting
+// added[i] to whether airports[i] was added - of airports sharing an id only
+// the first can be. The table grows at most once and readers see one new
+// version. With a store the new airports are all committed together before
+// any is visible, so duplicates in the batch have to be found up front:
+// the batch is sorted by the slot each goes in, which puts them together
+// and fills the slots front to back. Writers must be serialised by the
+// caller.
+void add_airports(AirportList list, const Airport* airports, int count,
+        bool* added) {
+
+    // sized as though all are new, which preloads nearly always are
+    reserve_slots(list, count);
+    AirportSlots* slots = list->slots;
+    uint32_t mask = slots->capacity - 1;
 
-    Node* node = list->head;
+    Airport** changed = malloc(sizeof(Airport*) * (count ? count : 1));
+    int fresh = 0; // airports to add, with a store moved to the front
 
-    while (node->next) {
+    // with nothing to commit first each airport can go straight in, and
+    // later ones in the batch see it
+    if (!list->store) {
+        for (int i = 0; i < count; ++i) {
+            uint32_t hash = hash_airport_id(airports[i].id);
+            AirportSlot* slot = find_slot(slots, airports[i].id, hash);
+            added[i] = slot->airport == NULL || slot->airport == &tombstone;
+            if (added[i]) {
+                changed[fresh] = copy_airport(list, airports[i], -1);
+                publish_airport(list, slot, changed[fresh++], hash);
+            }
+        }
+        index_airports(list, changed, fresh);
+        journal_changes(list, changed, fresh, false);
+        free(changed);
+        return;
+    }
 
-        Airport* this = node->data;
+    BatchEntry* entries = malloc(sizeof(BatchEntry) * count);
+    for (int i = 0; i < count; ++i) {
+        entries[i].id = airports[i].id;
+        entries[i].hash = hash_airport_id(airports[i].id);
+        entries[i].order = entries[i].hash & mask;
+        entries[i].index = i;
+        entries[i].record = -1;
+    }
+    int bits = 0;
+    while ((1u << bits) < slots->capacity) {
+        bits++;
+    }
+    sort_batch(entries, count, bits);
 
-        if (this && !strcmp(id, this->id)) {
-            return this;
+    for (int i = 0; i < count; ++i) {
+        BatchEntry entry = entries[i];
+        AirportSlot* slot = find_slot(slots, entry.id, entry.hash);
+        added[entry.index] = (slot->airport == NULL ||
+                slot->airport == &tombstone) &&
+                !taken_already(entries, fresh, &entry);
+        if (added[entry.index]) {
+            entries[fresh++] = entry;
         }
-        node = node->next;
     }
-    return NULL;
+
+    // store every new airport then commit them together
+    bool stored = false;
+    for (int i = 0; i < fresh; ++i) {
+        const Airport* airport = &airports[entries[i].index];
+        entries[i].record = store_airport(list->store, airport->id,
+                airport->port, entries[i].hash);
+        stored = stored || entries[i].record >= 0;
+    }
+    bool committed = stored && commit_store(list->store);
+
+    for (int i = 0; i < fresh; ++i) {
+        prefetch_batch(airports, entries, i, fresh);
+        const Airport* airport = &airports[entries[i].index];
+        AirportSlot* slot = find_slot(slots, entries[i].id, entries[i].hash);
+        changed[i] = copy_airport(list, *airport,
+                committed ? entries[i].record : -1);
+        publish_airport(list, slot, changed[i], entries[i].hash);
+    }
+    index_airports(list, changed, fresh);
+    journal_changes(list, changed, fresh, false);
+    free(changed);
+    free(entries);
+}
+
+// Give an airport, its strings and its index node back to the table's
+// arena.
+static void free_airport(AirportList list, Airport* airport,
+        AirportNode* node) {
+
+    arena_free(&list->arena, node, node_size(node->levels));
+    if (airport->record < 0) {
+        arena_free(&list->arena, (char*)airport->id,
+                strlen(airport->id) + 1);
+        arena_free(&list->arena, (char*)airport->port,
+                strlen(airport->port) + 1);
+    }
+    if (airport->info) {
+        arena_free(&list->arena, (char*)airport->info,
+                strlen(airport->info) + 1);
+    }
+    arena_free(&list->arena, airport, sizeof(Airport));
+}
+
+// Remove the airport with the given id from the list, freeing it once no
+// reader can still hold it. Writers must be serialised by the caller.
+void remove_airport(AirportList list, const char* id) {
+
+    AirportSlot* slot = find_slot(list->slots, id, hash_airport_id(id));
+    Airport* airport = slot->airport;
+
+    if (airport != NULL && airport != &tombstone) {
+        __atomic_store_n(&slot->airport, &tombstone, __ATOMIC_RELEASE);
+        if (airport->record >= 0) {
+            remove_stored_airport(list->store, airport->record);
+        }
+        list->count--;
+        AirportNode* node = unindex_airport(list, airport);
+        journal_changes(list, &airport, 1, true);
+        rcu_synchronize();
+        free_airport(list, airport, node);
+    }
+}
+
+// Given an airport id, find it & return a pointer to that airport in the
+// list. Lock free - call inside an RCU read side section, the airport stays
+// valid until rcu_read_unlock.
+Airport* get_airport(AirportList list, const char* id) {
+
+    AirportSlots* slots = __atomic_load_n(&list->slots, __ATOMIC_ACQUIRE);
+    return find_airport(slots, id, hash_airport_id(id));
+}
+
+// Keep the serialised listing of list up to date from now on, rebuilding it
+// in the background after changes, so get_airport_dump can be used. Tables
+// that are never listed this way don't pay for the rebuilds. Call before
+// any other thread uses list. Returns false if the rebuilds can't start.
+bool start_airport_dumps(AirportList list) {
+    list->dumping = !pthread_create(&list->rebuilder, 0, run_dump_rebuilds,
+            list);
+    return list->dumping;
+}
+
+// Return a reference to the serialised listing of the table, which the
+// caller must release. Listings are rebuilt in the background after the
+// table changes, so this never waits for one and may return the listing of
+// a version just before the latest, which is the version it carries.
+// start_airport_dumps must have been called. Must not be called inside an
+// RCU read side section.
+AirportDump* get_airport_dump(AirportList list) {
+
+    // a rebuild waits for this section to end before it lets the old dump
+    // go, so it can't be freed before we hold a reference
+    rcu_read_lock();
+    AirportDump* dump = __atomic_load_n(&list->dump, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&dump->refs, 1, __ATOMIC_RELAXED);
+    rcu_read_unlock();
+    return dump;
+}
+
+// Return the allocation counters of the table's airports. Writers must be
+// serialised with the caller.
+ArenaStats get_airport_stats(AirportList list) {
+    return list->arena.stats;
+}
+
+// Back an empty table with store and load its committed airports. The
+// airports point straight into the store and are placed using the stored
+// hashes, so nothing is parsed or hashed. Call before the table is shared.
+void attach_airport_store(AirportList list, AirportStore* store) {
+
+    uint64_t stored = store->header->recordCount;
+    uint32_t capacity = INITIAL_CAPACITY;
+    while ((uint64_t)capacity * MAX_LOAD_PERCENT < stored * 100) {
+        capacity *= 2;
+    }
+
+    free(list->slots);
+    list->slots = init_slots(capacity);
+    list->store = store;
+
+    Airport** loaded = malloc(sizeof(Airport*) * (stored ? stored : 1));
+    uint32_t mask = capacity - 1;
+    for (uint64_t i = 0; i < stored; ++i) {
+        StoreRecord* record = &store->records[i];
+        if (record->removed) {
+            continue;
+        }
+
+        Airport* airport = arena_alloc(&list->arena, sizeof(Airport));
+        airport->id = store->heap + record->id;
+        airport->port = store->heap + record->port;
+        airport->portNo = port_number(airport->port);
+        airport->info = NULL;
+        airport->record = (int64_t)i;
+
+        // only the newest registration of an id is ever live, so there is
+        // nothing to compare against
+        uint32_t j = record->hash & mask;
+        while (list->slots->slot[j].airport != NULL) {
+            j = (j + 1) & mask;
+        }
+        list->slots->slot[j].hash = record->hash;
+        list->slots->slot[j].airport = airport;
+        loaded[list->count++] = airport;
+    }
+    list->slots->used = list->count;
+    index_airports(list, loaded, list->count);
+    free(loaded);
+    list->version++;
+    list->journalFrom = list->version; // loaded, not journaled
+    wake_dump_rebuilds(list);
 }
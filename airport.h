@@ -2,21 +2,118 @@
 #define SRC_AIRPORT_H
 
 #include <stdio.h>
-#include "linkedList.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "arena.h"
+#include "airportStore.h"
+#include "buffer.h"
 
-typedef struct LinkedList* AirportList;
+#define JOURNAL_CHANGES (1 << 16) // changes kept for @since, a power of two
+#define INDEX_LEVELS 16 // skip list levels, plenty for 4^16 airports
+
+typedef struct AirportTable* AirportList;
 
 typedef struct {
     const char* id;
     const char* port;
     const char* info;
+    uint16_t portNo; // port as a number for binary replies, 0 if it isn't one
+    int64_t record; // index in the table's store, -1 if not stored
 } Airport;
 
+// A slot in the open addressing table - airport is NULL for an empty slot
+typedef struct {
+    uint32_t hash;
+    Airport* airport;
+} AirportSlot;
+
+// One published version of the slot array. Capacity is a power of two.
+typedef struct AirportSlots {
+    uint32_t capacity;
+    uint32_t used; // live airports + tombstones
+    AirportSlot slot[];
+} AirportSlots;
+
+// A node of the ordered index, a skip list of the airports by id that
+// readers walk lock free like the slots. Every node is on level 0 and each
+// level up holds about a quarter of the nodes below it.
+typedef struct AirportNode {
+    uint64_t key; // the id's id_key
+    Airport* airport; // NULL for the head
+    int levels;
+    struct AirportNode* next[];
+} AirportNode;
+
+// A query for the airports with from <= id < to that start with prefix
+typedef struct {
+    const char* from; // NULL for no lower bound
+    const char* to; // NULL for no upper bound
+    const char* prefix; // NULL for any id
+    uint32_t limit; // most airports to list, 0 for all of them
+} AirportRange;
+
+// The serialised @ listing of one version of the table. Immutable once
+// published and reference counted so it can be sent without holding
+// anything; the table holds one reference while it is current.
+typedef struct AirportDump {
+    uint64_t version;
+    int refs;
+    size_t len;
+    char data[];
+} AirportDump;
+
+// One change to the table, kept for clients catching up with @since
+typedef struct {
+    char* id;
+    char* port; // NULL if the airport was removed
+} AirportChange;
+
+// Hash table of airports indexed by id, with an ordered index over the ids
+// for listings and range queries. Lookups run lock free inside an RCU read
+// side section and may overlap one writer; callers serialise writers.
+// Every change gets the next version, and the last JOURNAL_CHANGES are
+// journaled so a client holding an older version can be sent just those.
+typedef struct AirportTable {
+    AirportSlots* slots;
+    uint32_t count; // live airports
+    AirportNode* index; // head of the ordered index
+    uint32_t indexSeed; // picks node levels, used by writers only
+    uint64_t version; // bumped after every change is visible
+    AirportChange* journal; // the change to version v is at v % journalCap
+    uint32_t journalCap; // grown as changes come, up to JOURNAL_CHANGES
+    uint64_t journalFrom; // every change after this version is journaled
+    pthread_mutex_t journalLock; // orders journal readers and writers
+    AirportDump* dump; // listing of some version, rebuilt after changes
+    bool dumping; // a rebuilder keeps the dump up to date
+    pthread_t rebuilder;
+    pthread_mutex_t dumpLock; // guards idle and closing
+    pthread_cond_t changed; // signalled to wake an idle rebuilder
+    bool idle; // the rebuilder is waiting for a change
+    bool closing; // the rebuilder is to stop
+    Arena arena; // airports and their strings, used by writers only
+    AirportStore* store; // persists the table if not NULL
+} AirportTable;
+
 
-struct LinkedList* init_airport_list(void);
-void add_airport(LinkedList* list, Airport airport);
-Airport* get_airport(LinkedList* list, const char* id);
-void remove_airport(LinkedList* list, const char* id);
-void print_airport_list(LinkedList* list, FILE* file);
+AirportList init_airport_list(void);
+void free_airport_list(AirportList list);
+uint32_t hash_airport_id(const char* id);
+bool add_airport(AirportList list, Airport airport);
+void add_airports(AirportList list, const Airport* airports, int count,
+        bool* added);
+Airport* get_airport(AirportList list, const char* id);
+void remove_airport(AirportList list, const char* id);
+void print_airport_list(AirportList list, FILE* file);
+void append_airport_list(AirportList list, Buffer* buffer);
+Airport* append_airport_range(AirportList list, const AirportRange* range,
+        Buffer* buffer);
+bool start_airport_dumps(AirportList list);
+AirportDump* get_airport_dump(AirportList list);
+void release_airport_dump(AirportDump* dump);
+ArenaStats get_airport_stats(AirportList list);
+void attach_airport_store(AirportList list, AirportStore* store);
+bool append_airport_changes(AirportList list, uint64_t since, Buffer* out,
+        uint64_t* version);
 
 #endif //SRC_AIRPORT_H
@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "airportStore.h"
+
+#define HEAP_RESERVE ((uint64_t)1 << 36) // address space kept for the heap
+#define GROW_STEP ((uint64_t)1 << 20)
+
+// Return the file offset of the string heap for a file of recordCap records.
+static uint64_t heap_base(uint64_t recordCap) {
+
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t records = page + recordCap * sizeof(StoreRecord);
+    return (records + page - 1) / page * page;
+}
+
+// Grow the file so the first size bytes of the mapping can be touched.
+// Returns false if the file can't be grown.
+static bool ensure_size(AirportStore* store, uint64_t size) {
+
+    if (size <= store->fileSize) {
+        return true;
+    }
+    if (size > store->mapLen) {
+        return false;
+    }
+
+    uint64_t grown = store->fileSize * 2;
+    if (grown < size + GROW_STEP) {
+        grown = (size + GROW_STEP) / GROW_STEP * GROW_STEP;
+    }
+    if (grown > store->mapLen) {
+        grown = store->mapLen;
+    }
+    if (ftruncate(store->fd, (off_t)grown)) {
+        return false;
+    }
+    store->fileSize = grown;
+    return true;
+}
+
+// Write a header for an empty store to a new file. Returns false on
+// failure.
+static bool init_store_file(int fd) {
+
+    StoreHeader header;
+    memset(&header, 0, sizeof(StoreHeader));
+    memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+    header.format = STORE_FORMAT;
+    header.recordSize = sizeof(StoreRecord);
+    header.recordCap = STORE_RECORDS;
+    header.heapBase = heap_base(STORE_RECORDS);
+    header.recordCount = 0;
+
+    // the records region is left as a hole until it is written
+    return !ftruncate(fd, (off_t)(header.heapBase + GROW_STEP)) &&
+            pwrite(fd, &header, sizeof(StoreHeader), 0) ==
+            sizeof(StoreHeader) && !fsync(fd);
+}
+
+// Check the header of a mapped store before trusting anything else in it.
+static bool valid_header(StoreHeader* header, uint64_t fileSize) {
+
+    if (memcmp(header->magic, STORE_MAGIC, sizeof(header->magic)) ||
+            header->format != STORE_FORMAT ||
+            header->recordSize != sizeof(StoreRecord) ||
+            header->heapBase != heap_base(header->recordCap) ||
+            header->recordCount > header->recordCap ||
+            header->heapBase > fileSize) {
+        return false;
+    }
+    return true;
+}
+
+// Open the store at path, creating an empty one if there is no file. The
+// committed records are ready to use on return. Returns NULL if the file
+// can't be opened or isn't a valid store.
+AirportStore* open_airport_store(const char* path) {
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info)) {
+        return NULL;
+    }
+    if (info.st_size == 0 && !init_store_file(fd)) {
+        close(fd);
+        return NULL;
+    }
+    if (fstat(fd, &info) || (size_t)info.st_size < sizeof(StoreHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    StoreHeader header;
+    if (pread(fd, &header, sizeof(StoreHeader), 0) != sizeof(StoreHeader) ||
+            !valid_header(&header, (uint64_t)info.st_size)) {
+        close(fd);
+        return NULL;
+    }
+
+    // map the whole reserve up front so pointers into it stay valid as the
+    // file grows underneath
+    size_t mapLen = header.heapBase + HEAP_RESERVE;
+    char* map = mmap(NULL, mapLen, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    AirportStore* store = malloc(sizeof(AirportStore));
+    store->fd = fd;
+    store->map = map;
+    store->mapLen = mapLen;
+    store->header = (StoreHeader*)map;
+    store->records = (StoreRecord*)(map + sysconf(_SC_PAGESIZE));
+    store->heap = map + header.heapBase;
+    store->fileSize = (uint64_t)info.st_size;
+    store->count = header.recordCount;
+
+    // the last committed record says where the heap ends, anything after it
+    // is from an update that never committed and gets overwritten
+    store->heapUsed = 0;
+    if (store->count > 0) {
+        store->heapUsed = store->records[store->count - 1].end;
+    }
+    store->committedHeap = store->heapUsed;
+
+    if (header.heapBase + store->heapUsed > store->fileSize) {
+        close_airport_store(store);
+        return NULL;
+    }
+    return store;
+}
+
+// Unmap and close the store. Uncommitted records are lost.
+void close_airport_store(AirportStore* store) {
+    munmap(store->map, store->mapLen);
+    close(store->fd);
+    free(store);
+}
+
+// Append an airport to the store without committing it. Returns its record
+// index, or -1 if the store is full. Callers serialise writes.
+int64_t store_airport(AirportStore* store, const char* id, const char* port,
+        uint32_t hash) {
+
+    size_t idLen = strlen(id) + 1;
+    size_t portLen = strlen(port) + 1;
+    uint64_t end = store->heapUsed + idLen + portLen;
+
+    if (store->count == store->header->recordCap ||
+            !ensure_size(store, store->header->heapBase + end)) {
+        return -1;
+    }
+
+    memcpy(store->heap + store->heapUsed, id, idLen);
+    memcpy(store->heap + store->heapUsed + idLen, port, portLen);
+
+    StoreRecord* record = &store->records[store->count];
+    record->hash = hash;
+    record->removed = 0;
+    record->id = store->heapUsed;
+    record->port = store->heapUsed + idLen;
+    record->end = end;
+
+    store->heapUsed = end;
+    return (int64_t)store->count++;
+}
+
+// msync the bytes from start to end of the mapping, widened to pages.
+static bool sync_range(AirportStore* store, uint64_t start, uint64_t end) {
+
+    if (start >= end) {
+        return true;
+    }
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    start = start / page * page;
+    return !msync(store->map + start, end - start, MS_SYNC);
+}
+
+// Drop every record stored since the last commit, so the next ones are
+// written over them and the header covers only committed records again.
+static void roll_back_store(AirportStore* store, uint64_t committed) {
+    __atomic_store_n(&store->header->recordCount, committed,
+            __ATOMIC_RELEASE);
+    store->count = committed;
+    store->heapUsed = store->committedHeap;
+}
+
+// Make every record stored since the last commit durable. The data is
+// synced before the header points at it, so a crash part way through
+// leaves the previous commit intact. Returns false if a sync failed, in
+// which case the records are dropped as though never stored.
+bool commit_store(AirportStore* store) {
+
+    StoreHeader* header = store->header;
+    uint64_t committed = header->recordCount;
+    if (committed == store->count) {
+        return true;
+    }
+
+    uint64_t recordBase = (uint64_t)((char*)store->records - store->map);
+    if (!sync_range(store, header->heapBase + store->committedHeap,
+            header->heapBase + store->heapUsed) ||
+            !sync_range(store, recordBase + committed * sizeof(StoreRecord),
+            recordBase + store->count * sizeof(StoreRecord))) {
+        roll_back_store(store, committed);
+        return false;
+    }
+
+    __atomic_store_n(&header->recordCount, store->count, __ATOMIC_RELEASE);
+    if (!sync_range(store, 0, sizeof(StoreHeader))) {
+        roll_back_store(store, committed);
+        return false;
+    }
+    store->committedHeap = store->heapUsed;
+    return true;
+}
+
+// Mark a committed record as removed and make that durable. Its strings
+// stay in the heap, which is append only.
+void remove_stored_airport(AirportStore* store, int64_t record) {
+
+    uint64_t recordBase = (uint64_t)((char*)store->records - store->map);
+    __atomic_store_n(&store->records[record].removed, 1, __ATOMIC_RELEASE);
+    sync_range(store, recordBase + record * sizeof(StoreRecord),
+            recordBase + (record + 1) * sizeof(StoreRecord));
+}
@@ -0,0 +1,64 @@
+//
+// Persistent airport map - a memory mapped file the mapper's airport table
+// is backed by, laid out so a restarted mapper can point its airports
+// straight into it with no parsing.
+//
+// The file is a header, an array of fixed size records and a string heap.
+// Records and strings are only ever appended, and a record is only part of
+// the map once the header's recordCount covers it. An update writes the
+// strings and record, syncs them, then bumps recordCount and syncs the
+// header, so after a crash the file holds exactly the committed records.
+// Removal sets a record's removed flag, a single aligned store.
+//
+
+#ifndef SRC_AIRPORTSTORE_H
+#define SRC_AIRPORTSTORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define STORE_MAGIC "APSTORE1"
+#define STORE_FORMAT 1
+#define STORE_RECORDS (1 << 22) // record capacity of a new file
+
+// At the start of the file, padded to a page
+typedef struct {
+    char magic[8];
+    uint32_t format;
+    uint32_t recordSize;
+    uint64_t recordCap;
+    uint64_t heapBase; // file offset of the string heap
+    uint64_t recordCount; // committed records - the commit point
+} StoreHeader;
+
+// One registration. Offsets are into the heap, strings NUL terminated.
+typedef struct {
+    uint32_t hash; // hash of id as the airport table computes it
+    uint32_t removed;
+    uint64_t id;
+    uint64_t port;
+    uint64_t end; // heap offset just past this record's strings
+} StoreRecord;
+
+typedef struct AirportStore {
+    int fd;
+    char* map; // reserved so it never moves as the file grows
+    size_t mapLen;
+    StoreHeader* header;
+    StoreRecord* records;
+    char* heap;
+    uint64_t fileSize;
+    uint64_t count; // records written, committed or not
+    uint64_t heapUsed;
+    uint64_t committedHeap; // heapUsed as of the last commit
+} AirportStore;
+
+AirportStore* open_airport_store(const char* path);
+void close_airport_store(AirportStore* store);
+int64_t store_airport(AirportStore* store, const char* id, const char* port,
+        uint32_t hash);
+bool commit_store(AirportStore* store);
+void remove_stored_airport(AirportStore* store, int64_t record);
+
+#endif //SRC_AIRPORTSTORE_H
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define MIN_CLASS_SHIFT 4 // smallest class is 16 bytes
+
+// Return the size class for size, or ARENA_CLASSES if it is too big for
+// any class.
+static int size_class(size_t size) {
+
+    int class = 0;
+    size_t classSize = 1 << MIN_CLASS_SHIFT;
+    while (classSize < size) {
+        classSize <<= 1;
+        class++;
+    }
+    return class;
+}
+
+// Return the number of bytes blocks of class take up.
+static size_t class_size(int class) {
+    return (size_t)1 << (class + MIN_CLASS_SHIFT);
+}
+
+// malloc a chunk with room for size bytes and count it.
+static ArenaChunk* new_chunk(Arena* arena, size_t size) {
+
+    ArenaChunk* chunk = malloc(sizeof(ArenaChunk) + size);
+    chunk->size = size;
+    arena->stats.chunkAllocs++;
+    arena->stats.reserved += size;
+    return chunk;
+}
+
+// Initialise an empty arena. No memory is taken until the first allocation.
+void init_arena(Arena* arena) {
+    memset(arena, 0, sizeof(Arena));
+}
+
+// Give every chunk held by arena back to the system.
+void free_arena(Arena* arena) {
+
+    ArenaChunk* chunk = arena->chunks;
+    while (chunk) {
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    init_arena(arena);
+}
+
+// Free every block in arena at once. The newest chunk is kept so an arena
+// that is filled and reset over and over doesn't go back to malloc.
+void reset_arena(Arena* arena) {
+
+    ArenaChunk* keep = arena->chunks;
+    while (keep && keep->size != ARENA_CHUNK_SIZE) {
+        keep = keep->next; // oversized blocks aren't worth keeping
+    }
+
+    ArenaChunk* chunk = arena->chunks;
+    while (chunk) {
+        ArenaChunk* next = chunk->next;
+        if (chunk != keep) {
+            arena->stats.reserved -= chunk->size;
+            free(chunk);
+        }
+        chunk = next;
+    }
+
+    arena->chunks = keep;
+    if (keep) {
+        keep->next = NULL;
+    }
+    arena->used = 0;
+    memset(arena->freeLists, 0, sizeof(arena->freeLists));
+    arena->stats.frees += arena->stats.allocs - arena->stats.frees;
+    arena->stats.inUse = 0;
+}
+
+// Return a block of at least size bytes, 16 byte aligned. Blocks bigger than
+// the largest class get a chunk of their own and are only reclaimed by
+// reset_arena or free_arena.
+void* arena_alloc(Arena* arena, size_t size) {
+
+    int class = size_class(size);
+    arena->stats.allocs++;
+
+    if (class >= ARENA_CLASSES) {
+        ArenaChunk* chunk = new_chunk(arena, size);
+        arena->stats.inUse += size;
+        // behind the current chunk so its free space stays in use
+        if (arena->chunks) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = NULL;
+            arena->chunks = chunk;
+            arena->used = size;
+        }
+        return chunk->data;
+    }
+
+    size_t bytes = class_size(class);
+    arena->stats.inUse += bytes;
+
+    // reuse a freed block if there is one
+    void* block = arena->freeLists[class];
+    if (block) {
+        arena->freeLists[class] = *(void**)block;
+        return block;
+    }
+
+    if (!arena->chunks || arena->used + bytes > arena->chunks->size) {
+        ArenaChunk* chunk = new_chunk(arena, ARENA_CHUNK_SIZE);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->used = 0;
+    }
+    block = arena->chunks->data + arena->used;
+    arena->used += bytes;
+    return block;
+}
+
+// Give back a block of size bytes from arena_alloc for reuse.
+void arena_free(Arena* arena, void* ptr, size_t size) {
+
+    int class = size_class(size);
+    arena->stats.frees++;
+
+    if (class >= ARENA_CLASSES) {
+        arena->stats.inUse -= size;
+        return;
+    }
+    arena->stats.inUse -= class_size(class);
+    *(void**)ptr = arena->freeLists[class];
+    arena->freeLists[class] = ptr;
+}
+
+// Return a copy of str allocated from arena. Free it with
+// arena_free(arena, copy, strlen(copy) + 1).
+char* arena_strdup(Arena* arena, const char* str) {
+
+    size_t len = strlen(str) + 1;
+    char* copy = arena_alloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+// Add the counters in stats to total.
+void add_arena_stats(ArenaStats* total, const ArenaStats* stats) {
+    total->allocs += stats->allocs;
+    total->frees += stats->frees;
+    total->chunkAllocs += stats->chunkAllocs;
+    total->inUse += stats->inUse;
+    total->reserved += stats->reserved;
+}
@@ -0,0 +1,47 @@
+//
+// Chunked arena with size classes. Small blocks are carved out of large
+// chunks and recycled through a free list per power of two size class, so
+// steady state allocation never reaches malloc and related records sit
+// next to each other. The whole arena can be reset in one go. Not thread
+// safe - each arena belongs to one structure and its callers serialise.
+//
+
+#ifndef SRC_ARENA_H
+#define SRC_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CLASSES 8 // 16 bytes up to 2K
+#define ARENA_CHUNK_SIZE 65536
+
+// allocation counters for an arena
+typedef struct {
+    unsigned long allocs; // blocks handed out
+    unsigned long frees; // blocks given back
+    unsigned long chunkAllocs; // times malloc was called for a chunk
+    size_t inUse; // bytes handed out and not given back, by size class
+    size_t reserved; // bytes held from malloc
+} ArenaStats;
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+typedef struct Arena {
+    ArenaChunk* chunks; // the first has room from used onwards
+    size_t used;
+    void* freeLists[ARENA_CLASSES];
+    ArenaStats stats;
+} Arena;
+
+void init_arena(Arena* arena);
+void free_arena(Arena* arena);
+void reset_arena(Arena* arena);
+void* arena_alloc(Arena* arena, size_t size);
+void arena_free(Arena* arena, void* ptr, size_t size);
+char* arena_strdup(Arena* arena, const char* str);
+void add_arena_stats(ArenaStats* total, const ArenaStats* stats);
+
+#endif //SRC_ARENA_H
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include "arrivalJournal.h"
+
+#define BATCH_SIZE 4096
+
+// Return path with suffix appended. The caller frees it.
+static char* suffixed_path(const char* path, const char* suffix) {
+
+    char* full = malloc(strlen(path) + strlen(suffix) + 1);
+    strcpy(full, path);
+    strcat(full, suffix);
+    return full;
+}
+
+// Return the path of segment gen. The caller frees it.
+static char* segment_path(ArrivalJournal* journal, uint64_t gen) {
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%llu", (unsigned long long)gen);
+    return suffixed_path(journal->path, suffix);
+}
+
+// Append the contents of the file at path to buffer. Returns false if it
+// can't be read.
+static bool read_file(const char* path, Buffer* buffer) {
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &info)) {
+        close(fd);
+        return false;
+    }
+    reserve_buffer(buffer, (size_t)info.st_size);
+
+    ssize_t got;
+    while ((got = read(fd, buffer->data + buffer->len,
+            buffer->cap - buffer->len)) > 0) {
+        buffer->len += (size_t)got;
+        if (buffer->len == buffer->cap) {
+            reserve_buffer(buffer, BATCH_SIZE);
+        }
+    }
+    close(fd);
+    return got == 0;
+}
+
+// Write all of data to fd. Returns false on failure.
+static bool write_all(int fd, const char* data, size_t len) {
+
+    while (len > 0) {
+        ssize_t sent = write(fd, data, len);
+        if (sent < 0) {
+            return false;
+        }
+        data += sent;
+        len -= (size_t)sent;
+    }
+    return true;
+}
+
+// Split text into its lines in place, returning how many there are and a
+// malloc'd array of them in *lines. A last line with no newline is dropped.
+static size_t split_lines(char* text, size_t len, char*** lines) {
+
+    size_t n = 0;
+    for (char* at = text; (at = memchr(at, '\n', text + len - at)); ++at) {
+        n++;
+    }
+
+    *lines = malloc(sizeof(char*) * (n + 1));
+    char* line = text;
+    for (size_t i = 0; i < n; ++i) {
+        char* newline = memchr(line, '\n', text + len - line);
+        *newline = '\0';
+        (*lines)[i] = line;
+        line = newline + 1;
+    }
+    return n;
+}
+
+// Order ids lexicographically - for use with qsort.
+static int compare_ids(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// fsync the directory holding path, so names created, renamed or removed
+// in it are durable.
+static void sync_dir(const char* path) {
+
+    char* copy = strdup(path);
+    int fd = open(dirname(copy), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(copy);
+}
+
+// Open segment gen for appending, creating it if need be. Returns the file
+// descriptor or -1.
+static int open_segment(ArrivalJournal* journal, uint64_t gen) {
+
+    char* path = segment_path(journal, gen);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    free(path);
+    sync_dir(journal->path);
+    return fd;
+}
+
+// Load the checkpoint into list and note the first generation after it.
+// Returns false if there is a checkpoint that can't be read.
+static bool load_checkpoint(ArrivalJournal* journal, AirplaneList list) {
+
+    char* path = suffixed_path(journal->path, ".ckpt");
+    Buffer text;
+    init_buffer(&text, BATCH_SIZE);
+    bool exists = read_file(path, &text);
+    bool valid = !exists && access(path, F_OK);
+    free(path);
+
+    if (exists) {
+        char** lines;
+        size_t n = split_lines(text.data, text.len, &lines);
+        if (n > 0 && lines[0][0] == '#') {
+            journal->checkpointGen = strtoull(lines[0] + 1, NULL, 10);
+            // written in order, so it goes straight in as the sorted run
+            restore_airplanes(list, lines + 1, n - 1, true);
+            valid = true;
+        }
+        free(lines);
+    }
+    free_buffer(&text);
+    return valid;
+}
+
+// Replay the segments after the checkpoint into list, dropping a line torn
+// by a crash mid write, and leave gen as the last of them.
+static void replay_segments(ArrivalJournal* journal, AirplaneList list) {
+
+    // segments before the checkpoint are left by a checkpoint interrupted
+    // while removing them
+    for (uint64_t gen = journal->checkpointGen; gen-- > 0; ) {
+        char* path = segment_path(journal, gen);
+        int gone = unlink(path);
+        free(path);
+        if (gone) {
+            break;
+        }
+    }
+
+    Buffer text;
+    init_buffer(&text, BATCH_SIZE);
+    uint64_t gen = journal->checkpointGen;
+    while (true) {
+        char* path = segment_path(journal, gen);
+        size_t start = text.len;
+        if (!read_file(path, &text)) {
+            free(path);
+            break;
+        }
+
+        size_t end = text.len;
+        while (end > start && text.data[end - 1] != '\n') {
+            end--;
+        }
+        if (end != text.len && truncate(path, (off_t)(end - start)) == 0) {
+            text.len = end;
+        }
+        free(path);
+        gen++;
+    }
+    journal->gen = gen > journal->checkpointGen ? gen - 1 : gen;
+
+    char** lines;
+    size_t n = split_lines(text.data, text.len, &lines);
+    restore_airplanes(list, lines, n, false);
+    journal->tail = n;
+    free(lines);
+    free_buffer(&text);
+}
+
+// Write and sync everything pending as one batch. Call with journal->lock
+// held and no flush running. The lock is dropped while writing so arrivals
+// keep queueing up for the next batch.
+static void flush_pending(ArrivalJournal* journal) {
+
+    Buffer batch = journal->pending;
+    journal->pending = journal->batch;
+    journal->batch = batch;
+    uint64_t upto = journal->appended;
+    int fd = journal->fd;
+    journal->flushing = true;
+    pthread_mutex_unlock(&journal->lock);
+
+    bool written = write_all(fd, batch.data, batch.len) && !fdatasync(fd);
+
+    pthread_mutex_lock(&journal->lock);
+    journal->batch.len = 0;
+    journal->failed |= !written;
+    journal->tail += upto - journal->durable;
+    journal->durable = upto;
+    journal->batches++;
+    journal->flushing = false;
+    pthread_cond_broadcast(&journal->synced);
+}
+
+// Flush what is pending and move appends on to a new segment. Returns the
+// new segment's generation, every arrival before it is in an older one, and
+// sets *finished to the number of arrivals known to be in those.
+static uint64_t rotate_segment(ArrivalJournal* journal, uint64_t* finished) {
+
+    pthread_mutex_lock(&journal->lock);
+    while (journal->flushing || journal->pending.len > 0) {
+        if (journal->flushing) {
+            pthread_cond_wait(&journal->synced, &journal->lock);
+        } else {
+            flush_pending(journal);
+        }
+    }
+
+    // if the new segment can't be opened the current one isn't finished,
+    // and the older ones' share of the tail isn't known, so say none
+    int fd = open_segment(journal, journal->gen + 1);
+    *finished = 0;
+    if (fd >= 0) {
+        close(journal->fd);
+        journal->fd = fd;
+        journal->gen++;
+        *finished = journal->tail;
+    }
+    uint64_t gen = journal->gen;
+    pthread_mutex_unlock(&journal->lock);
+
+    return gen;
+}
+
+// Merge the old checkpoint and every finished segment into a new sorted
+// checkpoint, then remove those segments. The checkpoint is written aside
+// and renamed into place, so a crash leaves either the old or the new one.
+static bool write_checkpoint(ArrivalJournal* journal) {
+
+    uint64_t finished;
+    uint64_t upto = rotate_segment(journal, &finished);
+    uint64_t from = journal->checkpointGen;
+    if (upto == from) {
+        return true; // nothing finished to fold in
+    }
+
+    char* path = suffixed_path(journal->path, ".ckpt");
+    char* tmpPath = suffixed_path(journal->path, ".ckpt.tmp");
+
+    Buffer old;
+    init_buffer(&old, BATCH_SIZE);
+    read_file(path, &old);
+    char** oldIds;
+    size_t oldCount = split_lines(old.data, old.len, &oldIds);
+    size_t skip = oldCount > 0 ? 1 : 0; // the header
+
+    Buffer tail;
+    init_buffer(&tail, BATCH_SIZE);
+    for (uint64_t gen = from; gen < upto; ++gen) {
+        char* segment = segment_path(journal, gen);
+        read_file(segment, &tail);
+        free(segment);
+    }
+    char** tailIds;
+    size_t tailCount = split_lines(tail.data, tail.len, &tailIds);
+    qsort(tailIds, tailCount, sizeof(char*), compare_ids);
+
+    Buffer out;
+    init_buffer(&out, old.len + tail.len + 32);
+    char header[32];
+    snprintf(header, sizeof(header), "#%llu\n", (unsigned long long)upto);
+    append_str(&out, header);
+
+    size_t i = skip;
+    size_t j = 0;
+    while (i < oldCount || j < tailCount) {
+        const char* id;
+        if (j == tailCount ||
+                (i < oldCount && strcmp(oldIds[i], tailIds[j]) <= 0)) {
+            id = oldIds[i++];
+        } else {
+            id = tailIds[j++];
+        }
+        append_str(&out, id);
+        append_buffer(&out, "\n", 1);
+    }
+
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd >= 0 && write_all(fd, out.data, out.len) && !fsync(fd);
+    if (fd >= 0) {
+        close(fd);
+    }
+    written = written && !rename(tmpPath, path);
+
+    if (written) {
+        sync_dir(journal->path);
+        for (uint64_t gen = from; gen < upto; ++gen) {
+            char* segment = segment_path(journal, gen);
+            unlink(segment);
+            free(segment);
+        }
+        // only now are the finished segments' arrivals out of the tail
+        pthread_mutex_lock(&journal->lock);
+        journal->checkpointGen = upto;
+        journal->tail -= finished;
+        pthread_mutex_unlock(&journal->lock);
+    }
+
+    free(oldIds);
+    free(tailIds);
+    free_buffer(&old);
+    free_buffer(&tail);
+    free_buffer(&out);
+    free(path);
+    free(tmpPath);
+    return written;
+}
+
+// Mark the running checkpoint as done and wake anyone waiting on it.
+static void end_checkpoint(ArrivalJournal* journal) {
+    pthread_mutex_lock(&journal->lock);
+    journal->checkpointing = false;
+    pthread_cond_broadcast(&journal->synced);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+// Thread function - write a checkpoint in the background. Started with
+// checkpointing already set.
+static void* run_checkpoint(void* arg) {
+    write_checkpoint(arg);
+    end_checkpoint(arg);
+    return NULL;
+}
+
+// Start a background checkpoint if the segments since the last one have
+// grown long enough and none is running. Call with journal->lock held.
+static void maybe_checkpoint(ArrivalJournal* journal) {
+
+    if (journal->tail < CHECKPOINT_ARRIVALS || journal->checkpointing ||
+            journal->failed) {
+        return;
+    }
+    pthread_t threadId;
+    journal->checkpointing = true;
+    if (pthread_create(&threadId, 0, run_checkpoint, journal)) {
+        journal->checkpointing = false;
+        return;
+    }
+    pthread_detach(threadId);
+}
+
+// Open the journal at path, rebuilding list from its checkpoint and the
+// segments after it. Returns NULL if the journal can't be read or opened
+// for appending.
+ArrivalJournal* open_arrival_journal(const char* path, AirplaneList list) {
+
+    ArrivalJournal* journal = malloc(sizeof(ArrivalJournal));
+    journal->path = strdup(path);
+    journal->checkpointGen = 0;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->synced, NULL);
+    init_buffer(&journal->pending, BATCH_SIZE);
+    init_buffer(&journal->batch, BATCH_SIZE);
+    journal->appended = 0;
+    journal->durable = 0;
+    journal->flushing = false;
+    journal->failed = false;
+    journal->checkpointing = false;
+    journal->batches = 0;
+
+    if (!load_checkpoint(journal, list)) {
+        return NULL;
+    }
+    replay_segments(journal, list);
+
+    journal->fd = open_segment(journal, journal->gen);
+    if (journal->fd < 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    maybe_checkpoint(journal);
+    pthread_mutex_unlock(&journal->lock);
+    return journal;
+}
+
+// Append the arrival of the airplane with the given id and return once it
+// is durable. Arrivals that come in while a batch is syncing go out
+// together in the next one. Returns false if the journal has failed.
+bool log_arrival(ArrivalJournal* journal, const char* id) {
+
+    pthread_mutex_lock(&journal->lock);
+    append_str(&journal->pending, id);
+    append_buffer(&journal->pending, "\n", 1);
+    uint64_t seq = ++journal->appended;
+
+    while (journal->durable < seq) {
+        if (journal->flushing) {
+            pthread_cond_wait(&journal->synced, &journal->lock);
+        } else {
+            flush_pending(journal);
+        }
+    }
+    maybe_checkpoint(journal);
+    bool ok = !journal->failed;
+    pthread_mutex_unlock(&journal->lock);
+
+    return ok;
+}
+
+// Fold everything logged so far into the checkpoint, waiting for any
+// checkpoint already running first. Returns false if it couldn't be
+// written, in which case the segments are kept.
+bool checkpoint_journal(ArrivalJournal* journal) {
+
+    pthread_mutex_lock(&journal->lock);
+    while (journal->checkpointing) {
+        pthread_cond_wait(&journal->synced, &journal->lock);
+    }
+    journal->checkpointing = true;
+    pthread_mutex_unlock(&journal->lock);
+
+    bool written = write_checkpoint(journal);
+    end_checkpoint(journal);
+    return written;
+}
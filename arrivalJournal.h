@@ -0,0 +1,48 @@
+//
+// On disk write ahead log of a control's arrivals, so its airplane log
+// survives a restart.
+//
+// Arrivals are appended one id per line to the current segment, path.<gen>.
+// Concurrent arrivals are group committed: whoever finds no write in flight
+// writes and syncs everything pending as one batch while the rest wait for
+// it. Once enough arrivals have built up, a checkpoint moves on to a new
+// segment and merges the old checkpoint with the finished segments into
+// path.ckpt - the sorted ids, headed by the first generation not in it -
+// then removes those segments. Startup loads the checkpoint as it is and
+// replays only the segments after it.
+//
+
+#ifndef SRC_ARRIVALJOURNAL_H
+#define SRC_ARRIVALJOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "airplane.h"
+#include "buffer.h"
+
+#define CHECKPOINT_ARRIVALS (1 << 20) // segment arrivals before a checkpoint
+
+typedef struct ArrivalJournal {
+    char* path;
+    int fd; // current segment, appended to
+    uint64_t gen; // current segment's generation
+    uint64_t checkpointGen; // first generation not in the checkpoint
+    pthread_mutex_t lock;
+    pthread_cond_t synced; // durable moved on or a flush finished
+    Buffer pending; // arrivals not yet written
+    Buffer batch; // arrivals being written
+    uint64_t appended; // arrivals logged
+    uint64_t durable; // arrivals written and synced
+    bool flushing; // a batch is being written
+    bool failed; // a write failed, so later arrivals may not be durable
+    uint64_t tail; // arrivals in segments since the checkpoint
+    bool checkpointing;
+    uint64_t batches; // syncs, so appended / batches is the batch size
+} ArrivalJournal;
+
+ArrivalJournal* open_arrival_journal(const char* path, AirplaneList list);
+bool log_arrival(ArrivalJournal* journal, const char* id);
+bool checkpoint_journal(ArrivalJournal* journal);
+
+#endif //SRC_ARRIVALJOURNAL_H
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "buffer.h"
+
+// Initialise buffer empty with room for cap bytes.
+void init_buffer(Buffer* buffer, size_t cap) {
+    buffer->data = malloc(cap ? cap : 1);
+    buffer->len = 0;
+    buffer->cap = cap ? cap : 1;
+}
+
+// Release the memory held by buffer.
+void free_buffer(Buffer* buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->cap = 0;
+}
+
+// Make sure there is room for at least extra more bytes in buffer.
+void reserve_buffer(Buffer* buffer, size_t extra) {
+
+    if (buffer->len + extra <= buffer->cap) {
+        return;
+    }
+
+    size_t cap = buffer->cap * 2;
+    while (cap < buffer->len + extra) {
+        cap *= 2;
+    }
+    buffer->data = realloc(buffer->data, cap);
+    buffer->cap = cap;
+}
+
+// Append len bytes of data to the end of buffer.
+void append_buffer(Buffer* buffer, const char* data, size_t len) {
+    reserve_buffer(buffer, len);
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+// Append the string str (without its terminator) to buffer.
+void append_str(Buffer* buffer, const char* str) {
+    append_buffer(buffer, str, strlen(str));
+}
+
+// Write all of buffer to the blocking fd and empty it. Returns false if the
+// write failed.
+bool send_buffer(int fd, Buffer* buffer) {
+
+    size_t sent = 0;
+    while (sent < buffer->len) {
+        ssize_t n = write(fd, buffer->data + sent, buffer->len - sent);
+        if (n < 0 && errno != EINTR) {
+            buffer->len = 0;
+            return false;
+        }
+        sent += n > 0 ? n : 0;
+    }
+    buffer->len = 0;
+    return true;
+}
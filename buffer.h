@@ -0,0 +1,25 @@
+//
+// Growable byte buffer used to assemble responses before they are written
+// to a socket in one go.
+//
+
+#ifndef SRC_BUFFER_H
+#define SRC_BUFFER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+void init_buffer(Buffer* buffer, size_t cap);
+void free_buffer(Buffer* buffer);
+void reserve_buffer(Buffer* buffer, size_t extra);
+void append_buffer(Buffer* buffer, const char* data, size_t len);
+void append_str(Buffer* buffer, const char* str);
+bool send_buffer(int fd, Buffer* buffer);
+
+#endif //SRC_BUFFER_H
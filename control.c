@@ -1,13 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <netdb.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
 #include "airplane.h"
+#include "arrivalJournal.h"
 #include "mapperProtocol.h"
+#include "shardRing.h"
+#include "stats.h"
+#include "trace.h"
+#include "workQueue.h"
 
 #define NO_OF_CONNS 128 //as defined in /proc/sys/net/core/somaxconn
 #define MIN_ARGC 3
@@ -15,29 +23,81 @@
 #define AIRPORT_ID_ARG 1
 #define AIRPORT_INFO_ARG 2
 #define MAPPER_PORT_ARG 3
-#define MAX_PORT_NO 65535
-#define MIN_PORT_NO 1
 #define SERVER_FAIL 10
+#define DEFAULT_WORKERS 8
+#define DEFAULT_QUEUE_DEPTH 256
+#define MAX_WORKERS 4096
+#define MAX_QUEUE_DEPTH (1 << 20)
+#define REPLY_SIZE 128
+#define PARK_EVENTS 64
+#define MAX_SESSIONS (1 << 20) // most fds tracked for keep-alive
+#define READ_TIMEOUT_S 5 // longest a worker waits on a half sent request
+
+// counters reported by a # request
+typedef enum {
+    STAT_ARRIVALS,
+    STAT_LOGS,
+    STAT_STATS,
+    STAT_INVALID,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_CONNECTIONS, // open now, parked or not
+    STAT_PARKED, // connections idle now, new or keep-alive
+    STAT_THREADS, // alive now
+    CONTROL_COUNTERS
+} ControlCounter;
+
+// latencies, from a request being read to its reply being ready
+typedef enum {
+    LATENCY_ARRIVE,
+    LATENCY_LOG,
+    CONTROL_HISTS
+} ControlHist;
+
+static const char* const counterNames[] = {"requests.arrive",
+        "requests.log", "requests.stats", "requests.invalid", "bytes.in",
+        "bytes.out", "connections.open", "connections.parked",
+        "threads.alive"};
+static const char* const histNames[] = {"latency.arrive", "latency.log"};
 
 typedef struct sockaddr SockAddr;
 typedef struct addrinfo AddrInfo;
 
+// A connection's request stream. Kept between requests on a keep-alive
+// connection, which waits parked in the control's epoll set while idle, as
+// a new connection does until its first request arrives.
+typedef struct {
+    MsgReader in;
+    bool keepAlive;
+    bool binary; // talks in frames, which implies keep-alive
+    bool registered; // has been added to the epoll set
+    uint64_t counted; // bytes read already counted
+} Session;
+
 // core components of a control
 typedef struct {
     const char* id;
     const char* info;
-    const char* mapperPort;
+    ShardRing* mapperShards; // NULL if there is no mapper
     unsigned short portNo; // current server port
     int sockfd; // server socket file descriptor
     AirplaneList airplaneList;
-    sem_t lock;
+    ArrivalJournal* journal; // persists arrivals if not NULL
+    WorkQueue* queue; // accepted connections waiting for a worker
+    int workerCount;
+    unsigned long shed; // connections dropped because the queue was full
+    int parkFd; // epoll set of idle keep-alive connections
+    Session** sessions; // parked sessions, by fd
+    int sessionCap;
+    Stats* stats;
 } Control;
 
-// Used for packing data into thread function
-typedef struct ThreadData {
-    int connFd;
-    Control* control;
-} ThreadData;
+// startup options
+typedef struct {
+    int workerCount;
+    unsigned queueDepth;
+    const char* journalPath; // where to persist arrivals, or NULL
+} Options;
 
 // program exit codes
 typedef enum {
@@ -133,16 +193,15 @@ const char* check_arg(char* arg) {
     return arg;
 }
 
-// Check if the given arg is a valid port number. If not, exit with code
-// INV_PORT, else return the arg.
-const char* validate_port(char* arg) {
+// Check if the given arg is a shard list - one or more comma separated
+// mapper ports. If not, exit with code INV_PORT, else return its ring.
+ShardRing* validate_shards(char* arg) {
 
-    char* end;
-    unsigned long portNo = strtoul(arg, &end, 10);
-    if (*end != '\0' || portNo > MAX_PORT_NO || portNo < MIN_PORT_NO) {
+    ShardRing* shards = init_shard_ring(arg);
+    if (!shards) {
         exit(print_status(INV_PORT));
     }
-    return arg;
+    return shards;
 }
 
 // Initialise the controller - including input validation.
@@ -157,38 +216,22 @@ Control* init_control(int argc, char** argv) {
     control->id = check_arg(argv[AIRPORT_ID_ARG]);
     control->info = check_arg(argv[AIRPORT_INFO_ARG]);
     control->airplaneList = init_airplane_list();
-    // init semaphore unlocked
-    sem_init(&control->lock, 0, 1);
 
     if (argc == MAX_ARGC) {
-        control->mapperPort = validate_port(argv[MAPPER_PORT_ARG]);
+        control->mapperShards = validate_shards(argv[MAPPER_PORT_ARG]);
     } else {
-        control->mapperPort = NULL;
+        control->mapperShards = NULL;
     }
     return control;
 }
 
-// Given control, initialise a connection to mapper, register the ID and
-// port of this airport and disconnect.
+// Given control, initialise a connection to the mapper shard that owns
+// its id, register the ID and port of this airport and disconnect.
 void register_id(Control* control) {
 
-    AddrInfo* ai = 0;
-    AddrInfo hints;
-
-    memset(&hints, 0, sizeof(AddrInfo));
-    hints.ai_family = AF_INET; // IPv4 for generic could use AF_UNSPEC
-    hints.ai_socktype = SOCK_STREAM;
-
-    int err = getaddrinfo("localhost", control->mapperPort, &hints, &ai);
-    if (err) {
-        freeaddrinfo(ai);
-        exit(print_status(CONN_FAILED));
-    }
-
-    // returns a socket file descriptor
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    if (connect(sockfd, (SockAddr*)ai->ai_addr, sizeof(SockAddr))) {
+    ShardRing* shards = control->mapperShards;
+    int sockfd = connect_shard(shards, shard_for(shards, control->id));
+    if (sockfd < 0) {
         exit(print_status(CONN_FAILED));
     }
 
@@ -206,80 +249,452 @@ void register_id(Control* control) {
     fclose(contOut);
 }
 
-// Thread function - unpack the struct stored in arg, read the incoming
-// request, and respond to it.
-void* handle_conn(void* arg) {
+// Record that the airplane with the given id has visited us. It is only
+// acknowledged once the journal has it. Returns false, without recording
+// it, if the journal couldn't make it durable.
+bool handle_arrival(Control* control, const char* id) {
+
+    // add_airplane interns the id, so the reader's copy can go
+    Airplane airplane;
+    airplane.id = id;
+
+    // waits, with the other arrivals, for the journal's group commit
+    if (control->journal) {
+        TRACE1(control, journal_wait, id);
+        if (!log_arrival(control->journal, id)) {
+            return false;
+        }
+        TRACE1(control, journal_durable, id);
+    }
+    add_airplane(control->airplaneList, airplane);
+    TRACE1(control, arrival, id);
+    return true;
+}
+
+// Append control's # report to out: its counters and latencies, then the
+// connections shed and the airplane log's distinct ids and memory, ended by
+// a line holding just a dot - or framed if binary.
+void handle_stats(Control* control, Buffer* out, bool binary) {
+
+    Buffer report;
+    init_buffer(&report, 4096);
+    append_stats(control->stats, &report);
+    append_stat(&report, "connections.shed",
+            __atomic_load_n(&control->shed, __ATOMIC_RELAXED));
+
+    ArenaStats memory = get_airplane_stats(control->airplaneList);
+    append_stat(&report, "memory.in_use", memory.inUse);
+    append_stat(&report, "memory.reserved", memory.reserved);
+    append_stat(&report, "ids.distinct",
+            count_airplane_ids(control->airplaneList));
+
+    if (control->journal) {
+        ArrivalJournal* journal = control->journal;
+        pthread_mutex_lock(&journal->lock);
+        append_stat(&report, "journal.appended", journal->appended);
+        append_stat(&report, "journal.durable", journal->durable);
+        append_stat(&report, "journal.syncs", journal->batches);
+        pthread_mutex_unlock(&journal->lock);
+    }
 
-    // unpack the struct pointed to by void*
-    ThreadData* threadData = arg;
-    Control* control = threadData->control;
-    int connFd = threadData->connFd;
+    if (binary) {
+        append_frame(out, OP_REPORT, report.data, report.len);
+    } else {
+        append_buffer(out, report.data, report.len);
+        append_buffer(out, ".\n", 2);
+    }
+    free_buffer(&report);
+}
 
-    // wrap file descriptors in FILE*
-    FILE* ctrlIn = fdopen(connFd, "r");
-    FILE* ctrlOut = fdopen(dup(connFd), "w");
+// Handle one request, appending the reply to out. Returns false if an
+// arrival couldn't be made durable, which is never acknowledged - the
+// connection should be closed instead.
+bool handle_request(Control* control, const char* msg, Buffer* out) {
 
-    const char* msg = parse_str(ctrlIn, '\n');
-    fclose(ctrlIn);
+    uint64_t start = stats_clock();
+    TRACE1(control, request, msg);
 
     if (!strcmp(msg, "log")) {
-        sem_wait(&control->lock);
         // message is log - send back lexicographic list of visited airplanes
-        print_airplane_list(control->airplaneList, ctrlOut);
-        sem_post(&control->lock);
+        append_airplane_list(control->airplaneList, out);
+        add_stat(control->stats, STAT_LOGS, 1);
+        record_latency(control->stats, LATENCY_LOG, stats_clock() - start);
+
+    } else if (!strcmp(msg, "#")) {
+        handle_stats(control, out, false);
+        add_stat(control->stats, STAT_STATS, 1);
 
     } else {
-        // message is an id
-        Airplane airplane;
-        airplane.id = msg;
+        // message is an id, this airplane has visited us
+        if (!handle_arrival(control, msg)) {
+            return false;
+        }
+        append_str(out, control->info);
+        append_buffer(out, "\n", 1);
+        add_stat(control->stats, STAT_ARRIVALS, 1);
+        record_latency(control->stats, LATENCY_ARRIVE,
+                stats_clock() - start);
+    }
+    return true;
+}
+
+// Handle one binary request, appending the reply frame to out. Returns
+// false if it isn't a valid request or its arrival couldn't be made
+// durable.
+bool handle_frame(Control* control, const Frame* frame, Buffer* out) {
+
+    uint64_t start = stats_clock();
+    TRACE2(control, frame, frame->op, frame->len);
+
+    if (frame->op == OP_LOG) {
+        // the log's length isn't known until it is built
+        Buffer log;
+        init_buffer(&log, REPLY_SIZE);
+        append_airplane_list(control->airplaneList, &log);
+        append_frame(out, OP_ARRIVALS, log.data, log.len);
+        free_buffer(&log);
+        add_stat(control->stats, STAT_LOGS, 1);
+        record_latency(control->stats, LATENCY_LOG, stats_clock() - start);
+        return true;
+    }
 
-        sem_wait(&control->lock);
+    if (frame->op == OP_STATS) {
+        handle_stats(control, out, true);
+        add_stat(control->stats, STAT_STATS, 1);
+        return true;
+    }
+
+    // the journal keeps an id per line, so one can't hold a newline
+    const char* id = frame_string(frame);
+    if (frame->op != OP_ARRIVE || !id || strchr(id, '\n')) {
+        add_stat(control->stats, STAT_INVALID, 1);
+        return false;
+    }
+    if (!handle_arrival(control, id)) {
+        return false;
+    }
+    append_frame(out, OP_INFO, control->info, strlen(control->info) + 1);
+    add_stat(control->stats, STAT_ARRIVALS, 1);
+    record_latency(control->stats, LATENCY_ARRIVE, stats_clock() - start);
+    return true;
+}
 
-        // this airplane has visited us
-        add_airplane(control->airplaneList, airplane);
+// Return a session for the newly accepted connection connFd.
+Session* new_session(Control* control, int connFd) {
+
+    Session* session = malloc(sizeof(Session));
+    init_reader(&session->in, connFd);
+    session->keepAlive = false;
+    session->binary = false;
+    session->registered = false;
+    session->counted = 0;
+    add_stat(control->stats, STAT_CONNECTIONS, 1);
+    return session;
+}
 
-        fprintf(ctrlOut, "%s\n", control->info);
-        fflush(ctrlOut);
+// Return the session for connFd - the parked one if it is a keep-alive
+// connection coming back, otherwise a new one.
+Session* take_session(Control* control, int connFd) {
 
-        sem_post(&control->lock);
+    Session* session = NULL;
+    if (connFd < control->sessionCap) {
+        session = control->sessions[connFd];
+        control->sessions[connFd] = NULL;
     }
+    if (session) {
+        add_stat(control->stats, STAT_PARKED, -1);
+    } else {
+        session = new_session(control, connFd);
+    }
+    return session;
+}
+
+// Close connFd and free its session.
+void end_session(Control* control, int connFd, Session* session) {
+    add_stat(control->stats, STAT_CONNECTIONS, -1);
+    free_reader(&session->in);
+    free(session);
+    close(connFd);
+}
+
+// Park an idle keep-alive connection until it has more to read. Returns
+// false if it can't be parked.
+bool park_session(Control* control, int connFd, Session* session) {
+
+    if (connFd >= control->sessionCap) {
+        return false;
+    }
+    control->sessions[connFd] = session;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.fd = connFd;
+    int op = session->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(control->parkFd, op, connFd, &event)) {
+        control->sessions[connFd] = NULL;
+        return false;
+    }
+    session->registered = true;
+    add_stat(control->stats, STAT_PARKED, 1);
+    return true;
+}
+
+// Answer every complete request already read on session, in its format.
+// Returns false if a binary request was invalid or an arrival couldn't be
+// made durable.
+bool handle_pending(Control* control, Session* session, Buffer* out) {
+
+    if (session->binary) {
+        Frame frame;
+        int got;
+        while ((got = next_frame(&session->in, &frame)) > 0) {
+            if (!handle_frame(control, &frame, out)) {
+                return false;
+            }
+        }
+        return got == 0;
+    }
+
+    const char* msg;
+    while ((msg = next_line(&session->in))) {
+        if (!handle_request(control, msg, out)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    fclose(ctrlOut);
+// Serve the connection on connFd. A new connection sends one request, which
+// is answered before the connection is closed, unless it asks for keep-alive
+// or binary frames. A keep-alive connection has every complete request it
+// has sent answered together, then is parked rather than holding the worker
+// while idle. The replies are built first and sent without holding any lock.
+void handle_conn(Control* control, int connFd) {
 
+    Session* session = take_session(control, connFd);
+    Buffer ctrlOut;
+    init_buffer(&ctrlOut, REPLY_SIZE);
+    bool open = true;
+
+    if (!session->keepAlive) {
+        WireFormat format = read_format(&session->in);
+        const char* msg = format == WIRE_TEXT ? read_line(&session->in)
+                : NULL;
+
+        if (format == WIRE_BINARY) {
+            session->keepAlive = true;
+            session->binary = true;
+            append_buffer(&ctrlOut, BINARY_HELLO, BINARY_HELLO_LEN);
+
+        } else if (!msg) {
+            // disconnected before sending a full line
+            open = false;
+
+        } else if (!strcmp(msg, KEEP_ALIVE)) {
+            session->keepAlive = true;
+            append_str(&ctrlOut, KEEP_ALIVE "\n");
+
+        } else {
+            handle_request(control, msg, &ctrlOut);
+            open = false;
+        }
+
+    } else if (fill_reader(&session->in) <= 0) {
+        // parked connections only come back readable, so this won't block
+        open = false;
+    }
+
+    if (open && !handle_pending(control, session, &ctrlOut)) {
+        open = false;
+    }
+
+    add_stat(control->stats, STAT_BYTES_IN,
+            session->in.bytesRead - session->counted);
+    add_stat(control->stats, STAT_BYTES_OUT, ctrlOut.len);
+    session->counted = session->in.bytesRead;
+    TRACE2(control, flush, connFd, ctrlOut.len);
+    if (!send_buffer(connFd, &ctrlOut)) {
+        open = false;
+    }
+    free_buffer(&ctrlOut);
+
+    if (!open || !park_session(control, connFd, session)) {
+        end_session(control, connFd, session);
+    }
+}
+
+// Thread function - hand parked connections to the workers as they become
+// readable (or hang up). When every worker is busy and the queue is full
+// the connection is closed straight away rather than letting the backlog
+// grow without bound.
+void* run_parker(void* arg) {
+
+    Control* control = arg;
+    struct epoll_event events[PARK_EVENTS];
+    add_stat(control->stats, STAT_THREADS, 1);
+
+    while (true) {
+        int n = epoll_wait(control->parkFd, events, PARK_EVENTS, -1);
+        for (int i = 0; i < n; ++i) {
+            int connFd = events[i].data.fd;
+            if (!try_enqueue(control->queue, connFd)) {
+                __atomic_add_fetch(&control->shed, 1, __ATOMIC_RELAXED);
+                end_session(control, connFd, take_session(control, connFd));
+            }
+        }
+    }
     return NULL;
 }
 
-// Accept connections from the queue and start up a new thread to handle each
-// connection.
-void accept_conns(Control* control) {
+// Thread function - a pool worker. Serve connections from the queue forever.
+void* run_worker(void* arg) {
+
+    Control* control = arg;
+    add_stat(control->stats, STAT_THREADS, 1);
+
+    while (true) {
+        handle_conn(control, dequeue(control->queue));
+    }
+    return NULL;
+}
+
+// Start the fixed pool of workers that serve queued connections, and the
+// thread watching parked keep-alive connections for them.
+void init_workers(Control* control) {
 
     pthread_t threadId;
-    ThreadData* threadData = malloc(sizeof(ThreadData));
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    control->sessionCap = limit.rlim_cur < MAX_SESSIONS ?
+            (int)limit.rlim_cur : MAX_SESSIONS;
+    control->sessions = calloc(control->sessionCap, sizeof(Session*));
+    control->parkFd = epoll_create1(0);
+    if (control->parkFd < 0 ||
+            pthread_create(&threadId, 0, run_parker, control)) {
+        exit(print_status(SERVER_FAILED));
+    }
+    pthread_detach(threadId);
+
+    for (int i = 0; i < control->workerCount; ++i) {
+        if (pthread_create(&threadId, 0, run_worker, control)) {
+            exit(print_status(SERVER_FAILED));
+        }
+        pthread_detach(threadId);
+    }
+}
+
+// Accept connections and park them until they have a request to read, so
+// a client that connects and sends nothing never holds a worker. The
+// parker queues them for the worker pool from there.
+void accept_conns(Control* control) {
 
     while(true) {
 
-        // pack the threadData
-        threadData->control = control;
-        threadData->connFd = accept(control->sockfd, 0, 0);
+        int connFd = accept(control->sockfd, 0, 0);
+        TRACE1(control, accept, connFd);
 
-        if (threadData->connFd >= 0) {
-            pthread_create(&threadId, 0, handle_conn, threadData);
-        } else {
+        if (connFd < 0) {
             exit(SERVER_FAIL);
         }
+
+        // a request sent in pieces can still hold a worker, but not forever
+        struct timeval timeout = {READ_TIMEOUT_S, 0};
+        setsockopt(connFd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                sizeof(timeout));
+
+        // parked until it has sent something, like an idle keep-alive
+        Session* session = new_session(control, connFd);
+        if (!park_session(control, connFd, session)) {
+            __atomic_add_fetch(&control->shed, 1, __ATOMIC_RELAXED);
+            end_session(control, connFd, session);
+        }
     }
 
 }
 
+// Return arg as a whole number from 1 to max, or -1 if it isn't one.
+long parse_count(const char* arg, long max) {
+
+    char* end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno || value < 1 || value > max) {
+        return -1;
+    }
+    return value;
+}
+
+// Parse the leading command line options into options. If they are invalid
+// exit with code INV_ARGC. Returns the index of the first positional arg.
+int parse_options(int argc, char** argv, Options* options) {
+
+    options->workerCount = DEFAULT_WORKERS;
+    options->queueDepth = DEFAULT_QUEUE_DEPTH;
+    options->journalPath = NULL;
+
+    int opt;
+    long count = 0;
+    // + stops at the first positional arg so ids are never taken as options
+    while ((opt = getopt(argc, argv, "+w:q:l:")) != -1) {
+        switch (opt) {
+            case 'w':
+                count = parse_count(optarg, MAX_WORKERS);
+                options->workerCount = (int)count;
+                break;
+            case 'q':
+                count = parse_count(optarg, MAX_QUEUE_DEPTH);
+                options->queueDepth = (unsigned)count;
+                break;
+            case 'l':
+                options->journalPath = optarg;
+                break;
+            default:
+                exit(print_status(INV_ARGC));
+        }
+        if (count < 0) {
+            exit(print_status(INV_ARGC));
+        }
+    }
+    return optind;
+}
+
 int main(int argc, char** argv) {
 
+    Options options;
+    int first = parse_options(argc, argv, &options);
+
+    // shift the args so the positional ones start at index 1 as usual
+    argc -= first - 1;
+    argv += first - 1;
+
     Control* control = init_control(argc, argv);
+    control->journal = NULL;
+    if (options.journalPath) {
+        // rebuild the airplane log before anyone can visit
+        control->journal = open_arrival_journal(options.journalPath,
+                control->airplaneList);
+        if (!control->journal) {
+            fprintf(stderr, "Can not open arrival journal\n");
+            exit(SERVER_FAILED);
+        }
+    }
+    control->workerCount = options.workerCount;
+    control->queue = init_work_queue(options.queueDepth);
+    if (!control->queue) {
+        exit(print_status(SERVER_FAILED));
+    }
+    control->shed = 0;
+    control->stats = init_stats(counterNames, CONTROL_COUNTERS, histNames,
+            CONTROL_HISTS);
+    add_stat(control->stats, STAT_THREADS, 1); // this one
     control->sockfd = init_server(control);
 
     if (argc == MAX_ARGC) {
         register_id(control);
     }
+    init_workers(control);
     accept_conns(control);
 
     return NORMAL_OPERATION;
-}
\ No newline at end of file
+}
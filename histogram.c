@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include "histogram.h"
+
+#define HIST_MAX_VALUE ((1ull << HIST_MAX_BITS) - 1)
+
+// Return the slot counting value. Values below 2 * HIST_SUB_COUNT have a
+// slot each; above that each octave has HIST_SUB_COUNT slots.
+static int slot_of(uint64_t value) {
+
+    if (value > HIST_MAX_VALUE) {
+        value = HIST_MAX_VALUE;
+    }
+    int octave = 63 - __builtin_clzll(value | (2 * HIST_SUB_COUNT - 1)) -
+            HIST_SUB_BITS;
+    int sub = value >> octave;
+    return ((octave + 1) << HIST_SUB_BITS) + sub - HIST_SUB_COUNT;
+}
+
+// Return the largest value counted in slot.
+static uint64_t slot_value(int slot) {
+
+    int octave = (slot >> HIST_SUB_BITS) - 1;
+    uint64_t sub = (slot & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT;
+    if (octave < 0) {
+        return slot;
+    }
+    return ((sub + 1) << octave) - 1;
+}
+
+// Initialise hist with nothing recorded.
+void init_histogram(Histogram* hist) {
+    memset(hist, 0, sizeof(Histogram));
+    hist->min = UINT64_MAX;
+}
+
+// Count one occurrence of value.
+void record_value(Histogram* hist, uint64_t value) {
+
+    hist->counts[slot_of(value)]++;
+    hist->total++;
+    hist->sum += value;
+    hist->min = value < hist->min ? value : hist->min;
+    hist->max = value > hist->max ? value : hist->max;
+}
+
+// Count one occurrence of value in a histogram other threads may be
+// recording in too. Relaxed atomics, so a reader summing it while it is
+// being recorded in may see a count before the matching total.
+void record_shared_value(Histogram* hist, uint64_t value) {
+
+    __atomic_add_fetch(&hist->counts[slot_of(value)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->total, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum, value, __ATOMIC_RELAXED);
+
+    uint64_t seen = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+    while (value < seen && !__atomic_compare_exchange_n(&hist->min, &seen,
+            value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    seen = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(&hist->max, &seen,
+            value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Add everything recorded in from to into.
+void merge_histogram(Histogram* into, const Histogram* from) {
+
+    for (int i = 0; i < HIST_SLOTS; ++i) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    into->min = from->min < into->min ? from->min : into->min;
+    into->max = from->max > into->max ? from->max : into->max;
+}
+
+// Return the value that percentile (0 to 100) of the recorded values are at
+// or below, to the histogram's precision. 0 if nothing is recorded.
+uint64_t value_at_percentile(const Histogram* hist, double percentile) {
+
+    if (hist->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100 * hist->total + 0.5);
+    rank = rank < 1 ? 1 : rank;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_SLOTS; ++i) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = slot_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// Append hist to out as the members of a JSON object - count, mean, min,
+// max, the usual percentiles and the non-empty buckets as [upper bound,
+// count] pairs - with every value divided by unit.
+void append_histogram_json(Buffer* out, const Histogram* hist, double unit) {
+
+    static const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+    static const char* const names[] = {"p50", "p90", "p99", "p999",
+            "p9999"};
+    char field[96];
+
+    snprintf(field, sizeof(field), "\"count\":%llu,\"mean\":%.3f,"
+            "\"min\":%.3f,\"max\":%.3f", (unsigned long long)hist->total,
+            hist->total ? (double)hist->sum / hist->total / unit : 0,
+            hist->total ? hist->min / unit : 0, hist->max / unit);
+    append_str(out, field);
+
+    for (int i = 0; i < sizeof(percentiles) / sizeof(double); ++i) {
+        snprintf(field, sizeof(field), ",\"%s\":%.3f", names[i],
+                value_at_percentile(hist, percentiles[i]) / unit);
+        append_str(out, field);
+    }
+
+    append_str(out, ",\"buckets\":[");
+    bool first = true;
+    for (int i = 0; i < HIST_SLOTS; ++i) {
+        if (hist->counts[i]) {
+            snprintf(field, sizeof(field), "%s[%.3f,%llu]",
+                    first ? "" : ",", slot_value(i) / unit,
+                    (unsigned long long)hist->counts[i]);
+            append_str(out, field);
+            first = false;
+        }
+    }
+    append_str(out, "]");
+}
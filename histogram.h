@@ -0,0 +1,36 @@
+//
+// HDR style latency histogram. Values are counted in buckets that are
+// linear within each power of two - HIST_SUB_COUNT of them - so every
+// recorded value is kept to within 1% from nanoseconds up to minutes in a
+// fixed array, and recording is a few shifts and an increment. Histograms
+// recorded separately (one per thread, say) merge by adding their counts.
+// Only record_shared_value is thread safe.
+//
+
+#ifndef SRC_HISTOGRAM_H
+#define SRC_HISTOGRAM_H
+
+#include <stdint.h>
+#include "buffer.h"
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS) // linear buckets per octave
+#define HIST_MAX_BITS 40 // values from 2^40 up are counted as the largest
+#define HIST_SLOTS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct {
+    uint64_t counts[HIST_SLOTS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} Histogram;
+
+void init_histogram(Histogram* hist);
+void record_value(Histogram* hist, uint64_t value);
+void record_shared_value(Histogram* hist, uint64_t value);
+void merge_histogram(Histogram* into, const Histogram* from);
+uint64_t value_at_percentile(const Histogram* hist, double percentile);
+void append_histogram_json(Buffer* out, const Histogram* hist, double unit);
+
+#endif //SRC_HISTOGRAM_H
@@ -0,0 +1,153 @@
+#include <string.h>
+#include "idKey.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ID_KEY_SIMD 1
+#endif
+
+#define RANK_WINDOW 32 // keys left when counting takes over from bisecting
+#define SIGN_BIT 0x8000000000000000ull
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+// Return the first ID_KEY_BYTES of id as a number that orders like the id.
+uint64_t id_key(const char* id) {
+
+    uint64_t key = 0;
+    memcpy(&key, id, strnlen(id, ID_KEY_BYTES));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    key = __builtin_bswap64(key);
+#endif
+    return key;
+}
+
+// Return the key of the part of id after its first ID_KEY_BYTES, 0 if
+// there is none.
+uint64_t id_key_tail(const char* id) {
+    return strnlen(id, ID_KEY_BYTES) == ID_KEY_BYTES ?
+            id_key(id + ID_KEY_BYTES) : 0;
+}
+
+// Return true if id's head and tail hold all of it, terminating NUL
+// included, so any id with the same two is id.
+bool id_key_whole(const char* id) {
+    return strnlen(id, 2 * ID_KEY_BYTES) < 2 * ID_KEY_BYTES;
+}
+
+// Return how many of the n keys are below head and tail, one at a time.
+static size_t count_below_scalar(const uint64_t* heads,
+        const uint64_t* tails, size_t n, uint64_t head, uint64_t tail) {
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        count += heads[i] < head || (heads[i] == head && tails[i] < tail);
+    }
+    return count;
+}
+
+#if ID_KEY_SIMD
+// Return how many of the n keys are below head and tail, four at a time.
+// The compare is signed, so every word has its top bit flipped first.
+__attribute__((target("avx2")))
+static size_t count_below_avx2(const uint64_t* heads, const uint64_t* tails,
+        size_t n, uint64_t head, uint64_t tail) {
+
+    const __m256i flip = _mm256_set1_epi64x((long long)SIGN_BIT);
+    const __m256i headLimit = _mm256_set1_epi64x((long long)(head ^ SIGN_BIT));
+    const __m256i tailLimit = _mm256_set1_epi64x((long long)(tail ^ SIGN_BIT));
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i theseHeads = _mm256_xor_si256(flip,
+                _mm256_loadu_si256((const __m256i*)(heads + i)));
+        __m256i theseTails = _mm256_xor_si256(flip,
+                _mm256_loadu_si256((const __m256i*)(tails + i)));
+        __m256i below = _mm256_or_si256(
+                _mm256_cmpgt_epi64(headLimit, theseHeads),
+                _mm256_and_si256(_mm256_cmpeq_epi64(headLimit, theseHeads),
+                _mm256_cmpgt_epi64(tailLimit, theseTails)));
+        count += __builtin_popcount(
+                _mm256_movemask_pd(_mm256_castsi256_pd(below)));
+    }
+    return count + count_below_scalar(heads + i, tails + i, n - i, head,
+            tail);
+}
+
+// Return how many of the n keys are below head and tail, two at a time.
+__attribute__((target("sse4.2")))
+static size_t count_below_sse42(const uint64_t* heads, const uint64_t* tails,
+        size_t n, uint64_t head, uint64_t tail) {
+
+    const __m128i flip = _mm_set1_epi64x((long long)SIGN_BIT);
+    const __m128i headLimit = _mm_set1_epi64x((long long)(head ^ SIGN_BIT));
+    const __m128i tailLimit = _mm_set1_epi64x((long long)(tail ^ SIGN_BIT));
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i theseHeads = _mm_xor_si128(flip,
+                _mm_loadu_si128((const __m128i*)(heads + i)));
+        __m128i theseTails = _mm_xor_si128(flip,
+                _mm_loadu_si128((const __m128i*)(tails + i)));
+        __m128i below = _mm_or_si128(_mm_cmpgt_epi64(headLimit, theseHeads),
+                _mm_and_si128(_mm_cmpeq_epi64(headLimit, theseHeads),
+                _mm_cmpgt_epi64(tailLimit, theseTails)));
+        count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(below)));
+    }
+    return count + count_below_scalar(heads + i, tails + i, n - i, head,
+            tail);
+}
+#endif
+
+static size_t (*count_below)(const uint64_t* heads, const uint64_t* tails,
+        size_t n, uint64_t head, uint64_t tail) = count_below_scalar;
+static const char* method = "scalar";
+
+// Pick the widest way of counting keys this CPU has.
+__attribute__((constructor)) static void choose_count(void) {
+#if ID_KEY_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        count_below = count_below_avx2;
+        method = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        count_below = count_below_sse42;
+        method = "sse4.2";
+    }
+#endif
+}
+
+// Return the number of the n sorted keys below head and tail, which is
+// where that key would go among them.
+size_t rank_id_key(const uint64_t* heads, const uint64_t* tails, size_t n,
+        uint64_t head, uint64_t tail) {
+
+    size_t low = 0;
+    size_t high = n;
+    while (high - low > RANK_WINDOW) {
+        size_t mid = low + (high - low) / 2;
+        if (heads[mid] < head || (heads[mid] == head && tails[mid] < tail)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low + count_below(heads + low, tails + low, high - low, head,
+            tail);
+}
+
+// Return the name of the way keys are being counted, for reports.
+const char* id_key_method(void) {
+    return method;
+}
+
+// Return the FNV-1a hash of id.
+uint32_t id_hash(const char* id) {
+
+    uint32_t hash = FNV_OFFSET;
+    while (*id) {
+        hash ^= (unsigned char)*id++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
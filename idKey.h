@@ -0,0 +1,37 @@
+//
+// Fixed width keys for ids, kept inline beside arrays and index nodes so
+// ordering ids mostly compares numbers instead of chasing pointers into
+// strings. A key is a word holding the first ID_KEY_BYTES of the id read
+// big endian and NUL padded, so keys order like the ids they come from.
+// Where one word is too few the id's tail - its next ID_KEY_BYTES - makes
+// a second, and ids that fit in the two are told apart by them alone.
+// Longer ids can share their words: equal words only say the ids may be
+// equal and the ids themselves decide - the overflow path.
+//
+// Sorted arrays of keys, heads and tails in arrays of their own, are
+// searched by rank_id_key: it narrows the range by bisection and then
+// counts the last stretch several keys an instruction, with AVX2 or
+// SSE4.2 where the CPU has them and plain C where it doesn't - chosen once
+// at startup.
+//
+// Tables keyed by id hash it with id_hash, FNV-1a, so they all agree.
+//
+
+#ifndef SRC_IDKEY_H
+#define SRC_IDKEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ID_KEY_BYTES 8
+
+uint64_t id_key(const char* id);
+uint64_t id_key_tail(const char* id);
+bool id_key_whole(const char* id);
+size_t rank_id_key(const uint64_t* heads, const uint64_t* tails, size_t n,
+        uint64_t head, uint64_t tail);
+const char* id_key_method(void);
+uint32_t id_hash(const char* id);
+
+#endif //SRC_IDKEY_H
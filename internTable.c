@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "internTable.h"
+#include "idKey.h"
+
+#define INITIAL_SLOTS 64
+
+// Return a new slot array of the given size, a power of two, all empty.
+static InternSlots* new_slots(uint32_t size) {
+
+    InternSlots* slots = malloc(sizeof(InternSlots));
+    slots->entries = calloc(size, sizeof(InternEntry*));
+    slots->mask = size - 1;
+    slots->older = NULL;
+    return slots;
+}
+
+// Initialise an empty intern table and return it.
+InternTable* init_intern_table(void) {
+
+    InternTable* table = malloc(sizeof(InternTable));
+    for (int i = 0; i < INTERN_SHARDS; ++i) {
+        InternShard* shard = &table->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->slots = new_slots(INITIAL_SLOTS);
+        shard->count = 0;
+        init_arena(&shard->ids);
+    }
+    return table;
+}
+
+// Free table, its slot arrays old and new and every id it interned. No one
+// may be using it or any id from it.
+void free_intern_table(InternTable* table) {
+
+    for (int i = 0; i < INTERN_SHARDS; ++i) {
+        InternShard* shard = &table->shards[i];
+        InternSlots* slots = shard->slots;
+        while (slots) {
+            InternSlots* older = slots->older;
+            free(slots->entries);
+            free(slots);
+            slots = older;
+        }
+        free_arena(&shard->ids);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(table);
+}
+
+// Return the shard that owns ids with the given hash.
+static InternShard* shard_for_hash(InternTable* table, uint32_t hash) {
+    return &table->shards[hash >> (32 - INTERN_SHARD_BITS)];
+}
+
+// Return the canonical copy of id in slots, or NULL if it isn't there.
+static const char* probe(InternSlots* slots, const char* id, uint32_t hash) {
+
+    for (uint32_t i = hash & slots->mask; ; i = (i + 1) & slots->mask) {
+        // pairs with the release in publish, so the entry is complete
+        InternEntry* entry = __atomic_load_n(&slots->entries[i],
+                __ATOMIC_ACQUIRE);
+        if (!entry) {
+            return NULL;
+        } else if (entry->hash == hash && !strcmp(entry->id, id)) {
+            return entry->id;
+        }
+    }
+}
+
+// Put entry in the first empty slot of slots for its hash.
+static void publish(InternSlots* slots, InternEntry* entry) {
+
+    uint32_t i = entry->hash & slots->mask;
+    while (slots->entries[i]) {
+        i = (i + 1) & slots->mask;
+    }
+    __atomic_store_n(&slots->entries[i], entry, __ATOMIC_RELEASE);
+}
+
+// Replace shard's slots with ones twice the size. The old ones stay on the
+// chain for readers that loaded them before the swap. Call with
+// shard->lock held.
+static void grow_slots(InternShard* shard) {
+
+    InternSlots* old = shard->slots;
+    InternSlots* slots = new_slots((old->mask + 1) * 2);
+    for (uint32_t i = 0; i <= old->mask; ++i) {
+        if (old->entries[i]) {
+            publish(slots, old->entries[i]);
+        }
+    }
+    slots->older = old;
+    __atomic_store_n(&shard->slots, slots, __ATOMIC_RELEASE);
+}
+
+// Return the canonical copy of id, adding it to table if add is true, or
+// NULL if it isn't there and add is false.
+static const char* lookup(InternTable* table, const char* id, bool add) {
+
+    uint32_t hash = id_hash(id);
+    InternShard* shard = shard_for_hash(table, hash);
+    const char* found = probe(__atomic_load_n(&shard->slots,
+            __ATOMIC_ACQUIRE), id, hash);
+    if (found) {
+        return found;
+    }
+
+    // the slots read above may have been outgrown since, so only a miss
+    // under the lock is a real one
+    pthread_mutex_lock(&shard->lock);
+    found = probe(shard->slots, id, hash);
+    if (!found && add) {
+        if ((shard->count + 1) * 4 > (size_t)(shard->slots->mask + 1) * 3) {
+            grow_slots(shard);
+        }
+        size_t len = strlen(id);
+        InternEntry* entry = arena_alloc(&shard->ids,
+                sizeof(InternEntry) + len + 1);
+        entry->hash = hash;
+        memcpy(entry->id, id, len + 1);
+        publish(shard->slots, entry);
+        shard->count++;
+        found = entry->id;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+// Return table's canonical copy of id, adding one first if it has none.
+// The copy is valid until the table is freed.
+const char* intern_id(InternTable* table, const char* id) {
+    return lookup(table, id, true);
+}
+
+// Return table's canonical copy of id, or NULL if it has never been
+// interned.
+const char* find_interned(InternTable* table, const char* id) {
+    return lookup(table, id, false);
+}
+
+// Return the number of distinct ids in table.
+size_t count_interned(InternTable* table) {
+
+    size_t count = 0;
+    for (int i = 0; i < INTERN_SHARDS; ++i) {
+        InternShard* shard = &table->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        count += shard->count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return count;
+}
+
+// Add the allocation counters of table's ids to total.
+void add_intern_stats(InternTable* table, ArenaStats* total) {
+
+    for (int i = 0; i < INTERN_SHARDS; ++i) {
+        InternShard* shard = &table->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        add_arena_stats(total, &shard->ids.stats);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,59 @@
+//
+// Concurrent intern table for ids - one canonical copy of each distinct id,
+// which stays put until the table is freed, so callers can hold on to it
+// and tell ids apart by pointer. Memory grows with the distinct ids seen,
+// however often each comes back.
+//
+// The table is split into INTERN_SHARDS shards by hash, each an open
+// addressing table of entries in its own arena. Looking up an id that is
+// already there takes no lock: readers probe whichever slot array is
+// published, and an entry is only published once it is complete. Adding an
+// id takes its shard's lock, and a miss is checked again under it before
+// adding. Slot arrays outgrown by a shard are kept until the table is
+// freed, since a reader may still be probing one.
+//
+
+#ifndef SRC_INTERNTABLE_H
+#define SRC_INTERNTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "arena.h"
+
+#define INTERN_SHARD_BITS 4
+#define INTERN_SHARDS (1 << INTERN_SHARD_BITS)
+
+// An interned id, as kept in a shard's arena
+typedef struct {
+    uint32_t hash;
+    char id[];
+} InternEntry;
+
+// A shard's slots, NULL where empty. Replaced by a copy twice the size
+// when it gets too full.
+typedef struct InternSlots {
+    InternEntry** entries;
+    uint32_t mask; // slots - 1, slots being a power of two
+    struct InternSlots* older; // outgrown, kept for readers still on it
+} InternSlots;
+
+typedef struct {
+    pthread_mutex_t lock; // serialises adding ids
+    InternSlots* slots; // published for lock free readers
+    size_t count;
+    Arena ids;
+} InternShard;
+
+typedef struct {
+    InternShard shards[INTERN_SHARDS];
+} InternTable;
+
+InternTable* init_intern_table(void);
+void free_intern_table(InternTable* table);
+const char* intern_id(InternTable* table, const char* id);
+const char* find_interned(InternTable* table, const char* id);
+size_t count_interned(InternTable* table);
+void add_intern_stats(InternTable* table, ArenaStats* total);
+
+#endif //SRC_INTERNTABLE_H
@@ -0,0 +1,601 @@
+//
+// Load generator and latency benchmark for the whole system. Starts a
+// mapper and a number of controls on localhost, then drives them with a
+// swarm of simulated rocs for a while. Each roc looks up a random route of
+// controls at the mapper, pipelined as roc does, and visits each of them;
+// every EXTRA_EVERY rocs one also registers an airport, fetches a control's
+// log and the mapper's dump. Rocs start at a fixed rate, or back to back
+// if no rate is given, and a roc's latency is measured from when it was due
+// to start so a stalled system can't hide its queueing delay.
+//
+// Prints one JSON object per line on stdout: the run's settings, then
+// throughput and an HDR histogram of latencies in microseconds for each
+// operation type.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "buffer.h"
+#include "histogram.h"
+#include "mapperProtocol.h"
+
+#define DEFAULT_CONTROLS 8
+#define DEFAULT_THREADS 8
+#define DEFAULT_SECONDS 5
+#define DEFAULT_ROUTE 4
+#define EXTRA_EVERY 50 // rocs per registration, log and dump
+#define REGISTER_WAIT_MS 5000 // longest to wait for controls to register
+#define NS_PER_US 1000.0
+
+// the operations timed
+typedef enum {
+    BENCH_LOOKUP,
+    BENCH_REGISTER,
+    BENCH_VISIT,
+    BENCH_LOG,
+    BENCH_DUMP,
+    BENCH_ROC,
+    BENCH_OPS
+} BenchOp;
+
+static const char* const opNames[] = {"lookup", "registration", "visit",
+        "log", "dump", "roc"};
+
+// the system under test and how to load it
+typedef struct {
+    bool eventLoop; // run the mapper with -e
+    bool binary; // talk in binary frames, as roc -b does
+    int controlCount;
+    int threads;
+    double seconds;
+    double rate; // rocs started per second, 0 for back to back
+    int route; // controls visited per roc
+    struct sockaddr_in addr; // localhost
+    uint16_t mapperPort;
+    char** controlIds;
+    pid_t* pids; // mapper then controls
+    long startNs;
+} Bench;
+
+// One thread of simulated rocs and what it has recorded
+typedef struct {
+    Bench* bench;
+    int index;
+    unsigned seed;
+    long rocs;
+    long failures; // rocs that didn't complete
+    Histogram hists[BENCH_OPS];
+} Swarm;
+
+// Return the monotonic clock in ns.
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Sleep until the monotonic clock reaches ns.
+static void sleep_until(long ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000L;
+    ts.tv_nsec = ns % 1000000000L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) {
+    }
+}
+
+// Run the program in argv with its stdout piped back, and return the first
+// line it prints - the port it listens on - or 0 if it didn't print one.
+static uint16_t spawn(char* const argv[], pid_t* pid) {
+
+    int pipeFds[2];
+    if (pipe(pipeFds)) {
+        return 0;
+    }
+    *pid = fork();
+    if (*pid == 0) {
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(pipeFds[1]);
+
+    // the pipe stays open, so the child never writes to a closed one
+    MsgReader reader;
+    init_reader(&reader, pipeFds[0]);
+    const char* line = read_line(&reader);
+    uint16_t port = line ? atoi(line) : 0;
+    free_reader(&reader);
+    return port;
+}
+
+// Open a blocking connection to port on localhost. Returns the socket or
+// -1.
+static int connect_port(Bench* bench, uint16_t port) {
+
+    struct sockaddr_in addr = bench->addr;
+    addr.sin_port = htons(port);
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd >= 0 &&
+            connect(sockfd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    return sockfd;
+}
+
+// Read a lookup response from reader. Returns the port, or 0 if there is
+// no such airport or the mapper failed.
+static uint16_t read_port(Bench* bench, MsgReader* reader) {
+
+    if (!bench->binary) {
+        const char* line = read_line(reader);
+        return line ? atoi(line) : 0;
+    }
+    Frame frame;
+    if (read_frame(reader, &frame) <= 0 || frame.op != OP_PORT ||
+            frame.len != 2) {
+        return 0;
+    }
+    const unsigned char* port = (const unsigned char*)frame.data;
+    return port[0] << 8 | port[1];
+}
+
+// Append a lookup of id to out.
+static void append_lookup(Bench* bench, Buffer* out, const char* id) {
+
+    if (bench->binary) {
+        append_frame(out, OP_LOOKUP, id, strlen(id) + 1);
+    } else {
+        append_buffer(out, "?", 1);
+        append_str(out, id);
+        append_buffer(out, "\n", 1);
+    }
+}
+
+// Send out, which starts with the hello in binary mode, on a new connection
+// to port and set reader up to read the replies. Returns false if it
+// failed.
+static bool start_request(Bench* bench, uint16_t port, Buffer* out,
+        MsgReader* reader) {
+
+    int sockfd = connect_port(bench, port);
+    if (sockfd < 0) {
+        out->len = 0;
+        return false;
+    }
+    init_reader(reader, sockfd);
+    if (!send_buffer(sockfd, out) ||
+            (bench->binary && read_format(reader) != WIRE_BINARY)) {
+        close(sockfd);
+        free_reader(reader);
+        return false;
+    }
+    return true;
+}
+
+// Close the connection reader was reading replies from.
+static void end_request(MsgReader* reader) {
+    close(reader->fd);
+    free_reader(reader);
+}
+
+// Start a request buffer, with the hello in binary mode.
+static void init_request(Bench* bench, Buffer* out) {
+    init_buffer(out, 256);
+    if (bench->binary) {
+        append_buffer(out, BINARY_HELLO, BINARY_HELLO_LEN);
+    }
+}
+
+// Look up every id in route at the mapper in one pipelined batch, as roc
+// does, setting ports. Each lookup's latency runs from the batch being sent
+// to its answer. Returns false if any failed.
+static bool lookup_route(Swarm* swarm, char** route, uint16_t* ports) {
+
+    Bench* bench = swarm->bench;
+    Buffer out;
+    init_request(bench, &out);
+    for (int i = 0; i < bench->route; ++i) {
+        append_lookup(bench, &out, route[i]);
+    }
+
+    MsgReader reader;
+    long start = now_ns();
+    bool connected = start_request(bench, bench->mapperPort, &out, &reader);
+    bool ok = connected;
+    for (int i = 0; ok && i < bench->route; ++i) {
+        ports[i] = read_port(bench, &reader);
+        record_value(&swarm->hists[BENCH_LOOKUP], now_ns() - start);
+        ok = ports[i] != 0;
+    }
+    if (connected) {
+        end_request(&reader);
+    }
+    free_buffer(&out);
+    return ok;
+}
+
+// Visit the control at port as plane id over a connection of its own.
+// Returns false if it failed.
+static bool visit(Swarm* swarm, uint16_t port, const char* id) {
+
+    Bench* bench = swarm->bench;
+    Buffer out;
+    init_request(bench, &out);
+    if (bench->binary) {
+        append_frame(&out, OP_ARRIVE, id, strlen(id) + 1);
+    } else {
+        append_str(&out, id);
+        append_buffer(&out, "\n", 1);
+    }
+
+    MsgReader reader;
+    long start = now_ns();
+    bool ok = start_request(bench, port, &out, &reader);
+    if (ok) {
+        Frame frame;
+        ok = bench->binary ? read_frame(&reader, &frame) > 0 &&
+                frame.op == OP_INFO : read_line(&reader) != NULL;
+        end_request(&reader);
+    }
+    if (ok) {
+        record_value(&swarm->hists[BENCH_VISIT], now_ns() - start);
+    }
+    free_buffer(&out);
+    return ok;
+}
+
+// Register a new airport at port and time until a lookup sees it - a
+// registration has no reply of its own. Returns false if it failed.
+static bool register_airport(Swarm* swarm, uint16_t port) {
+
+    Bench* bench = swarm->bench;
+    char id[48];
+    snprintf(id, sizeof(id), "BENCH%d-%ld", swarm->index, swarm->rocs);
+
+    Buffer out;
+    init_request(bench, &out);
+    if (bench->binary) {
+        char data[sizeof(id) + 2];
+        data[0] = port >> 8;
+        data[1] = port & 0xff;
+        strcpy(data + 2, id);
+        append_frame(&out, OP_REGISTER, data, strlen(id) + 3);
+    } else {
+        char line[sizeof(id) + 16];
+        snprintf(line, sizeof(line), "!%s:%u\n", id, port);
+        append_str(&out, line);
+    }
+    append_lookup(bench, &out, id);
+
+    MsgReader reader;
+    long start = now_ns();
+    bool ok = start_request(bench, bench->mapperPort, &out, &reader);
+    if (ok) {
+        ok = read_port(bench, &reader) == port;
+        end_request(&reader);
+    }
+    if (ok) {
+        record_value(&swarm->hists[BENCH_REGISTER], now_ns() - start);
+    }
+    free_buffer(&out);
+    return ok;
+}
+
+// Fetch the log of the control at port, or with port the mapper's, the
+// dump, and time until all of it has arrived. Returns false if it failed.
+static bool fetch_listing(Swarm* swarm, uint16_t port, BenchOp op) {
+
+    Bench* bench = swarm->bench;
+    Buffer out;
+    init_request(bench, &out);
+    if (bench->binary) {
+        append_frame(&out, op == BENCH_LOG ? OP_LOG : OP_LIST, NULL, 0);
+    } else {
+        append_str(&out, op == BENCH_LOG ? "log\n" : "@\n");
+    }
+
+    MsgReader reader;
+    long start = now_ns();
+    bool connected = start_request(bench, port, &out, &reader);
+    bool ok = connected;
+    if (ok && bench->binary) {
+        Frame frame;
+        ok = read_frame(&reader, &frame) > 0;
+    } else if (ok && op == BENCH_LOG) {
+        // the log ends with a line holding just a dot
+        const char* line;
+        while ((line = read_line(&reader)) && strcmp(line, ".")) {
+        }
+        ok = line != NULL;
+    } else if (ok) {
+        // the dump ends when the mapper sees we have nothing more to send
+        shutdown(reader.fd, SHUT_WR);
+        while (read_line(&reader)) {
+        }
+    }
+    if (connected) {
+        end_request(&reader);
+    }
+    if (ok) {
+        record_value(&swarm->hists[op], now_ns() - start);
+    }
+    free_buffer(&out);
+    return ok;
+}
+
+// Run one simulated roc, due to start at due. Returns false if any of it
+// failed.
+static bool run_roc(Swarm* swarm, long due) {
+
+    Bench* bench = swarm->bench;
+    char** route = malloc(sizeof(char*) * bench->route);
+    uint16_t* ports = malloc(sizeof(uint16_t) * bench->route);
+    char planeId[32];
+    snprintf(planeId, sizeof(planeId), "PLANE%d", swarm->index);
+
+    for (int i = 0; i < bench->route; ++i) {
+        route[i] = bench->controlIds[rand_r(&swarm->seed) %
+                bench->controlCount];
+    }
+    bool ok = lookup_route(swarm, route, ports);
+    for (int i = 0; ok && i < bench->route; ++i) {
+        ok = visit(swarm, ports[i], planeId);
+    }
+
+    if (ok && swarm->rocs % EXTRA_EVERY == 0) {
+        ok = register_airport(swarm, ports[0]) &&
+                fetch_listing(swarm, ports[0], BENCH_LOG) &&
+                fetch_listing(swarm, bench->mapperPort, BENCH_DUMP);
+    }
+    if (ok) {
+        record_value(&swarm->hists[BENCH_ROC], now_ns() - due);
+    }
+
+    free(route);
+    free(ports);
+    return ok;
+}
+
+// Thread function - run rocs one after another until the time is up, each
+// due its share of the rate after the last.
+static void* run_swarm(void* arg) {
+
+    Swarm* swarm = arg;
+    Bench* bench = swarm->bench;
+    long endNs = bench->startNs + (long)(bench->seconds * 1e9);
+    long interval = bench->rate > 0 ? (long)(1e9 * bench->threads /
+            bench->rate) : 0;
+    long due = bench->startNs + interval * swarm->index / bench->threads;
+
+    while (true) {
+        if (interval) {
+            sleep_until(due);
+        } else {
+            due = now_ns();
+        }
+        if (due >= endNs) {
+            break;
+        }
+        if (!run_roc(swarm, due)) {
+            swarm->failures++;
+        }
+        swarm->rocs++;
+        due += interval;
+    }
+    return NULL;
+}
+
+// Start the mapper and the controls, and wait until every control can be
+// looked up. Exits if any of it fails.
+static void start_system(Bench* bench) {
+
+    bench->pids = calloc(bench->controlCount + 1, sizeof(pid_t));
+    char* mapperArgs[] = {"./mapper", bench->eventLoop ? "-e" : NULL,
+            NULL};
+    bench->mapperPort = spawn(mapperArgs, &bench->pids[0]);
+    if (!bench->mapperPort) {
+        fprintf(stderr, "can't start ./mapper\n");
+        exit(1);
+    }
+
+    char mapperPort[8];
+    snprintf(mapperPort, sizeof(mapperPort), "%u", bench->mapperPort);
+    bench->controlIds = malloc(sizeof(char*) * bench->controlCount);
+    for (int i = 0; i < bench->controlCount; ++i) {
+        char id[16];
+        snprintf(id, sizeof(id), "CTL%03d", i);
+        bench->controlIds[i] = strdup(id);
+        char* controlArgs[] = {"./control", id, "info", mapperPort, NULL};
+        if (!spawn(controlArgs, &bench->pids[i + 1])) {
+            fprintf(stderr, "can't start ./control\n");
+            exit(1);
+        }
+    }
+
+    // controls register just after printing their port
+    Bench probe = *bench;
+    probe.binary = false;
+    long deadline = now_ns() + REGISTER_WAIT_MS * 1000000L;
+    for (int i = 0; i < bench->controlCount; ++i) {
+        Buffer out;
+        init_buffer(&out, 64);
+        uint16_t port = 0;
+        while (!port && now_ns() < deadline) {
+            append_lookup(&probe, &out, bench->controlIds[i]);
+            MsgReader reader;
+            if (start_request(&probe, bench->mapperPort, &out, &reader)) {
+                port = read_port(&probe, &reader);
+                end_request(&reader);
+            }
+            if (!port) {
+                usleep(10000);
+            }
+        }
+        free_buffer(&out);
+        if (!port) {
+            fprintf(stderr, "%s didn't register\n", bench->controlIds[i]);
+            exit(1);
+        }
+    }
+}
+
+// Stop the mapper and controls.
+static void stop_system(Bench* bench) {
+
+    for (int i = 0; i <= bench->controlCount; ++i) {
+        if (bench->pids[i] > 0) {
+            kill(bench->pids[i], SIGTERM);
+            waitpid(bench->pids[i], NULL, 0);
+        }
+    }
+}
+
+// Print the results of every swarm on stdout, one JSON object per line.
+static void report(Bench* bench, Swarm** swarms, double elapsed) {
+
+    long rocs = 0;
+    long failures = 0;
+    for (int i = 0; i < bench->threads; ++i) {
+        rocs += swarms[i]->rocs;
+        failures += swarms[i]->failures;
+    }
+    printf("{\"controls\":%d,\"threads\":%d,\"seconds\":%.3f,"
+            "\"rate\":%.1f,\"route\":%d,\"binary\":%s,\"eventLoop\":%s,"
+            "\"rocs\":%ld,\"failures\":%ld}\n", bench->controlCount,
+            bench->threads, elapsed, bench->rate, bench->route,
+            bench->binary ? "true" : "false",
+            bench->eventLoop ? "true" : "false", rocs, failures);
+
+    Histogram* merged = malloc(sizeof(Histogram));
+    Buffer line;
+    init_buffer(&line, 4096);
+    for (int op = 0; op < BENCH_OPS; ++op) {
+        init_histogram(merged);
+        for (int i = 0; i < bench->threads; ++i) {
+            merge_histogram(merged, &swarms[i]->hists[op]);
+        }
+
+        char head[96];
+        snprintf(head, sizeof(head), "{\"op\":\"%s\",\"perSecond\":%.1f,",
+                opNames[op], merged->total / elapsed);
+        append_str(&line, head);
+        append_histogram_json(&line, merged, NS_PER_US);
+        append_str(&line, "}\n");
+        fwrite(line.data, 1, line.len, stdout);
+        line.len = 0;
+    }
+    free_buffer(&line);
+    free(merged);
+    fflush(stdout);
+}
+
+// Parse the command line into bench. Exits with a usage message if it is
+// invalid.
+static void parse_options(int argc, char** argv, Bench* bench) {
+
+    bench->eventLoop = false;
+    bench->binary = false;
+    bench->controlCount = DEFAULT_CONTROLS;
+    bench->threads = DEFAULT_THREADS;
+    bench->seconds = DEFAULT_SECONDS;
+    bench->rate = 0;
+    bench->route = DEFAULT_ROUTE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ebc:t:d:r:n:")) != -1) {
+        switch (opt) {
+            case 'e':
+                bench->eventLoop = true;
+                break;
+            case 'b':
+                bench->binary = true;
+                break;
+            case 'c':
+                bench->controlCount = atoi(optarg);
+                break;
+            case 't':
+                bench->threads = atoi(optarg);
+                break;
+            case 'd':
+                bench->seconds = atof(optarg);
+                break;
+            case 'r':
+                bench->rate = atof(optarg);
+                break;
+            case 'n':
+                bench->route = atoi(optarg);
+                break;
+            default:
+                bench->threads = 0;
+                break;
+        }
+    }
+
+    if (bench->controlCount < 1 || bench->threads < 1 ||
+            bench->seconds <= 0 || bench->rate < 0 || bench->route < 1) {
+        fprintf(stderr, "Usage: loadbench [-e] [-b] [-c controls] "
+                "[-t threads] [-d seconds] [-r rocs/s] [-n route]\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv) {
+
+    Bench bench;
+    parse_options(argc, argv, &bench);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct addrinfo hints;
+    struct addrinfo* ai = 0;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("localhost", NULL, &hints, &ai)) {
+        fprintf(stderr, "can't resolve localhost\n");
+        return 1;
+    }
+    memcpy(&bench.addr, ai->ai_addr, sizeof(struct sockaddr_in));
+    freeaddrinfo(ai);
+
+    start_system(&bench);
+
+    Swarm** swarms = malloc(sizeof(Swarm*) * bench.threads);
+    pthread_t* threads = malloc(sizeof(pthread_t) * bench.threads);
+    bench.startNs = now_ns();
+    for (int i = 0; i < bench.threads; ++i) {
+        swarms[i] = calloc(1, sizeof(Swarm));
+        swarms[i]->bench = &bench;
+        swarms[i]->index = i;
+        swarms[i]->seed = i + 1;
+        for (int op = 0; op < BENCH_OPS; ++op) {
+            init_histogram(&swarms[i]->hists[op]);
+        }
+        pthread_create(&threads[i], 0, run_swarm, swarms[i]);
+    }
+    for (int i = 0; i < bench.threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (now_ns() - bench.startNs) / 1e9;
+
+    stop_system(&bench);
+    report(&bench, swarms, elapsed);
+
+    for (int i = 0; i < bench.threads; ++i) {
+        free(swarms[i]);
+    }
+    free(swarms);
+    free(threads);
+    return 0;
+}
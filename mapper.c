@@ -6,11 +6,13 @@
 #include <netdb.h>
 #include <stdbool.h>
 #include <semaphore.h>
-#include "mapperProtocol.h"
-#include "airport.h"
+#include "mapper.h"
+#include "rcu.h"
+#include "preload.h"
+#include "trace.h"
 
-#define ARGC 1
 #define SERVER_FAILURE 1
+#define INV_ARGS 1
 #define NO_OF_CONNS 128
 #if (DEBUG | CONST_PORT)
 #define PORT "12000" //for debugging on a constant port
@@ -18,22 +20,33 @@
 #define PORT 0
 #endif
 
+static const char* const counterNames[] = {"requests.lookup",
+        "requests.register", "requests.bulk_register", "bulk.entries",
+        "requests.list", "requests.delta", "delta.snapshots",
+        "requests.range", "requests.stats", "requests.invalid", "bytes.in",
+        "bytes.out", "connections.open", "threads.alive", "lock.acquired",
+        "lock.wait_ns", "lock.hold_ns"};
+static const char* const histNames[] = {"latency.lookup",
+        "latency.register", "latency.bulk_register", "latency.list",
+        "latency.delta", "latency.range"};
+
 typedef struct sockaddr SockAddr;
 typedef struct addrinfo AddrInfo;
 
-// core components of a mapper
-typedef struct Mapper {
-    int sockfd;
-    AirportList apList;
-    sem_t lock;
-} Mapper;
-
 // Used for packing data into thread function
 typedef struct ThreadData {
     int connFd;
     Mapper* mapper;
 } ThreadData;
 
+// startup options
+typedef struct {
+    bool eventLoop; // serve with epoll loops rather than thread per conn
+    int loopCount;
+    const char* storePath; // file to persist airports in, or NULL
+    const char* preloadPath; // file of airports to register first, or NULL
+} Options;
+
 // Find an ephemeral port, initialise addrHints. If getting address info
 // fails exit with code SERVER_FAILURE, else return addrInfo pointer
 AddrInfo* find_ephemeral_port(AddrInfo** addrInfo, AddrInfo* addrHints) {
@@ -94,91 +107,379 @@ int init_server(void) {
     return sockfd;
 }
 
-// Search mapper for the requested data as per the contents of msg & respond to
-// the request by printing to file.
-void handle_port_request(Mapper* mapper, MapperMsg msg, FILE* file) {
+// Search mapper for the requested data as per the contents of msg & append
+// the response to out, framed if binary.
+void handle_port_request(Mapper* mapper, MapperMsg msg, Buffer* out,
+        bool binary) {
 
-    // find requested data
-    sem_wait(&mapper->lock);
+    // find requested data - the airport is only valid until rcu_read_unlock
+    // so copy the response out while still inside the read side section
+    rcu_read_lock();
     Airport* airport = get_airport(mapper->apList, msg.args.id);
-    sem_post(&mapper->lock);
+    TRACE2(mapper, lookup, msg.args.id, airport != NULL);
 
     // respond to the port request
-    if (airport) {
-        fprintf(file, "%s\n", airport->port);
-        fflush(file);
+    if (binary && airport) {
+        char port[2] = {airport->portNo >> 8, airport->portNo & 0xff};
+        append_frame(out, OP_PORT, port, sizeof(port));
+    } else if (binary) {
+        append_frame(out, OP_NO_PORT, NULL, 0);
+    } else if (airport) {
+        append_str(out, airport->port);
+        append_buffer(out, "\n", 1);
     } else {
-        fprintf(file, ";\n");
-        fflush(file);
+        append_buffer(out, ";\n", 2);
     }
+    rcu_read_unlock();
+}
+
+// Take mapper's writer lock. Returns when it was taken, for unlock_writers.
+uint64_t lock_writers(Mapper* mapper) {
+
+    uint64_t start = stats_clock();
+    sem_wait(&mapper->lock);
+    uint64_t locked = stats_clock();
+    TRACE1(mapper, lock_acquire, locked - start);
+    add_stat(mapper->stats, STAT_LOCK_ACQUIRED, 1);
+    add_stat(mapper->stats, STAT_LOCK_WAIT_NS, locked - start);
+    return locked;
+}
+
+// Release mapper's writer lock, taken at locked.
+void unlock_writers(Mapper* mapper, uint64_t locked) {
 
+    sem_post(&mapper->lock);
+    TRACE0(mapper, lock_release);
+    add_stat(mapper->stats, STAT_LOCK_HOLD_NS, stats_clock() - locked);
 }
 
 // Check if the airport id contained within the msg is already in mapper's
 // list. If it is, ignore it otherwise add it. Thread-safe
 void handle_add_airport(Mapper* mapper, MapperMsg msg) {
 
-    sem_wait(&mapper->lock);
+    // unlocked check so duplicate registrations don't queue behind writers
+    rcu_read_lock();
     Airport* existingAirport = get_airport(mapper->apList, msg.args.id);
-    sem_post(&mapper->lock);
+    rcu_read_unlock();
 
     //if airport is already in list, ignore command
     if (existingAirport != NULL) {
         return;
     }
 
+    // add_airport copies the strings out of the reader. Ports are kept as
+    // text, the form they are listed in
+    char port[8];
+    if (!msg.args.port) {
+        snprintf(port, sizeof(port), "%u", msg.args.portNo);
+    }
     Airport airport;
     airport.id = msg.args.id;
-    airport.port = msg.args.port;
+    airport.port = msg.args.port ? msg.args.port : port;
     airport.info = NULL;
 
-    // otherwise add airport to the airport list
-    sem_wait(&mapper->lock);
+    // otherwise add airport to the airport list, add_airport ignores it if
+    // another writer got there first
+    uint64_t locked = lock_writers(mapper);
     add_airport(mapper->apList, airport);
+    unlock_writers(mapper, locked);
+}
+
+// Register every entry of the bulk registration msg under a single hold of
+// the writer lock, and append the ack to out: a BulkStatus per entry, on
+// one line or framed if binary.
+void handle_bulk_register(Mapper* mapper, MapperMsg msg, Buffer* out,
+        bool binary) {
+
+    int cap = 64;
+    int count = 0;
+    Airport* airports = malloc(sizeof(Airport) * cap);
+
+    BulkCursor cursor;
+    MapperMsgArgs entry;
+    init_bulk_cursor(&cursor, &msg.args, binary);
+    while (next_bulk_entry(&cursor, &entry)) {
+        if (count == cap) {
+            cap *= 2;
+            airports = realloc(airports, sizeof(Airport) * cap);
+        }
+        airports[count].id = entry.id;
+        airports[count].port = entry.port;
+        airports[count].portNo = entry.portNo;
+        airports[count++].info = NULL;
+    }
+
+    // binary ports are kept as text too, the form they are listed in
+    char (*ports)[8] = malloc(sizeof(*ports) * (count ? count : 1));
+    char* status = malloc(count ? count : 1);
+    for (int i = 0; i < count; ++i) {
+        if (!airports[i].port && airports[i].portNo) {
+            snprintf(ports[i], sizeof(*ports), "%u", airports[i].portNo);
+            airports[i].port = ports[i];
+        }
+        status[i] = airports[i].id && *airports[i].id && airports[i].port &&
+                *airports[i].port ? BULK_ADDED : BULK_INVALID;
+    }
+
+    // as with single registrations, ids already present are answered
+    // without queueing behind writers
+    rcu_read_lock();
+    int fresh = 0;
+    for (int i = 0; i < count; ++i) {
+        if (status[i] == BULK_INVALID) {
+            continue;
+        } else if (get_airport(mapper->apList, airports[i].id)) {
+            status[i] = BULK_EXISTS;
+        } else {
+            airports[fresh++] = airports[i];
+        }
+    }
+    rcu_read_unlock();
+
+    bool* added = malloc(sizeof(bool) * (fresh ? fresh : 1));
+    if (fresh) {
+        uint64_t locked = lock_writers(mapper);
+        add_airports(mapper->apList, airports, fresh, added);
+        unlock_writers(mapper, locked);
+    }
+    // the fresh ones are the BULK_ADDED ones, in order
+    for (int i = 0, j = 0; i < count; ++i) {
+        if (status[i] == BULK_ADDED && !added[j++]) {
+            status[i] = BULK_EXISTS;
+        }
+    }
+
+    if (binary) {
+        append_frame(out, OP_ACK, status, count);
+    } else {
+        append_buffer(out, status, count);
+        append_buffer(out, "\n", 1);
+    }
+    add_stat(mapper->stats, STAT_BULK_ENTRIES, count);
+    free(added);
+    free(status);
+    free(ports);
+    free(airports);
+}
+
+// Answer the @since request msg: append to out the changes to the map since
+// the version it gives or, if they aren't all journaled any more, the
+// full listing - either headed by the version it brings the client up to.
+void handle_delta(Mapper* mapper, MapperMsg msg, MapperOut* out) {
+
+    Buffer changes;
+    init_buffer(&changes, 4096);
+    uint64_t version;
+    char header[48];
+    int headerLen;
+
+    if (append_airport_changes(mapper->apList, msg.args.since, &changes,
+            &version)) {
+        headerLen = snprintf(header, sizeof(header), "delta %llu\n",
+                (unsigned long long)version);
+        if (out->binary) {
+            append_frame_header(&out->text, OP_DELTA,
+                    headerLen + changes.len);
+        }
+        append_buffer(&out->text, header, headerLen);
+        append_buffer(&out->text, changes.data, changes.len);
+
+    } else {
+        // the shared listing, sent without copying. It may hold changes
+        // after its version; applying those again does no harm
+        AirportDump* dump = get_airport_dump(mapper->apList);
+        headerLen = snprintf(header, sizeof(header), "snapshot %llu\n",
+                (unsigned long long)dump->version);
+        if (out->binary) {
+            append_frame_header(&out->text, OP_DELTA, headerLen + dump->len);
+        }
+        append_buffer(&out->text, header, headerLen);
+        append_dump(out, dump);
+        add_stat(mapper->stats, STAT_SNAPSHOTS, 1);
+    }
+
+    if (!out->binary) {
+        append_buffer(&out->text, ".\n", 2);
+    }
+    free_buffer(&changes);
+}
+
+// Answer the @range or @prefix request msg: append to out the airports it
+// asks for, then if its limit left some out a line giving the id to carry
+// on from.
+void handle_range(Mapper* mapper, MapperMsg msg, MapperOut* out) {
+
+    AirportRange range;
+    range.from = msg.args.id;
+    range.to = msg.args.to;
+    range.prefix = msg.args.prefix;
+    range.limit = msg.args.limit;
+
+    Buffer page;
+    init_buffer(&page, 4096);
+    rcu_read_lock();
+    Airport* more = append_airport_range(mapper->apList, &range, &page);
+    if (more) {
+        append_str(&page, "more ");
+        append_str(&page, more->id);
+        append_buffer(&page, "\n", 1);
+    }
+    rcu_read_unlock();
+
+    if (out->binary) {
+        append_frame(&out->text, OP_PAGE, page.data, page.len);
+    } else {
+        append_buffer(&out->text, page.data, page.len);
+        append_buffer(&out->text, ".\n", 2);
+    }
+    free_buffer(&page);
+}
+
+// Append mapper's # report to out: its counters and latencies, then the
+// table's size and memory, ended by a line holding just a dot - or framed
+// if binary.
+void handle_stats(Mapper* mapper, Buffer* out, bool binary) {
+
+    Buffer report;
+    init_buffer(&report, 4096);
+    append_stats(mapper->stats, &report);
+
+    // only the writers change these
+    sem_wait(&mapper->lock);
+    ArenaStats memory = get_airport_stats(mapper->apList);
+    append_stat(&report, "airports", mapper->apList->count);
     sem_post(&mapper->lock);
+    append_stat(&report, "memory.in_use", memory.inUse);
+    append_stat(&report, "memory.reserved", memory.reserved);
+
+    if (binary) {
+        append_frame(out, OP_REPORT, report.data, report.len);
+    } else {
+        append_buffer(out, report.data, report.len);
+        append_buffer(out, ".\n", 2);
+    }
+    free_buffer(&report);
 }
 
-// Given, mapper and file, handle the msg in the relevant way depending on its
-// type. If the message suggests the connection is closed then kill the
-// current thread with pthread_exit.
-void process_message(Mapper* mapper, MapperMsg msg, FILE* file) {
+// Given mapper, handle the msg in the relevant way depending on its type and
+// append any response to out. Shared by every server mode.
+void process_request(Mapper* mapper, MapperMsg msg, MapperOut* out) {
+
+    uint64_t start = stats_clock();
+    Stats* stats = mapper->stats;
+    TRACE2(mapper, request, msg.type, msg.args.id);
 
     switch (msg.type) {
         case PORT_REQUEST:
-            handle_port_request(mapper, msg, file);
+            handle_port_request(mapper, msg, &out->text, out->binary);
+            add_stat(stats, STAT_LOOKUPS, 1);
+            record_latency(stats, LATENCY_LOOKUP, stats_clock() - start);
             break;
         case ADD_AIRPORT:
             handle_add_airport(mapper, msg);
+            add_stat(stats, STAT_REGISTRATIONS, 1);
+            record_latency(stats, LATENCY_REGISTER, stats_clock() - start);
             break;
-        case INFO_REQUEST:
-            sem_wait(&mapper->lock);
-            print_airport_list(mapper->apList, file);
-            sem_post(&mapper->lock);
+        case BULK_REGISTER:
+            handle_bulk_register(mapper, msg, &out->text, out->binary);
+            add_stat(stats, STAT_BULK_REGISTRATIONS, 1);
+            record_latency(stats, LATENCY_BULK_REGISTER,
+                    stats_clock() - start);
+            break;
+        case INFO_REQUEST: {
+            // shared pre-serialised listing, sent without copying
+            AirportDump* dump = get_airport_dump(mapper->apList);
+            if (out->binary) {
+                append_frame_header(&out->text, OP_LISTING, dump->len);
+            }
+            append_dump(out, dump);
+            add_stat(stats, STAT_LISTINGS, 1);
+            record_latency(stats, LATENCY_LIST, stats_clock() - start);
+            break;
+        }
+        case DELTA_REQUEST:
+            handle_delta(mapper, msg, out);
+            add_stat(stats, STAT_DELTAS, 1);
+            record_latency(stats, LATENCY_DELTA, stats_clock() - start);
             break;
+        case RANGE_REQUEST:
+            handle_range(mapper, msg, out);
+            add_stat(stats, STAT_RANGES, 1);
+            record_latency(stats, LATENCY_RANGE, stats_clock() - start);
+            break;
+        case STATS_REQUEST:
+            handle_stats(mapper, &out->text, out->binary);
+            add_stat(stats, STAT_STATS, 1);
+            break;
+        case INVALID_MSG:
         case CONN_CLOSED:
-            pthread_exit(NULL);
+        default:
+            add_stat(stats, STAT_INVALID, 1);
+            break;
+    }
+}
+
+// Set out up for a connection that has turned out to speak format,
+// acknowledging a binary hello.
+void start_format(WireFormat format, MapperOut* out) {
+
+    out->binary = format == WIRE_BINARY;
+    if (out->binary) {
+        append_buffer(&out->text, BINARY_HELLO, BINARY_HELLO_LEN);
     }
 }
 
-// Thread function - unpack data pointed to by arg, wrap file descriptors in
-// FILE pointers, read and process incoming requests/messages.
+// Thread function - unpack data pointed to by arg, read and process
+// incoming requests/messages until the connection is closed. Responses to
+// every request that arrived together are sent together.
 void* handle_conn(void* arg) {
 
     // unpack the struct pointed to by void*
     ThreadData* threadData = arg;
     Mapper* mapper = threadData->mapper;
     int connFd = threadData->connFd;
+    free(threadData);
+
+    MsgReader reader;
+    init_reader(&reader, connFd);
+    MapperOut out;
+    init_out(&out);
+    add_stat(mapper->stats, STAT_THREADS, 1);
+    add_stat(mapper->stats, STAT_CONNECTIONS, 1);
+    WireFormat format = read_format(&reader);
+    start_format(format, &out);
+    uint64_t counted = 0; // bytes read already counted
+
+    while (format != WIRE_PENDING) {
+        MapperMsg msg;
+
+        if (next_message(&reader, format, &msg)) {
+            if (msg.type == CONN_CLOSED) {
+                send_out(connFd, &out); // answer what came before it
+                break;
+            }
+            process_request(mapper, msg, &out);
+            continue;
+        }
 
-    // wrap file descriptors in FILE*
-    int connFdCopy = dup(connFd);
-    FILE* mapperIn = fdopen(connFd, "r");
-    FILE* mapperOut = fdopen(connFdCopy, "w");
-
-    // exits internally via pthread_exit
-    while (true) {
-        MapperMsg msg = read_message(mapperIn);
-        process_message(mapper, msg, mapperOut);
+        // all pipelined requests handled - answer them in one write before
+        // waiting for more
+        add_stat(mapper->stats, STAT_BYTES_IN, reader.bytesRead - counted);
+        add_stat(mapper->stats, STAT_BYTES_OUT, out_len(&out));
+        counted = reader.bytesRead;
+        TRACE2(mapper, flush, connFd, out_len(&out));
+        if (!send_out(connFd, &out) || fill_reader(&reader) <= 0) {
+            break;
+        }
     }
+
+    add_stat(mapper->stats, STAT_BYTES_IN, reader.bytesRead - counted);
+    add_stat(mapper->stats, STAT_CONNECTIONS, -1);
+    add_stat(mapper->stats, STAT_THREADS, -1);
+    free_out(&out);
+    free_reader(&reader);
+    close(connFd);
+    return NULL;
 }
 
 // Test airport list functionality. Insert, get, remove and print elements in
@@ -214,14 +515,36 @@ void test_airport(Mapper* mapper) {
     }
 }
 
-// Initialise the mapper and return a pointer to it.
-Mapper* init_mapper(void) {
+// Initialise the mapper and return a pointer to it. If options give a
+// store the airports persisted there are loaded, then if they give a
+// preload file its airports are registered, all before the port is
+// announced. If either can't be read exit with code SERVER_FAILURE.
+Mapper* init_mapper(const Options* options) {
 
     Mapper* mapper = malloc(sizeof(Mapper));
 
-    mapper->sockfd = init_server();
     mapper->apList = init_airport_list();
+    if (options->storePath) {
+        AirportStore* store = open_airport_store(options->storePath);
+        if (!store) {
+            fprintf(stderr, "Can't open airport store\n");
+            exit(SERVER_FAILURE);
+        }
+        attach_airport_store(mapper->apList, store);
+    }
+    if (options->preloadPath && preload_airports(mapper->apList,
+            options->preloadPath, options->loopCount) < 0) {
+        fprintf(stderr, "Can't read preload file\n");
+        exit(SERVER_FAILURE);
+    }
+    if (!start_airport_dumps(mapper->apList)) {
+        exit(SERVER_FAILURE);
+    }
+    mapper->sockfd = init_server();
     sem_init(&(mapper->lock), 0, 1);
+    mapper->stats = init_stats(counterNames, MAPPER_COUNTERS, histNames,
+            MAPPER_HISTS);
+    add_stat(mapper->stats, STAT_THREADS, 1); // this one
 
     return mapper;
 }
@@ -231,16 +554,18 @@ Mapper* init_mapper(void) {
 void accept_conns(Mapper* mapper) {
 
     pthread_t threadId;
-    ThreadData* threadData = malloc(sizeof(ThreadData));
 
     while(true) {
 
-        // pack the threadData
+        // pack the threadData - one per thread, freed by handle_conn
+        ThreadData* threadData = malloc(sizeof(ThreadData));
         threadData->mapper = mapper;
         threadData->connFd = accept(mapper->sockfd, 0, 0);
+        TRACE1(mapper, accept, threadData->connFd);
 
         if (threadData->connFd >= 0) {
             pthread_create(&threadId, 0, handle_conn, threadData);
+            pthread_detach(threadId);
 
         } else {
             exit(SERVER_FAILURE);  //todo check if I should exit here?
@@ -248,17 +573,57 @@ void accept_conns(Mapper* mapper) {
     }
 }
 
-int main(int argc, char** argv) {
+// Parse the command line options into options. If they are invalid exit
+// with code INV_ARGS.
+void parse_options(int argc, char** argv, Options* options) {
+
+    options->eventLoop = false;
+    options->loopCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    options->storePath = NULL;
+    options->preloadPath = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "et:f:p:")) != -1) {
+        switch (opt) {
+            case 'e':
+                options->eventLoop = true;
+                break;
+            case 't':
+                options->loopCount = atoi(optarg);
+                if (options->loopCount < 1) {
+                    exit(INV_ARGS);
+                }
+                break;
+            case 'f':
+                options->storePath = optarg;
+                break;
+            case 'p':
+                options->preloadPath = optarg;
+                break;
+            default:
+                exit(INV_ARGS);
+        }
+    }
 
-    if (argc != ARGC) {
-        exit(1); //todo
+    if (optind != argc) {
+        exit(INV_ARGS);
     }
+}
 
-    Mapper* mapper = init_mapper();
+int main(int argc, char** argv) {
+
+    Options options;
+    parse_options(argc, argv, &options);
+
+    Mapper* mapper = init_mapper(&options);
 #if DEBUG
     test_airport(mapper);
 #endif
-    accept_conns(mapper);
+    if (options.eventLoop) {
+        run_event_loops(mapper, options.loopCount);
+    } else {
+        accept_conns(mapper);
+    }
 
     return 0;
 }
@@ -0,0 +1,83 @@
+#ifndef SRC_MAPPER_H
+#define SRC_MAPPER_H
+
+#include <stdbool.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include "airport.h"
+#include "buffer.h"
+#include "mapperProtocol.h"
+#include "stats.h"
+
+// counters reported by a # request
+typedef enum {
+    STAT_LOOKUPS,
+    STAT_REGISTRATIONS,
+    STAT_BULK_REGISTRATIONS,
+    STAT_BULK_ENTRIES,
+    STAT_LISTINGS,
+    STAT_DELTAS,
+    STAT_SNAPSHOTS, // deltas answered with the full listing
+    STAT_RANGES,
+    STAT_STATS,
+    STAT_INVALID,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_CONNECTIONS, // open now
+    STAT_THREADS, // alive now
+    STAT_LOCK_ACQUIRED,
+    STAT_LOCK_WAIT_NS,
+    STAT_LOCK_HOLD_NS,
+    MAPPER_COUNTERS
+} MapperCounter;
+
+// latencies, from a request being parsed to its response being ready
+typedef enum {
+    LATENCY_LOOKUP,
+    LATENCY_REGISTER,
+    LATENCY_BULK_REGISTER,
+    LATENCY_LIST,
+    LATENCY_DELTA,
+    LATENCY_RANGE,
+    MAPPER_HISTS
+} MapperHist;
+
+// core components of a mapper. Lookups read apList lock free, lock only
+// serialises the writers.
+typedef struct Mapper {
+    int sockfd;
+    AirportList apList;
+    sem_t lock;
+    Stats* stats;
+} Mapper;
+
+// A dump spliced into the response text at offset at
+typedef struct {
+    size_t at;
+    AirportDump* dump;
+} DumpRef;
+
+// Responses waiting to be sent on a connection, in request order. Dumps are
+// referenced rather than copied in so everything goes out in one writev.
+typedef struct {
+    Buffer text;
+    DumpRef* dumps;
+    int dumpCount;
+    int dumpCap;
+    size_t dumpBytes;
+    bool binary; // replies go out as frames
+} MapperOut;
+
+void process_request(Mapper* mapper, MapperMsg msg, MapperOut* out);
+void start_format(WireFormat format, MapperOut* out);
+void run_event_loops(Mapper* mapper, int loopCount);
+
+void init_out(MapperOut* out);
+void free_out(MapperOut* out);
+size_t out_len(MapperOut* out);
+void append_dump(MapperOut* out, AirportDump* dump);
+ssize_t write_out(int fd, MapperOut* out, size_t sent);
+void reset_out(MapperOut* out);
+bool send_out(int fd, MapperOut* out);
+
+#endif //SRC_MAPPER_H
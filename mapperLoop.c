@@ -0,0 +1,259 @@
+//
+// Event loop server mode for the mapper. Each loop thread owns an epoll
+// instance and multiplexes its share of the non-blocking connections, so a
+// roc costs a small Conn rather than a thread and two FILE streams.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "mapper.h"
+#include "trace.h"
+
+#define SERVER_FAILURE 1
+#define MAX_EVENTS 64
+#define MAX_PENDING_OUT (1 << 20) // stop reading while this much is unsent
+
+// where a connection is in its lifecycle
+typedef enum {
+    CONN_READING, // parsing requests as they arrive
+    CONN_DRAINING, // peer has closed its end, flush what is left then close
+} ConnState;
+
+// Per-connection state. The reader keeps any partial message between
+// events.
+typedef struct Conn {
+    int fd;
+    ConnState state;
+    WireFormat format; // WIRE_PENDING until the first bytes arrive
+    MsgReader in;
+    MapperOut out;
+    size_t sent;
+    uint32_t interest; // events currently registered with epoll
+} Conn;
+
+// Used for packing data into a loop thread
+typedef struct LoopData {
+    Mapper* mapper;
+    int epollFd;
+} LoopData;
+
+// Put fd into non-blocking mode.
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Close conn and release everything it holds.
+static void close_conn(Mapper* mapper, Conn* conn) {
+    add_stat(mapper->stats, STAT_CONNECTIONS, -1);
+    close(conn->fd);
+    free_reader(&conn->in);
+    free_out(&conn->out);
+    free(conn);
+}
+
+// Register the events conn currently needs, if they have changed. While a
+// lot of output is pending stop reading so a slow reader can't make us
+// buffer without bound.
+static void update_interest(int epollFd, Conn* conn) {
+
+    size_t pending = out_len(&conn->out) - conn->sent;
+    uint32_t interest = 0;
+    if (conn->state == CONN_READING && pending < MAX_PENDING_OUT) {
+        interest |= EPOLLIN;
+    }
+    if (pending > 0) {
+        interest |= EPOLLOUT;
+    }
+
+    if (interest != conn->interest) {
+        struct epoll_event event;
+        event.events = interest;
+        event.data.ptr = conn;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->interest = interest;
+    }
+}
+
+// Write as much pending output as the socket will take. Returns false if the
+// connection failed.
+static bool flush_conn(Mapper* mapper, Conn* conn) {
+
+    size_t len = out_len(&conn->out);
+    if (conn->sent < len) {
+        TRACE2(mapper, flush, conn->fd, len - conn->sent);
+    }
+    while (conn->sent < len) {
+        ssize_t n = write_out(conn->fd, &conn->out, conn->sent);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->sent += n;
+        add_stat(mapper->stats, STAT_BYTES_OUT, n);
+    }
+    reset_out(&conn->out);
+    conn->sent = 0;
+    return true;
+}
+
+// Process every complete message in conn's input, appending the responses
+// to its output. A broken binary stream stops reading from conn.
+static void process_input(Mapper* mapper, Conn* conn) {
+
+    if (conn->format == WIRE_PENDING) {
+        conn->format = next_format(&conn->in);
+        start_format(conn->format, &conn->out);
+    }
+    if (conn->format == WIRE_PENDING) {
+        return;
+    }
+
+    MapperMsg msg;
+    while (next_message(&conn->in, conn->format, &msg)) {
+        if (msg.type == CONN_CLOSED) {
+            conn->state = CONN_DRAINING;
+            return;
+        }
+        process_request(mapper, msg, &conn->out);
+    }
+}
+
+// Read everything available on conn and respond. Returns false if conn has
+// been closed.
+static bool handle_readable(Mapper* mapper, Conn* conn) {
+
+    while (conn->state == CONN_READING) {
+        ssize_t n = fill_reader(&conn->in);
+
+        if (n > 0) {
+            add_stat(mapper->stats, STAT_BYTES_IN, n);
+            process_input(mapper, conn);
+            if (out_len(&conn->out) - conn->sent >= MAX_PENDING_OUT) {
+                break;
+            }
+        } else if (n == 0) {
+            conn->state = CONN_DRAINING;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            close_conn(mapper, conn);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Accept every pending connection on the listening socket and add them to
+// this loop.
+static void accept_pending(Mapper* mapper, int epollFd) {
+
+    while (true) {
+        int connFd = accept(mapper->sockfd, 0, 0);
+        if (connFd < 0) {
+            return; // EAGAIN, or another loop won the race
+        }
+        TRACE1(mapper, accept, connFd);
+        set_nonblocking(connFd);
+
+        Conn* conn = malloc(sizeof(Conn));
+        conn->fd = connFd;
+        conn->state = CONN_READING;
+        conn->format = WIRE_PENDING;
+        init_reader(&conn->in, connFd);
+        init_out(&conn->out);
+        conn->sent = 0;
+        conn->interest = EPOLLIN;
+        add_stat(mapper->stats, STAT_CONNECTIONS, 1);
+
+        struct epoll_event event;
+        event.events = conn->interest;
+        event.data.ptr = conn;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, connFd, &event)) {
+            close_conn(mapper, conn);
+        }
+    }
+}
+
+// Service one connection event. The conn is freed if it is finished with.
+static void handle_event(Mapper* mapper, int epollFd, Conn* conn,
+        uint32_t events) {
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (!handle_readable(mapper, conn)) {
+            return;
+        }
+    }
+
+    if (!flush_conn(mapper, conn)) {
+        close_conn(mapper, conn);
+        return;
+    }
+
+    if (conn->state == CONN_DRAINING && out_len(&conn->out) == conn->sent) {
+        close_conn(mapper, conn);
+        return;
+    }
+    update_interest(epollFd, conn);
+}
+
+// Thread function - run one event loop forever.
+static void* run_loop(void* arg) {
+
+    LoopData* loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    add_stat(loop->mapper->stats, STAT_THREADS, 1);
+
+    while (true) {
+        int n = epoll_wait(loop->epollFd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            exit(SERVER_FAILURE);
+        }
+
+        for (int i = 0; i < n; ++i) {
+            Conn* conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_pending(loop->mapper, loop->epollFd);
+            } else {
+                handle_event(loop->mapper, loop->epollFd, conn,
+                        events[i].events);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Serve the mapper with loopCount event loop threads, one per core by
+// default. Every loop waits on the listening socket; EPOLLEXCLUSIVE wakes
+// just one of them per incoming connection. Never returns.
+void run_event_loops(Mapper* mapper, int loopCount) {
+
+    set_nonblocking(mapper->sockfd);
+    pthread_t* threads = malloc(sizeof(pthread_t) * loopCount);
+
+    for (int i = 0; i < loopCount; ++i) {
+        LoopData* loop = malloc(sizeof(LoopData));
+        loop->mapper = mapper;
+        loop->epollFd = epoll_create1(0);
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL; // the listening socket
+        if (loop->epollFd < 0 ||
+                epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, mapper->sockfd,
+                &event)) {
+            exit(SERVER_FAILURE);
+        }
+        pthread_create(&threads[i], 0, run_loop, loop);
+    }
+
+    for (int i = 0; i < loopCount; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
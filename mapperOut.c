@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "mapper.h"
+
+#define TEXT_SIZE 128
+#define MAX_IOV 64
+
+// Initialise out with nothing pending.
+void init_out(MapperOut* out) {
+    init_buffer(&out->text, TEXT_SIZE);
+    out->dumps = NULL;
+    out->dumpCount = 0;
+    out->dumpCap = 0;
+    out->dumpBytes = 0;
+    out->binary = false;
+}
+
+// Release everything held by out.
+void free_out(MapperOut* out) {
+    reset_out(out);
+    free_buffer(&out->text);
+    free(out->dumps);
+}
+
+// Return the number of bytes pending in out.
+size_t out_len(MapperOut* out) {
+    return out->text.len + out->dumpBytes;
+}
+
+// Queue dump to be sent after everything already in out. Takes over the
+// caller's reference.
+void append_dump(MapperOut* out, AirportDump* dump) {
+
+    if (out->dumpCount == out->dumpCap) {
+        out->dumpCap = out->dumpCap ? out->dumpCap * 2 : 4;
+        out->dumps = realloc(out->dumps, sizeof(DumpRef) * out->dumpCap);
+    }
+    out->dumps[out->dumpCount].at = out->text.len;
+    out->dumps[out->dumpCount].dump = dump;
+    out->dumpCount++;
+    out->dumpBytes += dump->len;
+}
+
+// Add the part of [data, data + len) after the first *skip bytes to iov,
+// consuming *skip. Returns the new iovec count.
+static int add_iov(struct iovec* iov, int count, const char* data,
+        size_t len, size_t* skip) {
+
+    if (*skip >= len) {
+        *skip -= len;
+        return count;
+    }
+    iov[count].iov_base = (char*)data + *skip;
+    iov[count].iov_len = len - *skip;
+    *skip = 0;
+    return count + 1;
+}
+
+// Write what is pending in out after its first sent bytes with a single
+// writev. Returns what write returned.
+ssize_t write_out(int fd, MapperOut* out, size_t sent) {
+
+    struct iovec iov[MAX_IOV];
+    int count = 0;
+    size_t from = 0; // start of the next run of text
+    int i = 0;
+
+    // the rest is picked up by the next call if we run out of iovecs. A
+    // pass adds up to two and the text after the last dump one more, so
+    // stop while there is still room for all three.
+    for (; i < out->dumpCount && count <= MAX_IOV - 3; ++i) {
+        DumpRef* ref = &out->dumps[i];
+        count = add_iov(iov, count, out->text.data + from, ref->at - from,
+                &sent);
+        count = add_iov(iov, count, ref->dump->data, ref->dump->len, &sent);
+        from = ref->at;
+    }
+    if (i == out->dumpCount) {
+        count = add_iov(iov, count, out->text.data + from,
+                out->text.len - from, &sent);
+    }
+
+    ssize_t n;
+    do {
+        n = writev(fd, iov, count);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// Empty out once it has all been sent, releasing its dumps.
+void reset_out(MapperOut* out) {
+    for (int i = 0; i < out->dumpCount; ++i) {
+        release_airport_dump(out->dumps[i].dump);
+    }
+    out->dumpCount = 0;
+    out->dumpBytes = 0;
+    out->text.len = 0;
+}
+
+// Write everything pending in out to the blocking fd and empty it. Returns
+// false if the write failed.
+bool send_out(int fd, MapperOut* out) {
+
+    size_t sent = 0;
+    size_t len = out_len(out);
+    while (sent < len) {
+        ssize_t n = write_out(fd, out, sent);
+        if (n < 0) {
+            reset_out(out);
+            return false;
+        }
+        sent += n;
+    }
+    reset_out(out);
+    return true;
+}
@@ -1,60 +1,507 @@
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
 #include "mapperProtocol.h"
 
-#define CHUNK_SIZE 80
+// Initialise reader to read from fd with an empty buffer.
+void init_reader(MsgReader* reader, int fd) {
+    reader->fd = fd;
+    reader->cap = READER_SIZE;
+    reader->buf = malloc(reader->cap);
+    reader->start = 0;
+    reader->scanned = 0;
+    reader->end = 0;
+    reader->bytesRead = 0;
+}
+
+// Release the buffer held by reader. Does not close its fd.
+void free_reader(MsgReader* reader) {
+    free(reader->buf);
+    reader->buf = NULL;
+}
+
+// Make room at the end of the buffer, first by moving the unconsumed bytes
+// to the front and then, if the buffer is full of one partial line, by
+// growing it. Invalidates lines previously returned.
+static void make_room(MsgReader* reader) {
+
+    if (reader->start > 0) {
+        size_t pending = reader->end - reader->start;
+        memmove(reader->buf, reader->buf + reader->start, pending);
+        reader->scanned -= reader->start;
+        reader->end = pending;
+        reader->start = 0;
+    }
+
+    if (reader->end == reader->cap) {
+        reader->cap *= 2;
+        reader->buf = realloc(reader->buf, reader->cap);
+    }
+}
+
+// Do one read() of as much as fits into reader's buffer. Returns the number
+// of bytes read, 0 at end of file or -1 with errno set (EAGAIN for a
+// non-blocking fd with nothing available). Invalidates lines previously
+// returned.
+ssize_t fill_reader(MsgReader* reader) {
+
+    // only shuffle bytes when the tail is getting short on room
+    if (reader->cap - reader->end < READER_SIZE / 4) {
+        make_room(reader);
+    }
 
-// Read from file until finding the sentinel. If finding the sentinel, return
-// else if hitting \n or EOF keep reading.
-const char* parse_str(FILE* file, int sentinel) {
+    ssize_t n;
+    do {
+        n = read(reader->fd, reader->buf + reader->end,
+                reader->cap - reader->end);
+    } while (n < 0 && errno == EINTR);
 
-    int pos = 0;
-    char* str = malloc(sizeof(char) * CHUNK_SIZE);
+    if (n > 0) {
+        reader->end += n;
+        reader->bytesRead += n;
+    }
+    return n;
+}
 
-    // read until hitting '\n' or EOF
-    while (1) {
-        int next = fgetc(file);
+// Return the next complete line already in reader's buffer with its \n
+// replaced by \0, or NULL if it only holds a partial line. Never reads. The
+// line stays valid until the next fill_reader on this reader.
+char* next_line(MsgReader* reader) {
 
-        if (next == sentinel) {
-            str[pos] = '\0';
-            return str;
+    char* newline = memchr(reader->buf + reader->scanned, '\n',
+            reader->end - reader->scanned);
+
+    if (!newline) {
+        reader->scanned = reader->end;
+        return NULL;
+    }
 
-        } else if (next == EOF) {
-            return NULL; //todo see spec - how to handle EOF
+    char* line = reader->buf + reader->start;
+    *newline = '\0';
+    reader->start = newline - reader->buf + 1;
+    reader->scanned = reader->start;
+    return line;
+}
+
+// Return the next line from reader, reading as many blocks as it takes.
+// Returns NULL on end of file or error (a trailing partial line is dropped).
+// The line stays valid until the next read from this reader.
+char* read_line(MsgReader* reader) {
+
+    while (true) {
+        char* line = next_line(reader);
+        if (line) {
+            return line;
         }
-        if (pos > CHUNK_SIZE - 1) {
-            str = realloc(str, sizeof(int) * pos);
+        if (fill_reader(reader) <= 0) {
+            return NULL;
         }
-        str[pos++] = (char)next;
     }
 }
 
-// Read the incoming message/request from mapperIn, initialise the data
-// structure that stores the incoming request & return the message.
-MapperMsg read_message(FILE* mapperIn) {
+// Set args to those of a message that has none.
+static void clear_args(MapperMsgArgs* args) {
+    args->id = NULL;
+    args->port = NULL;
+    args->portNo = 0;
+    args->bulkLen = 0;
+    args->since = 0;
+    args->to = NULL;
+    args->prefix = NULL;
+    args->limit = 0;
+}
 
-    MapperMsg msg;
+// Set args to the query with fields first and second, a range from first
+// to second if prefix is false, else within prefix first from second.
+// Empty fields are unbounded.
+static void set_query(MapperMsgArgs* args, const char* first,
+        const char* second, bool prefix) {
 
-    if (feof(mapperIn)) {
-        msg.type = CONN_CLOSED;
-        return msg;
+    first = first && *first ? first : NULL;
+    second = second && *second ? second : NULL;
+    args->id = prefix ? second : first;
+    args->to = prefix ? NULL : second;
+    args->prefix = prefix ? first : NULL;
+}
+
+// Split the query of an @range or @prefix request - first[:second[:limit]]
+// - in place into args as set_query would. Returns false if the limit isn't
+// a number.
+static bool parse_query(char* query, bool prefix, MapperMsgArgs* args) {
+
+    char* second = NULL;
+    char* colon = strchr(query, ':');
+    if (colon) {
+        *colon = '\0';
+        second = colon + 1;
+        colon = strchr(second, ':');
+    }
+    if (colon) {
+        char* end;
+        *colon = '\0';
+        unsigned long limit = strtoul(colon + 1, &end, 10);
+        if (!isdigit((unsigned char)colon[1]) || *end != '\0' ||
+                limit > UINT32_MAX) {
+            return false;
+        }
+        args->limit = limit;
     }
+    set_query(args, query, second, prefix);
+    return true;
+}
+
+// Parse a single complete message held in line (without its trailing \n).
+// The line is split in place so the returned args point into it.
+MapperMsg parse_message(char* line) {
 
-    msg.type = fgetc(mapperIn);
+    MapperMsg msg;
+    // unsigned, so a high first byte can't read as CONN_CLOSED
+    msg.type = (unsigned char)line[0];
+    clear_args(&msg.args);
 
     switch (msg.type) {
         case PORT_REQUEST:
-            msg.args.id = parse_str(mapperIn, '\n');
+            msg.args.id = line + 1;
             break;
-        case ADD_AIRPORT:
-            msg.args.id = parse_str(mapperIn, ':');
-            msg.args.port = parse_str(mapperIn, '\n');
+        case ADD_AIRPORT: {
+            char* colon = strchr(line + 1, ':');
+            if (!colon) {
+                msg.type = INVALID_MSG;
+                break;
+            }
+            *colon = '\0';
+            msg.args.id = line + 1;
+            msg.args.port = colon + 1;
+            break;
+        }
+        case BULK_REGISTER:
+            // split every id and port in place
+            msg.args.id = line + 1;
+            msg.args.bulkLen = strlen(msg.args.id);
+            for (char* at = line + 1; (at = strchr(at, ':')); ) {
+                *at++ = '\0';
+            }
             break;
         case INFO_REQUEST:
-            parse_str(mapperIn, '\n'); // replace \n with \0
+            if (!strncmp(line + 1, "since ", 6)) {
+                char* end;
+                msg.type = DELTA_REQUEST;
+                msg.args.since = strtoull(line + 7, &end, 10);
+                if (!isdigit((unsigned char)line[7]) || *end != '\0') {
+                    msg.type = INVALID_MSG;
+                }
+            } else if (!strncmp(line + 1, "range ", 6)) {
+                msg.type = parse_query(line + 7, false, &msg.args) ?
+                        RANGE_REQUEST : INVALID_MSG;
+            } else if (!strncmp(line + 1, "prefix ", 7)) {
+                msg.type = parse_query(line + 8, true, &msg.args) ?
+                        RANGE_REQUEST : INVALID_MSG;
+            }
+            break;
+        case STATS_REQUEST:
+            break;
+        default:
+            msg.type = INVALID_MSG;
+            break;
+    }
+    return msg;
+}
+
+// Read the next incoming message/request from reader & return it. The
+// message's args point into reader. Returns a CONN_CLOSED message at end of
+// file.
+MapperMsg read_message(MsgReader* reader) {
+
+    char* line = read_line(reader);
+
+    if (!line) {
+        MapperMsg msg;
+        msg.type = CONN_CLOSED;
+        clear_args(&msg.args);
+        return msg;
+    }
+    return parse_message(line);
+}
+
+// Tell from the bytes already in reader whether its stream opened with
+// BINARY_HELLO, consuming the hello if so. Never reads.
+WireFormat next_format(MsgReader* reader) {
+
+    size_t pending = reader->end - reader->start;
+    const char* at = reader->buf + reader->start;
+    if (pending == 0 || (at[0] == '\0' && pending < BINARY_HELLO_LEN)) {
+        return WIRE_PENDING;
+    }
+    if (memcmp(at, BINARY_HELLO, BINARY_HELLO_LEN)) {
+        return WIRE_TEXT;
+    }
+    reader->start += BINARY_HELLO_LEN;
+    reader->scanned = reader->start;
+    return WIRE_BINARY;
+}
+
+// Read until it is clear whether reader's stream opened with BINARY_HELLO,
+// consuming the hello if so. Returns WIRE_PENDING on end of file or error.
+WireFormat read_format(MsgReader* reader) {
+
+    while (true) {
+        WireFormat format = next_format(reader);
+        if (format != WIRE_PENDING) {
+            return format;
+        }
+        if (fill_reader(reader) <= 0) {
+            return WIRE_PENDING;
+        }
+    }
+}
+
+// Take the next complete frame already in reader's buffer. Returns 1 if
+// frame was set, 0 if only part of one has arrived, or -1 if the stream is
+// broken - a length over MAX_FRAME. Never reads. The payload stays valid
+// until the next fill_reader on this reader.
+int next_frame(MsgReader* reader, Frame* frame) {
+
+    const unsigned char* at = (unsigned char*)reader->buf + reader->start;
+    const unsigned char* end = (unsigned char*)reader->buf + reader->end;
+    if (at == end) {
+        return 0;
+    }
+    uint8_t op = *at++;
+
+    size_t len = 0;
+    int shift = 0;
+    while (true) {
+        if (at == end) {
+            return 0;
+        }
+        len |= (size_t)(*at & 0x7f) << shift;
+        shift += 7;
+        if (!(*at++ & 0x80)) {
+            break;
+        }
+        if (len > MAX_FRAME || shift > 28) {
+            return -1;
+        }
+    }
+    if (len > MAX_FRAME) {
+        return -1;
+    }
+    if ((size_t)(end - at) < len) {
+        return 0;
+    }
+
+    frame->op = op;
+    frame->data = (const char*)at;
+    frame->len = len;
+    reader->start = (char*)at + len - reader->buf;
+    reader->scanned = reader->start;
+    return 1;
+}
+
+// Return the next frame from reader, reading as many blocks as it takes.
+// Returns 1 if frame was set, 0 on end of file or error (a trailing partial
+// frame is dropped) or -1 if the stream is broken.
+int read_frame(MsgReader* reader, Frame* frame) {
+
+    while (true) {
+        int got = next_frame(reader, frame);
+        if (got) {
+            return got;
+        }
+        if (fill_reader(reader) <= 0) {
+            return 0;
+        }
+    }
+}
+
+// Return frame's payload as a string if it is a NUL terminated one, else
+// NULL.
+const char* frame_string(const Frame* frame) {
+
+    if (frame->len == 0 || frame->data[frame->len - 1] != '\0') {
+        return NULL;
+    }
+    return frame->data;
+}
+
+// Split the payload of an OP_RANGE or OP_PREFIX frame into args as
+// parse_query would. Returns false if it is malformed.
+static bool parse_query_frame(const Frame* frame, bool prefix,
+        MapperMsgArgs* args) {
+
+    if (frame->len < 4) {
+        return false;
+    }
+    const unsigned char* limit = (unsigned char*)frame->data;
+    Frame strings = {frame->op, frame->data + 4, frame->len - 4};
+    const char* first = frame_string(&strings);
+    if (!first) {
+        return false;
+    }
+    const char* second = (char*)memchr(first, '\0', strings.len) + 1;
+    if (second == frame->data + frame->len) {
+        return false;
+    }
+
+    args->limit = (uint32_t)limit[0] << 24 | limit[1] << 16 |
+            limit[2] << 8 | limit[3];
+    set_query(args, first, second, prefix);
+    return true;
+}
+
+// Return whether a binary id could also be sent as text: a ':' would split
+// it and a newline end it, there and in listings.
+static bool is_text_id(const char* id) {
+    return id && !strpbrk(id, ":\n");
+}
+
+// Turn a binary mapper request into the message its text form would parse
+// to. The args point into the frame.
+MapperMsg parse_frame(const Frame* frame) {
+
+    MapperMsg msg;
+    msg.type = INVALID_MSG;
+    clear_args(&msg.args);
+
+    switch (frame->op) {
+        case OP_LOOKUP:
+            msg.args.id = frame_string(frame);
+            msg.type = msg.args.id ? PORT_REQUEST : INVALID_MSG;
+            break;
+        case OP_REGISTER:
+            if (frame->len > 2) {
+                const unsigned char* port = (unsigned char*)frame->data;
+                Frame id = {frame->op, frame->data + 2, frame->len - 2};
+                msg.args.portNo = port[0] << 8 | port[1];
+                msg.args.id = frame_string(&id);
+            }
+            msg.type = is_text_id(msg.args.id) && msg.args.portNo
+                    ? ADD_AIRPORT : INVALID_MSG;
+            break;
+        case OP_BULK_REGISTER:
+            msg.args.id = frame->data;
+            msg.args.bulkLen = frame->len;
+            msg.type = BULK_REGISTER;
+            break;
+        case OP_SINCE:
+            if (frame->len == 8) {
+                const unsigned char* since = (unsigned char*)frame->data;
+                for (int i = 0; i < 8; ++i) {
+                    msg.args.since = msg.args.since << 8 | since[i];
+                }
+                msg.type = DELTA_REQUEST;
+            }
+            break;
+        case OP_RANGE:
+        case OP_PREFIX:
+            if (parse_query_frame(frame, frame->op == OP_PREFIX,
+                    &msg.args)) {
+                msg.type = RANGE_REQUEST;
+            }
+            break;
+        case OP_LIST:
+            msg.type = INFO_REQUEST;
+            break;
+        case OP_STATS:
+            msg.type = STATS_REQUEST;
             break;
-        case CONN_CLOSED:
         default:
             break;
     }
     return msg;
 }
+
+// Start cursor at the first entry of the bulk registration with args,
+// framed if binary.
+void init_bulk_cursor(BulkCursor* cursor, const MapperMsgArgs* args,
+        bool binary) {
+    cursor->at = args->id;
+    cursor->end = args->id + args->bulkLen;
+    cursor->binary = binary;
+}
+
+// Take the next entry of a bulk registration into entry. Returns false once
+// there are none left. An entry that can't be parsed is given with a NULL
+// id, and takes the rest of the entries with it if they can't be told
+// apart.
+bool next_bulk_entry(BulkCursor* cursor, MapperMsgArgs* entry) {
+
+    if (cursor->at >= cursor->end) {
+        return false;
+    }
+    clear_args(entry);
+
+    if (cursor->binary) {
+        const unsigned char* port = (const unsigned char*)cursor->at;
+        const char* nul = NULL;
+        if (cursor->end - cursor->at > 2) {
+            nul = memchr(cursor->at + 2, '\0', cursor->end - cursor->at - 2);
+        }
+        if (!nul) {
+            cursor->at = cursor->end;
+            return true;
+        }
+        entry->portNo = port[0] << 8 | port[1];
+        entry->id = is_text_id(cursor->at + 2) ? cursor->at + 2 : NULL;
+        cursor->at = nul + 1;
+        return true;
+    }
+
+    // parse_message has split the entries into id\0port\0...
+    const char* id = cursor->at;
+    const char* port = id + strlen(id) + 1;
+    if (port >= cursor->end) {
+        cursor->at = cursor->end;
+        return true;
+    }
+    entry->id = id;
+    entry->port = port;
+    cursor->at = port + strlen(port) + 1;
+    return true;
+}
+
+// Take the next complete request already in reader's buffer, in the
+// connection's format. Returns false if there isn't one. A broken binary
+// stream gives a CONN_CLOSED message. Never reads.
+bool next_message(MsgReader* reader, WireFormat format, MapperMsg* msg) {
+
+    if (format == WIRE_TEXT) {
+        char* line = next_line(reader);
+        if (line) {
+            *msg = parse_message(line);
+        }
+        return line != NULL;
+    }
+
+    Frame frame;
+    int got = next_frame(reader, &frame);
+    if (got < 0) {
+        msg->type = CONN_CLOSED;
+        clear_args(&msg->args);
+    } else if (got > 0) {
+        *msg = parse_frame(&frame);
+    }
+    return got != 0;
+}
+
+// Append the header of a frame with a len byte payload to out.
+void append_frame_header(Buffer* out, FrameOp op, size_t len) {
+
+    char header[1 + 5];
+    int used = 0;
+    header[used++] = (char)op;
+    do {
+        header[used] = len & 0x7f;
+        len >>= 7;
+        header[used++] |= len ? 0x80 : 0;
+    } while (len);
+    append_buffer(out, header, used);
+}
+
+// Append a whole frame to out.
+void append_frame(Buffer* out, FrameOp op, const void* data, size_t len) {
+    append_frame_header(out, op, len);
+    append_buffer(out, data, len);
+}
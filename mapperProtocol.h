@@ -2,20 +2,73 @@
 #define SRC_MAPPERPROTOCOL_H
 
 #include <stdio.h>
-#include "airport.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "buffer.h"
 
+#define READER_SIZE 16384
 
+// Sent by a roc as its first line to ask a control to keep the connection
+// open for more requests; the control echoes it back if it agrees. ':' can't
+// appear in an id so it is never mistaken for one.
+#define KEEP_ALIVE ":keepalive"
 
+// Sent by a client as its first bytes to switch the connection to binary
+// frames, and echoed back by a server that agrees. No text message starts
+// with a NUL, so a server tells the two apart from the first byte. A client
+// may send frames straight after it without waiting for the echo.
+#define BINARY_HELLO "\0\1"
+#define BINARY_HELLO_LEN 2
+#define MAX_FRAME (1 << 24) // longer frames are taken as a broken stream
+
+// Mapper requests are one line each. A client may pipeline any number of
+// requests without waiting - responses always come back in request order.
+// A bulk registration is +id:port:id:port... and, unlike a single one, is
+// answered: by a line with a BulkStatus for each entry. @since version asks
+// for the changes since a version of the map: answered by "delta version"
+// then +id:port and -id lines, or if they are no longer all kept by
+// "snapshot version" and the full listing, either ended by a dot line.
+// @range from[:to[:limit]] lists the airports with from <= id < to, and
+// @prefix prefix[:from[:limit]] those whose ids start with prefix, from
+// from on; an empty from or to is unbounded and a limit of 0 is none. Both
+// are answered by the id:port lines in id order then, if the limit cut
+// them short, "more id" - the request again with from set to id continues
+// it - and a dot line.
 typedef enum {
     PORT_REQUEST = '?',
     ADD_AIRPORT = '!',
+    BULK_REGISTER = '+',
     INFO_REQUEST = '@',
+    STATS_REQUEST = '#',
+    DELTA_REQUEST = 0x100, // not a character, @since is told from @
+    RANGE_REQUEST = 0x101, // @range and @prefix, likewise
+    INVALID_MSG = '\0',
     CONN_CLOSED = EOF
 } MapperMsgType;
 
+// How each entry of a bulk registration went
+typedef enum {
+    BULK_ADDED = '+',
+    BULK_EXISTS = '=', // the id was already registered, it is unchanged
+    BULK_INVALID = '!'
+} BulkStatus;
+
+// id and port point into the reader that produced the message and are only
+// valid until the next read from that reader. A binary registration carries
+// its port as portNo with port NULL. A bulk registration's entries run
+// bulkLen bytes from id, to be walked with next_bulk_entry. since is the
+// version of a delta request. A range request runs from id to to, within
+// prefix, with NULL for an unbounded end or no prefix.
 typedef struct {
     const char* id;
     const char* port;
+    uint16_t portNo;
+    size_t bulkLen;
+    uint64_t since;
+    const char* to;
+    const char* prefix;
+    uint32_t limit;
 } MapperMsgArgs;
 
 typedef struct {
@@ -23,7 +76,89 @@ typedef struct {
     MapperMsgArgs args;
 } MapperMsg;
 
-const char* parse_str(FILE* file, int sentinel);
-MapperMsg read_message(FILE* mapperIn);
+// How a connection's peer has chosen to talk
+typedef enum {
+    WIRE_PENDING, // too few bytes yet to tell
+    WIRE_TEXT,
+    WIRE_BINARY
+} WireFormat;
+
+// Binary frame opcodes. A frame is the opcode byte, the payload length as
+// an unsigned LEB128 varint, then the payload. Ids and infos are sent NUL
+// terminated so they can be used in place; ports are 2 bytes big endian.
+// Frames need no delimiter scanning, so any number of requests can go out
+// back to back in one write and are answered in order.
+typedef enum {
+    OP_LOOKUP = 0x01, // id - answered by OP_PORT or OP_NO_PORT
+    OP_REGISTER = 0x02, // port then id
+    OP_LIST = 0x03, // empty - answered by OP_LISTING
+    OP_STATS = 0x04, // empty, to a mapper or control - answered by OP_REPORT
+    OP_BULK_REGISTER = 0x05, // entries of port then id - answered by OP_ACK
+    OP_SINCE = 0x06, // 8 byte big endian version - answered by OP_DELTA
+    OP_RANGE = 0x07, // 4 byte limit, from, to - answered by OP_PAGE
+    OP_PREFIX = 0x08, // 4 byte limit, prefix, from - answered by OP_PAGE
+    OP_ARRIVE = 0x10, // plane id, to a control - answered by OP_INFO
+    OP_LOG = 0x11, // empty, to a control - answered by OP_ARRIVALS
+    OP_PORT = 0x81, // port
+    OP_NO_PORT = 0x82, // empty
+    OP_LISTING = 0x83, // the text of an @ listing
+    OP_REPORT = 0x84, // the text of a # report
+    OP_ACK = 0x85, // a BulkStatus byte per entry
+    OP_DELTA = 0x86, // the text of an @since reply, without the dot line
+    OP_PAGE = 0x87, // the text of an @range reply, without the dot line
+    OP_INFO = 0x90, // info
+    OP_ARRIVALS = 0x91 // the text of a log listing
+} FrameOp;
+
+// A frame's payload points into the reader that produced it and is only
+// valid until the next read from that reader
+typedef struct {
+    uint8_t op;
+    const char* data;
+    size_t len;
+} Frame;
+
+// Position in the entries of a bulk registration
+typedef struct {
+    const char* at;
+    const char* end;
+    bool binary; // entries are port then id, as framed
+} BulkCursor;
+
+// Buffered reader over a connection. Bytes in buf[start, end) have been read
+// but not consumed; buf[start, scanned) is known to hold no newline so each
+// byte is only searched once. Complete lines are handed out in place as NUL
+// terminated views, the partial line at the end is moved to the front when
+// more room is needed, and buf only grows for a line longer than it.
+typedef struct {
+    int fd;
+    char* buf;
+    size_t cap;
+    size_t start;
+    size_t scanned;
+    size_t end;
+    uint64_t bytesRead; // over the reader's life, for stats
+} MsgReader;
+
+void init_reader(MsgReader* reader, int fd);
+void free_reader(MsgReader* reader);
+ssize_t fill_reader(MsgReader* reader);
+char* next_line(MsgReader* reader);
+char* read_line(MsgReader* reader);
+MapperMsg parse_message(char* line);
+MapperMsg read_message(MsgReader* reader);
+
+WireFormat next_format(MsgReader* reader);
+WireFormat read_format(MsgReader* reader);
+int next_frame(MsgReader* reader, Frame* frame);
+int read_frame(MsgReader* reader, Frame* frame);
+const char* frame_string(const Frame* frame);
+MapperMsg parse_frame(const Frame* frame);
+void init_bulk_cursor(BulkCursor* cursor, const MapperMsgArgs* args,
+        bool binary);
+bool next_bulk_entry(BulkCursor* cursor, MapperMsgArgs* entry);
+bool next_message(MsgReader* reader, WireFormat format, MapperMsg* msg);
+void append_frame_header(Buffer* out, FrameOp op, size_t len);
+void append_frame(Buffer* out, FrameOp op, const void* data, size_t len);
 
 #endif //SRC_MAPPERPROTOCOL_H
@@ -0,0 +1,224 @@
+//
+// Regression tests for the mapper's protocol handling. Starts a mapper on
+// localhost, in thread per connection mode and then with -e, and runs each
+// test against it: a test sends a whole request stream on one connection,
+// shuts its side down and compares everything the mapper sent back with
+// what it should have. Prints a line per failure and exits with the number
+// of failures.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "buffer.h"
+#include "mapperProtocol.h"
+
+#define TEST_ID "TST"
+#define TEST_PORT "1234"
+#define MAX_LISTINGS 70 // well past the 32 that fit in one writev
+#define LISTING_TRIES 100 // 10ms apart
+
+// A test: fills request with what to send and expected with the reply. It
+// is run once for each n from 1 to runs.
+typedef struct {
+    const char* name;
+    void (*build)(Buffer* request, Buffer* expected, int n);
+    int runs;
+} MapperTest;
+
+// Run the program in argv with its stdout piped back, and return the first
+// line it prints - the port it listens on - or 0 if it didn't print one.
+static uint16_t spawn(char* const argv[], pid_t* pid) {
+
+    int pipeFds[2];
+    if (pipe(pipeFds)) {
+        return 0;
+    }
+    *pid = fork();
+    if (*pid == 0) {
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(pipeFds[1]);
+
+    // the pipe stays open, so the child never writes to a closed one
+    MsgReader reader;
+    init_reader(&reader, pipeFds[0]);
+    const char* line = read_line(&reader);
+    uint16_t port = line ? atoi(line) : 0;
+    free_reader(&reader);
+    return port;
+}
+
+// Send request to the mapper on port over one connection and collect the
+// whole reply in reply. Returns false if the connection failed.
+static bool exchange(uint16_t port, Buffer* request, Buffer* reply) {
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0 ||
+            connect(sockfd, (struct sockaddr*)&addr, sizeof(addr))) {
+        return false;
+    }
+
+    size_t len = request->len;
+    bool sent = send_buffer(sockfd, request);
+    request->len = len;
+    shutdown(sockfd, SHUT_WR);
+
+    char chunk[4096];
+    ssize_t n;
+    while (sent && (n = read(sockfd, chunk, sizeof(chunk))) > 0) {
+        append_buffer(reply, chunk, n);
+    }
+    close(sockfd);
+    return sent;
+}
+
+// Pipeline n listings with a lookup before and after each, so the reply
+// alternates between text of its own and shared listings and every count
+// of listings is tried both ways round the end of an iovec array.
+static void build_text_listings(Buffer* request, Buffer* expected, int n) {
+    append_str(request, "?" TEST_ID "\n");
+    append_str(expected, TEST_PORT "\n");
+    for (int i = 0; i < n; ++i) {
+        append_str(request, "@\n?" TEST_ID "\n");
+        append_str(expected, TEST_ID ":" TEST_PORT "\n" TEST_PORT "\n");
+    }
+}
+
+// The same as build_text_listings in binary frames.
+static void build_binary_listings(Buffer* request, Buffer* expected,
+        int n) {
+
+    const char listing[] = TEST_ID ":" TEST_PORT "\n";
+    const unsigned char port[] = {atoi(TEST_PORT) >> 8,
+            atoi(TEST_PORT) & 0xff};
+    append_buffer(request, BINARY_HELLO, BINARY_HELLO_LEN);
+    append_buffer(expected, BINARY_HELLO, BINARY_HELLO_LEN);
+    append_frame(request, OP_LOOKUP, TEST_ID, sizeof(TEST_ID));
+    append_frame(expected, OP_PORT, port, sizeof(port));
+    for (int i = 0; i < n; ++i) {
+        append_frame(request, OP_LIST, NULL, 0);
+        append_frame(request, OP_LOOKUP, TEST_ID, sizeof(TEST_ID));
+        append_frame(expected, OP_LISTING, listing, strlen(listing));
+        append_frame(expected, OP_PORT, port, sizeof(port));
+    }
+}
+
+// Send a line starting with byte 0xFF, then a lookup. The line is invalid
+// and gets no reply, but mustn't be taken for the end of the connection.
+static void build_high_byte(Buffer* request, Buffer* expected, int n) {
+    append_str(request, "\xff" TEST_ID "\n?" TEST_ID "\n");
+    append_str(expected, TEST_PORT "\n");
+}
+
+// Register ids with a ':' or a newline in binary, singly and in bulk, then
+// look one up. Neither could be listed, so both are refused and the lookup
+// finds nothing.
+static void build_binary_bad_ids(Buffer* request, Buffer* expected,
+        int n) {
+
+    const char single[] = "\x04\xd2" "BAD:ID";
+    const char bulk[] = "\x04\xd2" "BAD:ID\0" "\x04\xd2" "BAD\nID";
+    append_buffer(request, BINARY_HELLO, BINARY_HELLO_LEN);
+    append_buffer(expected, BINARY_HELLO, BINARY_HELLO_LEN);
+    append_frame(request, OP_REGISTER, single, sizeof(single));
+    append_frame(request, OP_BULK_REGISTER, bulk, sizeof(bulk));
+    append_frame(expected, OP_ACK, "!!", 2);
+    append_frame(request, OP_LOOKUP, "BAD:ID", sizeof("BAD:ID"));
+    append_frame(expected, OP_NO_PORT, NULL, 0);
+}
+
+static const MapperTest tests[] = {
+    {"pipelined text listings", build_text_listings, MAX_LISTINGS},
+    {"pipelined binary listings", build_binary_listings, MAX_LISTINGS},
+    {"line starting with 0xff", build_high_byte, 1},
+    {"binary ids with ':' or newline", build_binary_bad_ids, 1},
+};
+
+// Start the mapper with args, register the test airport and run every
+// test against it. Returns the number of tests that failed.
+static int run_tests(char* const argv[]) {
+
+    pid_t pid;
+    uint16_t port = spawn(argv, &pid);
+    if (!port) {
+        fprintf(stderr, "can't start ./mapper\n");
+        exit(1);
+    }
+
+    Buffer request;
+    Buffer reply;
+    init_buffer(&request, 256);
+    init_buffer(&reply, 256);
+    append_str(&request, "!" TEST_ID ":" TEST_PORT "\n");
+    if (!exchange(port, &request, &reply)) {
+        fprintf(stderr, "can't reach ./mapper\n");
+        exit(1);
+    }
+
+    // listings are rebuilt in the background, so wait for one with it
+    const char listing[] = TEST_ID ":" TEST_PORT "\n";
+    for (int tries = 0; reply.len != strlen(listing) ||
+            memcmp(reply.data, listing, reply.len); ++tries) {
+        if (tries == LISTING_TRIES) {
+            fprintf(stderr, "./mapper never lists " TEST_ID "\n");
+            exit(1);
+        }
+        usleep(10000);
+        request.len = 0;
+        reply.len = 0;
+        append_str(&request, "@\n");
+        exchange(port, &request, &reply);
+    }
+
+    int failures = 0;
+    for (int i = 0; i < sizeof(tests) / sizeof(MapperTest); ++i) {
+        for (int n = 1; n <= tests[i].runs; ++n) {
+            Buffer expected;
+            init_buffer(&expected, 256);
+            request.len = 0;
+            reply.len = 0;
+            tests[i].build(&request, &expected, n);
+            if (!exchange(port, &request, &reply) ||
+                    reply.len != expected.len ||
+                    memcmp(reply.data, expected.data, reply.len)) {
+                printf("FAIL %s %s %d: %zu bytes back, wanted %zu\n",
+                        argv[argv[1] ? 1 : 0], tests[i].name, n, reply.len,
+                        expected.len);
+                failures++;
+            }
+            free_buffer(&expected);
+        }
+    }
+
+    free_buffer(&request);
+    free_buffer(&reply);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return failures;
+}
+
+int main(int argc, char** argv) {
+
+    signal(SIGPIPE, SIG_IGN);
+    char* threaded[] = {"./mapper", NULL};
+    char* eventLoop[] = {"./mapper", "-e", NULL};
+    int failures = run_tests(threaded) + run_tests(eventLoop);
+    printf("%d failed\n", failures);
+    return failures;
+}
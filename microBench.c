@@ -0,0 +1,382 @@
+//
+// Microbenchmarks of the container and parser primitives, each timed over
+// data sizes from 10 entries up by powers of ten. Every measurement starts
+// with an untimed warmup, then takes SAMPLES samples; a sample repeats the
+// operation over fresh data until it has run for at least MIN_SAMPLE_NS so
+// small sizes aren't lost in clock noise. Prints the median cost per entry
+// with the fastest sample and the spread between the quartiles, which
+// should stay within a few percent on a quiet machine.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "airplane.h"
+#include "airport.h"
+#include "internTable.h"
+#include "mapperProtocol.h"
+#include "rcu.h"
+
+#define DEFAULT_MAX_SIZE 1000000
+#define SAMPLES 7
+#define MIN_SAMPLE_NS 20000000L // 20 ms
+#define RANGE_LIMIT 8 // airports listed by each range query
+
+// State a benchmark runs over, rebuilt before each timed pass
+typedef struct {
+    long size;
+    char** ids; // size distinct ids
+    char** ports;
+    long* order; // a shuffle of 0 to size - 1, for lookups
+    AirportList airports;
+    AirplaneList airplanes;
+    FILE* sink; // /dev/null, for the print functions
+    char* text; // size mapper messages, one per line
+    size_t textLen;
+    char* work; // a scratch copy of text
+    int fd; // a file holding text
+    Airport* batch; // the ids and ports as one add_airports batch
+    bool* added;
+    Buffer page; // where range queries list to
+    InternTable* names; // interns the ids, made fresh for each size
+} Bench;
+
+// A benchmark: setup builds what run needs untimed, run does size
+// operations and is timed
+typedef struct {
+    const char* name;
+    void (*setup)(Bench* bench);
+    void (*run)(Bench* bench);
+} MicroBench;
+
+static long checksum; // keeps results from being optimised away
+
+// Return the monotonic clock in ns.
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Start bench off with a fresh airport table holding the first count ids.
+static void fill_airports(Bench* bench, long count) {
+
+    if (bench->airports) {
+        free_airport_list(bench->airports);
+    }
+    bench->airports = init_airport_list();
+    for (long i = 0; i < count; ++i) {
+        Airport airport;
+        airport.id = bench->ids[i];
+        airport.port = bench->ports[i];
+        airport.info = NULL;
+        add_airport(bench->airports, airport);
+    }
+}
+
+// Empty the airplane log and record the first count ids in it.
+static void fill_airplanes(Bench* bench, long count) {
+
+    reset_airplane_list(bench->airplanes);
+    for (long i = 0; i < count; ++i) {
+        Airplane airplane;
+        airplane.id = bench->ids[i];
+        add_airplane(bench->airplanes, airplane);
+    }
+}
+
+static void setup_empty_airports(Bench* bench) {
+    fill_airports(bench, 0);
+}
+
+static void setup_full_airports(Bench* bench) {
+    fill_airports(bench, bench->size);
+}
+
+static void run_add_airport(Bench* bench) {
+    for (long i = 0; i < bench->size; ++i) {
+        Airport airport;
+        airport.id = bench->ids[i];
+        airport.port = bench->ports[i];
+        airport.info = NULL;
+        add_airport(bench->airports, airport);
+    }
+}
+
+static void run_add_airports(Bench* bench) {
+    add_airports(bench->airports, bench->batch, bench->size, bench->added);
+}
+
+static void run_get_airport(Bench* bench) {
+    rcu_read_lock();
+    for (long i = 0; i < bench->size; ++i) {
+        Airport* airport = get_airport(bench->airports,
+                bench->ids[bench->order[i]]);
+        checksum += airport->port[0];
+    }
+    rcu_read_unlock();
+}
+
+// Page through the table from random ids, RANGE_LIMIT airports at a time.
+static void run_airport_range(Bench* bench) {
+    AirportRange range = {NULL, NULL, NULL, RANGE_LIMIT};
+    rcu_read_lock();
+    for (long i = 0; i < bench->size; ++i) {
+        range.from = bench->ids[bench->order[i]];
+        bench->page.len = 0;
+        append_airport_range(bench->airports, &range, &bench->page);
+        checksum += bench->page.len;
+    }
+    rcu_read_unlock();
+}
+
+static void run_remove_airport(Bench* bench) {
+    for (long i = 0; i < bench->size; ++i) {
+        remove_airport(bench->airports, bench->ids[bench->order[i]]);
+    }
+}
+
+static void run_print_airports(Bench* bench) {
+    print_airport_list(bench->airports, bench->sink);
+}
+
+static void setup_empty_airplanes(Bench* bench) {
+    fill_airplanes(bench, 0);
+}
+
+// Fill the log and merge the arrivals so printing only pays for output.
+static void setup_merged_airplanes(Bench* bench) {
+    fill_airplanes(bench, bench->size);
+    print_airplane_list(bench->airplanes, bench->sink);
+}
+
+static void setup_unmerged_airplanes(Bench* bench) {
+    fill_airplanes(bench, bench->size);
+}
+
+static void run_add_airplane(Bench* bench) {
+    for (long i = 0; i < bench->size; ++i) {
+        Airplane airplane;
+        airplane.id = bench->ids[i];
+        add_airplane(bench->airplanes, airplane);
+    }
+}
+
+static void run_get_airplane(Bench* bench) {
+    for (long i = 0; i < bench->size; ++i) {
+        Airplane* airplane = get_airplane(bench->airplanes,
+                bench->ids[bench->order[i]]);
+        checksum += airplane->id[0];
+    }
+}
+
+// The table keeps its ids between passes, so only the warmup adds any and
+// the timed passes measure hits.
+static void setup_interned(Bench* bench) {
+}
+
+static void run_intern_id(Bench* bench) {
+    for (long i = 0; i < bench->size; ++i) {
+        const char* id = intern_id(bench->names, bench->ids[bench->order[i]]);
+        checksum += id[0];
+    }
+}
+
+static void run_print_airplanes(Bench* bench) {
+    print_airplane_list(bench->airplanes, bench->sink);
+}
+
+// parse_message splits lines in place, so each pass parses a fresh copy.
+static void setup_parse(Bench* bench) {
+    memcpy(bench->work, bench->text, bench->textLen);
+}
+
+static void run_parse_message(Bench* bench) {
+    char* line = bench->work;
+    for (long i = 0; i < bench->size; ++i) {
+        char* newline = strchr(line, '\n');
+        *newline = '\0';
+        MapperMsg msg = parse_message(line);
+        checksum += msg.type;
+        line = newline + 1;
+    }
+}
+
+static void setup_read(Bench* bench) {
+    lseek(bench->fd, 0, SEEK_SET);
+}
+
+static void run_read_message(Bench* bench) {
+    MsgReader reader;
+    init_reader(&reader, bench->fd);
+    for (long i = 0; i < bench->size; ++i) {
+        MapperMsg msg = read_message(&reader);
+        checksum += msg.type;
+    }
+    free_reader(&reader);
+}
+
+static const MicroBench benches[] = {
+    {"add_airport", setup_empty_airports, run_add_airport},
+    {"add_airports", setup_empty_airports, run_add_airports},
+    {"get_airport", setup_full_airports, run_get_airport},
+    {"append_airport_range", setup_full_airports, run_airport_range},
+    {"remove_airport", setup_full_airports, run_remove_airport},
+    {"print_airport_list", setup_full_airports, run_print_airports},
+    {"add_airplane", setup_empty_airplanes, run_add_airplane},
+    {"get_airplane", setup_merged_airplanes, run_get_airplane},
+    {"print_airplane_list", setup_merged_airplanes, run_print_airplanes},
+    {"print_airplane_list+merge", setup_unmerged_airplanes,
+            run_print_airplanes},
+    {"intern_id", setup_interned, run_intern_id},
+    {"parse_message", setup_parse, run_parse_message},
+    {"read_message", setup_read, run_read_message},
+};
+
+// Generate the ids, ports and messages for size entries.
+static void init_bench(Bench* bench, long size) {
+
+    bench->size = size;
+    bench->ids = malloc(sizeof(char*) * size);
+    bench->ports = malloc(sizeof(char*) * size);
+    bench->order = malloc(sizeof(long) * size);
+    bench->batch = malloc(sizeof(Airport) * size);
+    bench->added = malloc(sizeof(bool) * size);
+    char str[32];
+    for (long i = 0; i < size; ++i) {
+        // scrambled so inserts don't arrive in sorted order
+        snprintf(str, sizeof(str), "AP%08lx", (i * 2654435761u) % size);
+        bench->ids[i] = strdup(str);
+        snprintf(str, sizeof(str), "%ld", 1024 + i % 60000);
+        bench->ports[i] = strdup(str);
+        bench->order[i] = i;
+        bench->batch[i].id = bench->ids[i];
+        bench->batch[i].port = bench->ports[i];
+        bench->batch[i].info = NULL;
+    }
+    unsigned seed = 1;
+    for (long i = size - 1; i > 0; --i) {
+        long j = rand_r(&seed) % (i + 1);
+        long swap = bench->order[i];
+        bench->order[i] = bench->order[j];
+        bench->order[j] = swap;
+    }
+
+    // the traffic mix of real mappers, mostly lookups
+    Buffer text;
+    init_buffer(&text, 4096);
+    for (long i = 0; i < size; ++i) {
+        if (i % 4 == 0) {
+            snprintf(str, sizeof(str), "!%s:", bench->ids[i]);
+            append_str(&text, str);
+            append_str(&text, bench->ports[i]);
+            append_buffer(&text, "\n", 1);
+        } else {
+            snprintf(str, sizeof(str), "?%s\n", bench->ids[i]);
+            append_str(&text, str);
+        }
+    }
+    bench->text = text.data;
+    bench->textLen = text.len;
+    bench->work = malloc(text.len);
+
+    FILE* file = tmpfile();
+    fwrite(text.data, 1, text.len, file);
+    fflush(file);
+    bench->fd = dup(fileno(file));
+    fclose(file);
+
+    bench->airports = NULL;
+    bench->names = init_intern_table();
+}
+
+// Release everything init_bench made, and the airport table.
+static void free_bench(Bench* bench) {
+
+    for (long i = 0; i < bench->size; ++i) {
+        free(bench->ids[i]);
+        free(bench->ports[i]);
+    }
+    free(bench->ids);
+    free(bench->ports);
+    free(bench->order);
+    free(bench->batch);
+    free(bench->added);
+    free(bench->text);
+    free(bench->work);
+    close(bench->fd);
+    if (bench->airports) {
+        free_airport_list(bench->airports);
+    }
+    free_intern_table(bench->names);
+}
+
+// Order longs - for use with qsort.
+static int compare_longs(const void* a, const void* b) {
+    long first = *(const long*)a;
+    long second = *(const long*)b;
+    return first < second ? -1 : first > second;
+}
+
+// Take one sample of micro over bench: repeat it until it has run for at
+// least MIN_SAMPLE_NS and return the time per entry in ps.
+static long take_sample(const MicroBench* micro, Bench* bench) {
+
+    long timed = 0;
+    long passes = 0;
+    while (timed < MIN_SAMPLE_NS) {
+        micro->setup(bench);
+        long start = now_ns();
+        micro->run(bench);
+        timed += now_ns() - start;
+        passes++;
+    }
+    return timed * 1000 / (passes * bench->size);
+}
+
+// Time micro over bench and print a line of results.
+static void measure(const MicroBench* micro, Bench* bench) {
+
+    long samples[SAMPLES];
+    take_sample(micro, bench); // warmup
+    for (int i = 0; i < SAMPLES; ++i) {
+        samples[i] = take_sample(micro, bench);
+    }
+    qsort(samples, SAMPLES, sizeof(long), compare_longs);
+
+    long median = samples[SAMPLES / 2];
+    long spread = samples[SAMPLES * 3 / 4] - samples[SAMPLES / 4];
+    printf("%-26s %9ld %11.1f %11.1f %7.1f%%\n", micro->name, bench->size,
+            median / 1e3, samples[0] / 1e3,
+            median ? 100.0 * spread / median : 0);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+
+    long maxSize = argc > 1 ? atol(argv[1]) : DEFAULT_MAX_SIZE;
+    const char* only = argc > 2 ? argv[2] : NULL;
+
+    Bench bench;
+    bench.airplanes = init_airplane_list();
+    init_buffer(&bench.page, 4096);
+    bench.sink = fopen("/dev/null", "w");
+
+    printf("%-26s %9s %11s %11s %8s\n", "benchmark", "size", "ns/entry",
+            "fastest", "spread");
+    for (long size = 10; size <= maxSize; size *= 10) {
+        init_bench(&bench, size);
+        for (int i = 0; i < sizeof(benches) / sizeof(MicroBench); ++i) {
+            if (!only || strstr(benches[i].name, only)) {
+                measure(&benches[i], &bench);
+            }
+        }
+        free_bench(&bench);
+    }
+
+    free_buffer(&bench.page);
+    fclose(bench.sink);
+    return checksum == 42 ? 1 : 0;
+}
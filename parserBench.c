@@ -0,0 +1,225 @@
+//
+// Throughput benchmark of the buffered MsgReader against the original
+// fgetc based parser, and of the same messages sent as binary frames.
+// Writes a stream of mapper messages to a temporary file in each form and
+// reports MB/s and messages/s for parsing it.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mapperProtocol.h"
+
+#define DEFAULT_MESSAGES 2000000
+#define RUNS 5
+#define CHUNK_SIZE 80
+
+// The original parse_str, kept here as the baseline.
+static char* legacy_parse_str(FILE* file, int sentinel) {
+
+    int pos = 0;
+    char* str = malloc(sizeof(char) * CHUNK_SIZE);
+
+    while (1) {
+        int next = fgetc(file);
+
+        if (next == sentinel) {
+            str[pos] = '\0';
+            return str;
+
+        } else if (next == EOF) {
+            free(str);
+            return NULL;
+        }
+        if (pos > CHUNK_SIZE - 1) {
+            str = realloc(str, sizeof(int) * pos);
+        }
+        str[pos++] = (char)next;
+    }
+}
+
+// The original read_message, kept here as the baseline. Frees what it
+// parses so the run doesn't measure the heap growing.
+static int legacy_read_message(FILE* in) {
+
+    int type = fgetc(in);
+
+    switch (type) {
+        case PORT_REQUEST:
+            free(legacy_parse_str(in, '\n'));
+            break;
+        case ADD_AIRPORT:
+            free(legacy_parse_str(in, ':'));
+            free(legacy_parse_str(in, '\n'));
+            break;
+        case INFO_REQUEST:
+            free(legacy_parse_str(in, '\n'));
+            break;
+        default:
+            break;
+    }
+    return type;
+}
+
+// Return the current monotonic time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Write count messages (mostly lookups, as real traffic is) to file and
+// return the number of bytes written.
+static long write_messages(FILE* file, long count) {
+
+    long bytes = 0;
+    for (long i = 0; i < count; ++i) {
+        switch (i % 20) {
+            case 0:
+                bytes += fprintf(file, "@\n");
+                break;
+            case 1: case 2: case 3: case 4: case 5:
+                bytes += fprintf(file, "!AP%07ld:%ld\n", i, 1024 + i % 60000);
+                break;
+            default:
+                bytes += fprintf(file, "?AP%07ld\n", i / 3);
+                break;
+        }
+    }
+    fflush(file);
+    return bytes;
+}
+
+// Write the same count messages as write_messages to file as binary
+// frames, after the hello, and return the number of bytes written.
+static long write_frames(FILE* file, long count) {
+
+    Buffer out;
+    init_buffer(&out, 4096);
+    append_buffer(&out, BINARY_HELLO, BINARY_HELLO_LEN);
+    char id[32];
+    for (long i = 0; i < count; ++i) {
+        switch (i % 20) {
+            case 0:
+                append_frame(&out, OP_LIST, NULL, 0);
+                break;
+            case 1: case 2: case 3: case 4: case 5: {
+                uint16_t portNo = 1024 + i % 60000;
+                int len = snprintf(id + 2, sizeof(id) - 2, "AP%07ld", i);
+                id[0] = portNo >> 8;
+                id[1] = portNo & 0xff;
+                append_frame(&out, OP_REGISTER, id, len + 3);
+                break;
+            }
+            default: {
+                int len = snprintf(id, sizeof(id), "AP%07ld", i / 3);
+                append_frame(&out, OP_LOOKUP, id, len + 1);
+                break;
+            }
+        }
+    }
+    fwrite(out.data, 1, out.len, file);
+    fflush(file);
+    long bytes = out.len;
+    free_buffer(&out);
+    return bytes;
+}
+
+// Parse every message in fd with the original parser. Returns the count.
+static long run_legacy(int fd) {
+
+    lseek(fd, 0, SEEK_SET);
+    FILE* in = fdopen(dup(fd), "r");
+    long count = 0;
+    while (legacy_read_message(in) != EOF) {
+        count++;
+    }
+    fclose(in);
+    return count;
+}
+
+// Parse every message in fd with MsgReader. Returns the count.
+static long run_reader(int fd) {
+
+    lseek(fd, 0, SEEK_SET);
+    MsgReader reader;
+    init_reader(&reader, fd);
+    long count = 0;
+    long checksum = 0; // keep the parse from being optimised away
+    while (true) {
+        MapperMsg msg = read_message(&reader);
+        if (msg.type == CONN_CLOSED) {
+            break;
+        }
+        checksum += msg.args.id ? msg.args.id[0] : 0;
+        count++;
+    }
+    free_reader(&reader);
+    return checksum >= 0 ? count : 0;
+}
+
+// Parse every frame in fd with MsgReader. Returns the count.
+static long run_frames(int fd) {
+
+    lseek(fd, 0, SEEK_SET);
+    MsgReader reader;
+    init_reader(&reader, fd);
+    long count = 0;
+    long checksum = 0;
+    if (read_format(&reader) != WIRE_BINARY) {
+        fprintf(stderr, "no hello\n");
+        exit(1);
+    }
+    while (true) {
+        MapperMsg msg;
+        if (!next_message(&reader, WIRE_BINARY, &msg)) {
+            if (fill_reader(&reader) <= 0) {
+                break;
+            }
+            continue;
+        }
+        checksum += msg.args.id ? msg.args.id[0] : 0;
+        count++;
+    }
+    free_reader(&reader);
+    return checksum >= 0 ? count : 0;
+}
+
+// Time the best of RUNS passes of parse over fd and print the result.
+static void report(const char* name, long (*parse)(int), int fd, long bytes) {
+
+    double best = 1e30;
+    long count = 0;
+    for (int i = 0; i < RUNS; ++i) {
+        double start = now();
+        count = parse(fd);
+        double elapsed = now() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    printf("%-8s %8ld msgs %9.1f MB/s %12.0f msgs/s\n", name, count,
+            bytes / best / 1e6, count / best);
+}
+
+int main(int argc, char** argv) {
+
+    long count = argc > 1 ? atol(argv[1]) : DEFAULT_MESSAGES;
+
+    FILE* file = tmpfile();
+    long bytes = write_messages(file, count);
+    int fd = fileno(file);
+
+    printf("%ld messages, %.1f MB\n", count, bytes / 1e6);
+    report("fgetc", run_legacy, fd, bytes);
+    report("reader", run_reader, fd, bytes);
+
+    FILE* frames = tmpfile();
+    bytes = write_frames(frames, count);
+    printf("as frames, %.1f MB\n", bytes / 1e6);
+    report("frames", run_frames, fileno(frames), bytes);
+
+    fclose(frames);
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "portCache.h"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define CACHE_SIZE (sizeof(CacheHeader) + sizeof(CacheEntry) * CACHE_SLOTS)
+
+// An id as it is stored in an entry
+typedef struct {
+    uint64_t words[CACHE_ID_WORDS];
+    uint32_t hash;
+} CacheKey;
+
+// Return the realtime clock in s - shared by every process using the file.
+static int64_t now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec;
+}
+
+// Fill key in from id. Returns false if id is too long to be cached.
+static bool make_key(const char* id, CacheKey* key) {
+
+    size_t len = strlen(id);
+    if (len >= sizeof(key->words)) {
+        return false;
+    }
+    memset(key->words, 0, sizeof(key->words));
+    memcpy(key->words, id, len);
+
+    key->hash = FNV_OFFSET;
+    for (size_t i = 0; i < len; ++i) {
+        key->hash ^= (unsigned char)id[i];
+        key->hash *= FNV_PRIME;
+    }
+    return true;
+}
+
+// Return the first of the CACHE_WAYS slots key may be in.
+static CacheEntry* key_window(PortCache* cache, const CacheKey* key) {
+    return cache->entries + (key->hash & (CACHE_SLOTS - CACHE_WAYS));
+}
+
+// Open the cache at path, creating an empty one if there is no file, and
+// have entries stored through it last ttl s. Returns NULL if the file
+// can't be used.
+PortCache* open_port_cache(const char* path, int ttl) {
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info)) {
+        return NULL;
+    }
+    // racing creators size the file the same, which is harmless
+    if ((info.st_size == 0 && ftruncate(fd, CACHE_SIZE)) ||
+            fstat(fd, &info) || info.st_size != CACHE_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    char* map = mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    CacheHeader* header = (CacheHeader*)map;
+    uint64_t magic = 0;
+    __atomic_compare_exchange_n(&header->magic, &magic, CACHE_MAGIC, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if (magic != 0 && magic != CACHE_MAGIC) {
+        munmap(map, CACHE_SIZE);
+        return NULL;
+    }
+
+    PortCache* cache = malloc(sizeof(PortCache));
+    cache->header = header;
+    cache->entries = (CacheEntry*)(map + sizeof(CacheHeader));
+    cache->ttl = ttl;
+    return cache;
+}
+
+// Unmap cache and free it.
+void close_port_cache(PortCache* cache) {
+    munmap(cache->header, CACHE_SIZE);
+    free(cache);
+}
+
+// Read entry as of a single write into *id, *portNo and *expires. Returns
+// false if a writer had it.
+static bool read_entry(CacheEntry* entry, uint64_t* id, uint32_t* portNo,
+        int64_t* expires) {
+
+    uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return false;
+    }
+    for (int i = 0; i < CACHE_ID_WORDS; ++i) {
+        id[i] = __atomic_load_n(&entry->id[i], __ATOMIC_RELAXED);
+    }
+    *portNo = __atomic_load_n(&entry->portNo, __ATOMIC_RELAXED);
+    *expires = __atomic_load_n(&entry->expires, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// Return the cached port of id, or 0 if it isn't cached or has expired.
+uint16_t cache_lookup(PortCache* cache, const char* id) {
+
+    CacheKey key;
+    if (!make_key(id, &key)) {
+        return 0;
+    }
+    CacheEntry* window = key_window(cache, &key);
+    int64_t now = now_s();
+
+    for (int i = 0; i < CACHE_WAYS; ++i) {
+        uint64_t words[CACHE_ID_WORDS];
+        uint32_t portNo;
+        int64_t expires;
+        if (read_entry(&window[i], words, &portNo, &expires) && portNo &&
+                !memcmp(words, key.words, sizeof(words))) {
+            return expires > now ? portNo : 0;
+        }
+    }
+    return 0;
+}
+
+// Overwrite entry with key's port, if no other writer has it.
+static void write_entry(CacheEntry* entry, const CacheKey* key,
+        uint32_t portNo, int64_t expires) {
+
+    uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&entry->seq, &seq,
+            seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return; // an update lost to a racing one is only a later miss
+    }
+    // keep the id and port from being seen before the odd seq
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int i = 0; i < CACHE_ID_WORDS; ++i) {
+        __atomic_store_n(&entry->id[i], key->words[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&entry->portNo, portNo, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->expires, expires, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Return the slot in key's window to store key in: its own entry if it has
+// one, else an empty or expired one, else the one closest to expiring.
+// Sets *own if it is key's own entry.
+static CacheEntry* choose_slot(PortCache* cache, const CacheKey* key,
+        bool* own) {
+
+    CacheEntry* window = key_window(cache, key);
+    CacheEntry* victim = NULL;
+    int64_t soonest = 0;
+    int64_t now = now_s();
+
+    *own = false;
+    for (int i = 0; i < CACHE_WAYS; ++i) {
+        uint64_t words[CACHE_ID_WORDS];
+        uint32_t portNo;
+        int64_t expires;
+        if (!read_entry(&window[i], words, &portNo, &expires)) {
+            continue;
+        }
+        if (portNo && !memcmp(words, key->words, sizeof(words))) {
+            *own = true;
+            return &window[i];
+        }
+        if (!portNo || expires <= now) {
+            expires = 0;
+        }
+        if (!victim || expires < soonest) {
+            victim = &window[i];
+            soonest = expires;
+        }
+    }
+    return victim;
+}
+
+// Cache portNo as id's port for the next cache->ttl s.
+void cache_store(PortCache* cache, const char* id, uint16_t portNo) {
+
+    CacheKey key;
+    bool own;
+    if (!portNo || !make_key(id, &key)) {
+        return;
+    }
+    CacheEntry* slot = choose_slot(cache, &key, &own);
+    if (slot) {
+        write_entry(slot, &key, portNo, now_s() + cache->ttl);
+    }
+}
+
+// Drop id from cache, e.g. once its cached port is found not to answer.
+void cache_forget(PortCache* cache, const char* id) {
+
+    CacheKey key;
+    bool own;
+    if (!make_key(id, &key)) {
+        return;
+    }
+    CacheEntry* slot = choose_slot(cache, &key, &own);
+    if (slot && own) {
+        write_entry(slot, &key, 0, 0);
+    }
+}
@@ -0,0 +1,54 @@
+//
+// Shared cache of id to port lookups for roc - a memory mapped file any
+// number of roc processes read and update at once, so repeat lookups don't
+// cost a mapper round trip.
+//
+// The file is a header then CACHE_SLOTS fixed size entries, an id hashing
+// to a window of CACHE_WAYS slots. A file of zeroes is an empty cache, so
+// whoever creates it only has to size it. Each entry is guarded by a
+// sequence number, odd while it is being written: readers take no lock and
+// retry (or miss) if it changed under them, writers claim an entry by
+// bumping it from even to odd and give up if someone else has it. Entries
+// expire ttl seconds after they were stored, and are forgotten when the
+// port they give turns out not to answer.
+//
+
+#ifndef SRC_PORTCACHE_H
+#define SRC_PORTCACHE_H
+
+#include <stdint.h>
+
+#define CACHE_MAGIC 0x3148434143545250ull // "PRTCACH1" little endian
+#define CACHE_SLOTS 4096 // a power of two
+#define CACHE_WAYS 8 // slots an id may live in
+#define CACHE_ID_WORDS 6 // ids up to 8 * CACHE_ID_WORDS - 1 chars are cached
+#define DEFAULT_CACHE_TTL 300 // seconds
+#define MAX_CACHE_TTL 2592000 // seconds, thirty days
+
+// At the start of the file, padded to an entry
+typedef struct {
+    uint64_t magic; // 0 until the first opener claims the file
+    uint64_t pad[7];
+} CacheHeader;
+
+// One cached lookup, a cache line in size
+typedef struct {
+    uint32_t seq; // odd while being written
+    uint32_t portNo; // 0 if the entry is empty or forgotten
+    int64_t expires; // on the realtime clock, in s
+    uint64_t id[CACHE_ID_WORDS]; // NUL padded
+} CacheEntry;
+
+typedef struct {
+    CacheHeader* header;
+    CacheEntry* entries;
+    int ttl;
+} PortCache;
+
+PortCache* open_port_cache(const char* path, int ttl);
+void close_port_cache(PortCache* cache);
+uint16_t cache_lookup(PortCache* cache, const char* id);
+void cache_store(PortCache* cache, const char* id, uint16_t portNo);
+void cache_forget(PortCache* cache, const char* id);
+
+#endif //SRC_PORTCACHE_H
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "preload.h"
+
+// One thread's share of the file and the airports parsed from it
+typedef struct {
+    char* start;
+    char* end; // just past the last line, a newline or the end of the file
+    Airport* airports;
+    long count;
+    pthread_t thread;
+} Chunk;
+
+// Read all of the file at path into a NUL terminated buffer, setting *len.
+// Returns NULL if it can't be read.
+static char* read_file(const char* path, size_t* len) {
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        return NULL;
+    } else if (fstat(fd, &info)) {
+        close(fd);
+        return NULL;
+    }
+    char* data = malloc(info.st_size + 1);
+    size_t got = 0;
+    while (got < (size_t)info.st_size) {
+        ssize_t n = read(fd, data + got, info.st_size - got);
+        if (n <= 0) {
+            free(data);
+            close(fd);
+            return NULL;
+        }
+        got += n;
+    }
+    close(fd);
+    data[got] = '\0';
+    *len = got;
+    return data;
+}
+
+// Thread function - split the lines of the chunk pointed to by arg in
+// place into its airports.
+static void* parse_chunk(void* arg) {
+
+    Chunk* chunk = arg;
+    long cap = 1024;
+    chunk->airports = malloc(sizeof(Airport) * cap);
+    chunk->count = 0;
+
+    char* line = chunk->start;
+    while (line < chunk->end) {
+        char* newline = memchr(line, '\n', chunk->end - line);
+        char* next = newline ? newline + 1 : chunk->end;
+        if (newline) {
+            *newline = '\0';
+        }
+        char* colon = strchr(line, ':');
+        if (colon && colon != line && colon[1]) {
+            if (chunk->count == cap) {
+                cap *= 2;
+                chunk->airports = realloc(chunk->airports,
+                        sizeof(Airport) * cap);
+            }
+            *colon = '\0';
+            Airport* airport = &chunk->airports[chunk->count++];
+            airport->id = line;
+            airport->port = colon + 1;
+            airport->info = NULL;
+        }
+        line = next;
+    }
+    return NULL;
+}
+
+// Register the airports listed in the file at path with list, parsing it
+// with threads threads. Call before list is shared. Returns the number of
+// airports registered, or -1 if the file can't be read.
+long preload_airports(AirportList list, const char* path, int threads) {
+
+    size_t len;
+    char* data = read_file(path, &len);
+    if (!data) {
+        return -1;
+    }
+
+    // chunks end at line ends, so a short file may leave some empty
+    Chunk* chunks = malloc(sizeof(Chunk) * threads);
+    char* at = data;
+    for (int i = 0; i < threads; ++i) {
+        char* end = data + len * (i + 1) / threads;
+        if (end < at) {
+            end = at;
+        }
+        char* newline = end < data + len ? memchr(end, '\n',
+                data + len - end) : NULL;
+        end = newline ? newline + 1 : data + len;
+        chunks[i].start = at;
+        chunks[i].end = i == threads - 1 ? data + len : end;
+        at = chunks[i].end;
+        pthread_create(&chunks[i].thread, 0, parse_chunk, &chunks[i]);
+    }
+
+    // put the chunks back together in file order, so the first line for an
+    // id is still first
+    long total = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(chunks[i].thread, NULL);
+        total += chunks[i].count;
+    }
+    Airport* airports = malloc(sizeof(Airport) * (total ? total : 1));
+    long filled = 0;
+    for (int i = 0; i < threads; ++i) {
+        memcpy(airports + filled, chunks[i].airports,
+                sizeof(Airport) * chunks[i].count);
+        filled += chunks[i].count;
+        free(chunks[i].airports);
+    }
+
+    bool* added = malloc(sizeof(bool) * (total ? total : 1));
+    add_airports(list, airports, (int)total, added);
+    long registered = 0;
+    for (long i = 0; i < total; ++i) {
+        registered += added[i];
+    }
+
+    free(added);
+    free(airports);
+    free(chunks);
+    free(data);
+    return registered;
+}
@@ -0,0 +1,16 @@
+//
+// Mapper startup preload - registers every airport in a file of id:port
+// lines, the format of an @ listing, before the mapper takes requests. The
+// file is split between threads to parse, then the table is built from the
+// whole lot in one add_airports. A line without a colon, or with an empty
+// id or port, is skipped; of lines sharing an id the first wins.
+//
+
+#ifndef SRC_PRELOAD_H
+#define SRC_PRELOAD_H
+
+#include "airport.h"
+
+long preload_airports(AirportList list, const char* path, int threads);
+
+#endif //SRC_PRELOAD_H
@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "rcu.h"
+
+#define CACHE_LINE 64
+
+// Per-thread reader state. Padded to a cache line so readers on different
+// cores never write to the same line.
+typedef struct RcuReader {
+    uint64_t epoch; // epoch the current read section began in, 0 if none
+    int nesting;
+    int inUse; // owned by a live thread
+    struct RcuReader* next;
+} __attribute__((aligned(CACHE_LINE))) RcuReader;
+
+static uint64_t globalEpoch = 1;
+static RcuReader* readers = NULL;
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t readerKey;
+static pthread_once_t readerKeyOnce = PTHREAD_ONCE_INIT;
+static __thread RcuReader* self = NULL;
+
+// Thread exit destructor - hand the reader record back for reuse.
+static void release_reader(void* arg) {
+    RcuReader* reader = arg;
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&reader->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void init_reader_key(void) {
+    pthread_key_create(&readerKey, release_reader);
+}
+
+// Claim a reader record for the calling thread, reusing one left behind by
+// an exited thread if possible. Records are never freed.
+static RcuReader* register_reader(void) {
+
+    pthread_once(&readerKeyOnce, init_reader_key);
+    pthread_mutex_lock(&registryLock);
+
+    RcuReader* reader = readers;
+    while (reader && reader->inUse) {
+        reader = reader->next;
+    }
+
+    if (!reader) {
+        if (posix_memalign((void**)&reader, CACHE_LINE, sizeof(RcuReader))) {
+            abort();
+        }
+        reader->epoch = 0;
+        reader->next = readers;
+        __atomic_store_n(&readers, reader, __ATOMIC_RELEASE);
+    }
+    reader->nesting = 0;
+    reader->inUse = 1;
+
+    pthread_mutex_unlock(&registryLock);
+    pthread_setspecific(readerKey, reader);
+    return reader;
+}
+
+// Enter a read side section. Anything loaded from an RCU protected pointer
+// stays valid until the matching rcu_read_unlock. Sections may nest.
+void rcu_read_lock(void) {
+
+    if (!self) {
+        self = register_reader();
+    }
+
+    if (self->nesting++ == 0) {
+        uint64_t epoch = __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED);
+        __atomic_store_n(&self->epoch, epoch, __ATOMIC_RELAXED);
+        // the announcement must be visible before we load anything
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+// Leave a read side section.
+void rcu_read_unlock(void) {
+
+    if (--self->nesting == 0) {
+        __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// Wait until every read side section that was in progress when this was
+// called has finished. Must not be called from inside a read side section.
+void rcu_synchronize(void) {
+
+    uint64_t epoch = __atomic_add_fetch(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&registryLock);
+    for (RcuReader* reader = readers; reader; reader = reader->next) {
+        while (1) {
+            uint64_t seen = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+            if (seen == 0 || seen >= epoch) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&registryLock);
+}
@@ -0,0 +1,16 @@
+//
+// Read-copy-update style reclamation. Readers never block: they announce the
+// epoch they started in on their own cache line. A writer publishes a new
+// version of some structure and then calls rcu_synchronize to wait until
+// every reader that could still see the old version has left its read side
+// section, after which the old version can be freed.
+//
+
+#ifndef SRC_RCU_H
+#define SRC_RCU_H
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_synchronize(void);
+
+#endif //SRC_RCU_H
@@ -4,7 +4,14 @@
 #include <stdbool.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include "mapperProtocol.h"
+#include "shardRing.h"
+#include "portCache.h"
+#include "trace.h"
 
 #define MIN_ARGC 3
 #define PLANE_ID_ARG 1
@@ -12,24 +19,82 @@
 #define MAX_PORT_NO 65535
 #define MIN_PORT_NO 1
 #define NO_MAPPER_PORT "-"
+#define PIPELINE_DEPTH 256 // most lookups in flight to mapper at once
+#define DEFAULT_PARALLEL 16 // most destinations visited at once
+#define DEFAULT_TIMEOUT_MS 5000 // longest a single visit may take
+#define MAX_PARALLEL 4096
+#define MAX_TIMEOUT_MS 3600000 // an hour
+#define REQUEST_SIZE 256
 
 // core components of the control
 typedef struct {
     const char* id;
     const char* info;
-    const char* port;
+    uint16_t portNo; // 0 until looked up, or if the mapper's isn't valid
+    int shard; // mapper shard a port request is out with, else -1
+    bool cached; // portNo came from the port cache
+    bool refused; // connecting to portNo failed
 } Control;
 
 // core components of the roc
 typedef struct {
     const char* planeId;
     const char* mapperPort;
+    ShardRing* shards; // NULL if there is no mapper
     Control* controls; //also acts as roc's log
-    FILE* rocOut;
-    FILE* rocIn;
+    Buffer* rocOut; // lookups waiting to be sent, one per shard
+    MsgReader* rocIn;
+    bool binary; // talk to mappers and controls in binary frames
+    bool* negotiated; // per shard, the mapper has echoed BINARY_HELLO
+    PortCache* cache; // NULL unless asked for
     int destCount;
+    int parallel;
+    int timeoutMs;
 } Roc;
 
+// how far through a destination visit we are
+typedef enum {
+    VISIT_CONNECTING,
+    VISIT_SENDING,
+    VISIT_RECEIVING
+} VisitState;
+
+// A visit in progress to every destination at one port. Repeat visits
+// share the connection: once the control has agreed to keep it alive they
+// are sent together, and the replies come back in order. A control that
+// won't is visited over a connection per destination instead.
+typedef struct {
+    int* dests; // indices into roc->controls, in visiting order
+    int count;
+    int answered;
+    bool keepAlive; // keep-alive was asked for and not refused
+    bool agreed; // the control has echoed KEEP_ALIVE or BINARY_HELLO
+    struct sockaddr_in addr; // the port's, to connect again on
+    int fd;
+    VisitState state;
+    char* msg;
+    size_t msgLen;
+    size_t sent;
+    MsgReader reader;
+    long deadline; // on the monotonic clock, in ms
+} Visit;
+
+// A destination and its port, for grouping destinations by port
+typedef struct {
+    uint16_t portNo;
+    int dest;
+} DestPort;
+
+// startup options
+typedef struct {
+    int parallel;
+    int timeoutMs;
+    bool listAll; // print the merged listing of every mapper shard
+    bool binary;
+    const char* cachePath; // NULL for no port cache
+    int cacheTtl;
+} Options;
+
 typedef struct sockaddr SockAddr;
 typedef struct addrinfo AddrInfo;
 
@@ -40,8 +105,8 @@ typedef enum {
     INV_MAPPER_PORT = 2,
     MAPPER_REQ = 3,
     CONN_FAILED = 4,
-    NO_MAP = 5
-    //todo add exit code 6
+    NO_MAP = 5,
+    DEST_FAILED = 6
 } Status;
 
 // Given code, print the relevant status message and return the code.
@@ -57,117 +122,190 @@ Status print_status(Status code) {
     return code;
 }
 
-// Check arg for any invalid characters. If invalid, exit with code
-// status else return arg.
-const char* validate_arg(char* arg, Status status) {
+// Return true if arg contains any characters that can't be sent in a
+// message.
+bool has_invalid_char(const char* arg) {
 
-    // check if arg contains any invalid characters
     for (int i = 0; i < strlen(arg); ++i) {
         if (arg[i] == '\n' || arg[i] == '\r' || arg[i] == ':') {
-            exit(print_status(status));
+            return true;
         }
     }
+    return false;
+}
+
+// Check arg for any invalid characters. If invalid, exit with code
+// status else return arg.
+const char* validate_arg(char* arg, Status status) {
+
+    if (has_invalid_char(arg)) {
+        exit(print_status(status));
+    }
     return arg;
 }
 
-// If dest is a valid port number true else return false.
-bool is_a_port(char* dest) {
+// Return port as a number, or 0 if it isn't a valid port number.
+uint16_t port_number(const char* port) {
 
     char* end;
-    int portNo = (int)strtoul(dest, &end, 10);
+    unsigned long portNo = strtoul(port, &end, 10);
     if (*end != '\0' || portNo > MAX_PORT_NO || portNo < MIN_PORT_NO) {
-        return false;
+        return 0;
     }
-    return true;
+    return portNo;
 }
 
-// Check if the given arg is a dash or a valid port number. If not valid, exit
-// with code INV_MAPPER_PORT, else return the arg.
-const char* init_mapper_port(char* arg) {
+// If dest is a valid port number true else return false.
+bool is_a_port(char* dest) {
+    return port_number(dest) != 0;
+}
+
+// Check if the given arg is a dash or a shard list - one or more comma
+// separated mapper ports. If not valid, exit with code INV_MAPPER_PORT,
+// else set roc's mapper port and shards from it.
+void init_mapper_port(Roc* roc, char* arg) {
 
     // check if it's a dash
     if (!strcmp(arg, "-")) {
-        return NO_MAPPER_PORT;
+        roc->mapperPort = NO_MAPPER_PORT;
+        roc->shards = NULL;
+        return;
+    }
 
-        // check if it's a valid port number
-    } else if (!is_a_port(arg)) {
+    // check if it's a list of valid port numbers
+    roc->shards = init_shard_ring(arg);
+    if (!roc->shards) {
         exit(print_status(INV_MAPPER_PORT));
     }
+    roc->mapperPort = arg;
+}
 
-    return arg;
+// Connect roc to mapper shard. In binary mode the hello goes out with the
+// first lookups rather than costing a round trip of its own. If the shard
+// can't be reached exit with code CONN_FAILED.
+void connect_mapper(Roc* roc, int shard) {
+
+    int sockfd = connect_shard(roc->shards, shard);
+    TRACE2(roc, connect_mapper, shard, sockfd);
+    if (sockfd < 0) {
+        exit(print_status(CONN_FAILED));
+    }
+    roc->rocIn[shard].fd = sockfd;
+    if (roc->binary) {
+        append_buffer(&roc->rocOut[shard], BINARY_HELLO, BINARY_HELLO_LEN);
+    }
 }
 
-// Initialise the client to connect to mapper and assign the file relevant
-// pointers to roc.
+// Initialise the client's connection to every mapper shard. With a port
+// cache a shard is only connected to once it has a lookup to answer, so
+// mappers only ever see cache misses.
 void init_client(Roc* roc) {
 
-    if (!strcmp(roc->mapperPort, NO_MAPPER_PORT)) {
+    if (!roc->shards) {
+        roc->rocOut = NULL;
         return;
     }
 
-    AddrInfo* ai = 0;
-    AddrInfo hints;
-
-    memset(&hints, 0, sizeof(AddrInfo));
-    hints.ai_family = AF_INET; // IPv4  for generic could use AF_UNSPEC
-    hints.ai_socktype = SOCK_STREAM;
+    roc->rocOut = malloc(sizeof(Buffer) * roc->shards->count);
+    roc->rocIn = malloc(sizeof(MsgReader) * roc->shards->count);
+    roc->negotiated = calloc(roc->shards->count, sizeof(bool));
 
-    int err = getaddrinfo("localhost", roc->mapperPort, &hints, &ai);
-    if (err) {
-        freeaddrinfo(ai);
-        exit(print_status(MAPPER_REQ));
+    for (int i = 0; i < roc->shards->count; ++i) {
+        init_buffer(&roc->rocOut[i], REQUEST_SIZE);
+        init_reader(&roc->rocIn[i], -1);
+        if (!roc->cache) {
+            connect_mapper(roc, i);
+        }
     }
+}
 
-    // returns a socket file descriptor
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+// Read the response to a port request from shard. If it is a semi colon or
+// OP_NO_PORT return 0 if missingOk is true, otherwise (or if the mapper hung
+// up) exit with code NO_MAP. Else return the port, 0 if it isn't a valid
+// one. If a binary hello isn't echoed exit with code CONN_FAILED.
+uint16_t read_port(Roc* roc, int shard, bool missingOk) {
 
-    if (connect(sockfd, (SockAddr*)ai->ai_addr, sizeof(SockAddr))) {
-        exit(print_status(CONN_FAILED));
+    MsgReader* reader = &roc->rocIn[shard];
+
+    if (!roc->binary) {
+        const char* response = read_line(reader);
+        if (response && missingOk && !strcmp(response, ";")) {
+            return 0;
+        } else if (!response || !strcmp(response, ";")) {
+            exit(print_status(NO_MAP));
+        }
+        return port_number(response);
     }
 
-    // we want separate streams (which we can close independently)
-    roc->rocOut = fdopen(sockfd, "w");
-    roc->rocIn = fdopen(dup(sockfd), "r");
-}
+    if (!roc->negotiated[shard]) {
+        if (read_format(reader) != WIRE_BINARY) {
+            exit(print_status(CONN_FAILED));
+        }
+        roc->negotiated[shard] = true;
+    }
 
-// Parse response from file. If it is a semi colon exit with code NO_MAP else
-// return response.
-const char* read_response(FILE* file) {
+    Frame frame;
+    int got = read_frame(reader, &frame);
+    if (got > 0 && missingOk && frame.op == OP_NO_PORT) {
+        return 0;
+    } else if (got <= 0 || frame.op != OP_PORT || frame.len != 2) {
+        exit(print_status(NO_MAP));
+    }
+    const unsigned char* port = (const unsigned char*)frame.data;
+    return port[0] << 8 | port[1];
+}
 
-    const char* response = parse_str(file, '\n');
+// Return true if dest can be visited by roc - it is a port, or an id and
+// roc has a mapper to look it up with.
+bool is_valid_dest(Roc* roc, char* dest) {
 
-    if (!strcmp(response, ";")) {
-        exit(print_status(NO_MAP));
+    if (has_invalid_char(dest)) {
+        return false;
     }
+    return is_a_port(dest) || strcmp(roc->mapperPort, NO_MAPPER_PORT);
+}
+
+// Queue a request for control's port to the mapper shard that owns its
+// id, to be read back by resolve_ports.
+void request_port(Roc* roc, Control* control) {
 
-    return response;
+    control->shard = shard_for(roc->shards, control->id);
+    if (roc->rocIn[control->shard].fd < 0) {
+        connect_mapper(roc, control->shard);
+    }
+    Buffer* out = &roc->rocOut[control->shard];
+    if (roc->binary) {
+        append_frame(out, OP_LOOKUP, control->id, strlen(control->id) + 1);
+    } else {
+        append_buffer(out, "?", 1);
+        append_str(out, control->id);
+        append_buffer(out, "\n", 1);
+    }
 }
 
-// Given roc, check if dest is a valid port. If it is assign it otherwise
-// send the id to request the port from mapper. Initialise all other control
-// elements and return control.
+// Given roc and a valid dest, if dest is a port assign it, if it is an id
+// in the port cache take its port from there, otherwise request its port
+// from mapper. Initialise all other control elements and return control.
 Control init_control(Roc* roc, char* dest) {
 
-    validate_arg(dest, MAPPER_REQ);
-
     Control control;
+    control.shard = -1;
+    control.cached = false;
+    control.refused = false;
 
     if (is_a_port(dest)) {
         // dest is a valid port
         control.id = NULL;
-        control.port = dest;
+        control.portNo = port_number(dest);
 
     } else {
-        // dest is an id, request its port from mapper
-        if (!strcmp(roc->mapperPort, NO_MAPPER_PORT)) {
-            exit(print_status(MAPPER_REQ));
-        }
-
+        // dest is an id
         control.id = dest;
-        fprintf(roc->rocOut, "?%s\n", control.id);
-        fflush(roc->rocOut);
-
-        control.port = read_response(roc->rocIn);
+        control.portNo = roc->cache ? cache_lookup(roc->cache, dest) : 0;
+        control.cached = control.portNo != 0;
+        if (!control.cached) {
+            request_port(roc, &control);
+        }
     }
 
     control.info = NULL;
@@ -175,22 +313,70 @@ Control init_control(Roc* roc, char* dest) {
     return control;
 }
 
-// init DEST_COUNT number of controls
+// Send the queued port requests for controls [from, to) and read back the
+// responses. Each shard answers in request order, so reading them in
+// control order pairs every response with its request. If missingOk is
+// true a control the mapper doesn't know is left with port 0, see
+// read_port.
+void resolve_ports(Roc* roc, int from, int to, bool missingOk) {
+
+    if (!roc->rocOut) {
+        return;
+    }
+    // a failed send shows up as the mapper hanging up
+    for (int i = 0; i < roc->shards->count; ++i) {
+        if (roc->rocOut[i].len) {
+            TRACE2(roc, flush, i, roc->rocOut[i].len);
+            send_buffer(roc->rocIn[i].fd, &roc->rocOut[i]);
+        }
+    }
+
+    for (int i = from; i < to; ++i) {
+        Control* control = &roc->controls[i];
+        if (control->shard >= 0) {
+            control->portNo = read_port(roc, control->shard, missingOk);
+            TRACE2(roc, port, control->shard, control->portNo);
+            control->shard = -1;
+            if (roc->cache) {
+                cache_store(roc->cache, control->id, control->portNo);
+            }
+        }
+    }
+}
+
+// init DEST_COUNT number of controls. Port requests are pipelined so up to
+// PIPELINE_DEPTH lookups cost mapper a single round trip.
 void init_controls(Roc* roc, int argc, char** argv) {
 
     roc->destCount = argc - MIN_ARGC;
 
     roc->controls = malloc(sizeof(Control) * roc->destCount);
 
-    if (roc->destCount > 0) {
-        for (int i = 0; i < roc->destCount; ++i) {
-            roc->controls[i] = init_control(roc, argv[i + (MIN_ARGC)]);
+    int resolved = 0; // controls before this have their ports
+    for (int i = 0; i < roc->destCount; ++i) {
+        char* dest = argv[i + (MIN_ARGC)];
+
+        if (!is_valid_dest(roc, dest)) {
+            // failed lookups before this dest are reported first, just as
+            // if they had been made one at a time
+            resolve_ports(roc, resolved, i, false);
+            exit(print_status(MAPPER_REQ));
+        }
+        roc->controls[i] = init_control(roc, dest);
+
+        if (i + 1 - resolved == PIPELINE_DEPTH) {
+            resolve_ports(roc, resolved, i + 1, false);
+            resolved = i + 1;
         }
     }
+    resolve_ports(roc, resolved, roc->destCount, false);
 }
 
-// Check program arguments, initialise roc and return a pointer to it.
-Roc* init_roc(int argc, char** argv) {
+// Check program arguments, initialise roc and return a pointer to it. Roc
+// talks to mappers and controls in binary frames if options ask for it,
+// and looks ids up in their port cache first if they name one. A cache
+// that can't be opened is done without.
+Roc* init_roc(int argc, char** argv, const Options* options) {
 
     if (argc < MIN_ARGC) {
         exit(print_status(INV_ARGC));
@@ -200,16 +386,28 @@ Roc* init_roc(int argc, char** argv) {
 
     // NORMAL_OP so it prints nothing (but function remains general)
     roc->planeId = validate_arg(argv[PLANE_ID_ARG], NORMAL_OP);
-    roc->mapperPort = init_mapper_port(argv[MAPPER_PORT_ARG]);
+    roc->binary = options->binary;
+    roc->cache = NULL;
+    init_mapper_port(roc, argv[MAPPER_PORT_ARG]);
+    if (options->cachePath && roc->shards) {
+        roc->cache = open_port_cache(options->cachePath, options->cacheTtl);
+    }
     init_client(roc);
     init_controls(roc, argc, argv);
 
     return roc;
 }
 
-// Initialise a client connection to communicate with control with
-// port destPort. Assign the file pointers to roc for later communication.
-void init_control_client(Roc* roc, const char* destPort) {
+// Return the monotonic clock in ms.
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Resolve localhost once for every visit into addr. Returns false if it
+// can't be resolved.
+bool resolve_localhost(struct sockaddr_in* addr) {
 
     AddrInfo* ai = 0;
     AddrInfo hints;
@@ -218,70 +416,521 @@ void init_control_client(Roc* roc, const char* destPort) {
     hints.ai_family = AF_INET; // IPv4  for generic could use AF_UNSPEC
     hints.ai_socktype = SOCK_STREAM;
 
-    int err = getaddrinfo("localhost", destPort, &hints, &ai);
-    if (err) {
-        return;
+    if (getaddrinfo("localhost", NULL, &hints, &ai)) {
+        return false;
     }
+    memcpy(addr, ai->ai_addr, sizeof(struct sockaddr_in));
+    freeaddrinfo(ai);
+    return true;
+}
 
-    // returns a socket file descriptor
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (connect(sockfd, (SockAddr*)ai->ai_addr, sizeof(SockAddr))) {
-        return;
+// Build the next message to send on visit's connection, replacing the
+// last. In binary mode it is the hello and an OP_ARRIVE frame per
+// destination. In text it is the keep-alive request alone until the
+// control answers it, then the plane id once per destination left - or
+// just once if the connection won't be kept alive.
+void build_visit_msg(Roc* roc, Visit* visit) {
+
+    size_t idLen = strlen(roc->planeId);
+    int ids = visit->agreed ? visit->count - visit->answered : 1;
+    Buffer msg;
+    init_buffer(&msg, REQUEST_SIZE);
+
+    if (roc->binary) {
+        append_buffer(&msg, BINARY_HELLO, BINARY_HELLO_LEN);
+        for (int i = 0; i < visit->count; ++i) {
+            append_frame(&msg, OP_ARRIVE, roc->planeId, idLen + 1);
+        }
+    } else if (visit->keepAlive && !visit->agreed) {
+        append_str(&msg, KEEP_ALIVE "\n");
+    } else {
+        for (int i = 0; i < ids; ++i) {
+            append_buffer(&msg, roc->planeId, idLen);
+            append_buffer(&msg, "\n", 1);
+        }
+    }
+    free(visit->msg);
+    visit->msg = msg.data;
+    visit->msgLen = msg.len;
+    visit->sent = 0;
+}
+
+// Record that connecting to the port of the count destinations in dests
+// failed, so any cached ones may be looked up again.
+void refuse_dests(Roc* roc, int* dests, int count) {
+    for (int i = 0; i < count; ++i) {
+        roc->controls[dests[i]].refused = true;
+    }
+}
+
+// Start a non-blocking connect to visit's port for the destinations it
+// has left, with a deadline of its own. Returns false, with no connection,
+// if it failed straight away.
+bool open_visit_conn(Roc* roc, Visit* visit) {
+
+    int left = visit->count - visit->answered;
+    visit->deadline = now_ms() + roc->timeoutMs;
+    visit->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (visit->fd < 0) {
+        return false;
+    }
+    TRACE2(roc, visit_start, ntohs(visit->addr.sin_port), left);
+
+    if (!connect(visit->fd, (SockAddr*)&visit->addr, sizeof(visit->addr))) {
+        visit->state = VISIT_SENDING;
+    } else if (errno == EINPROGRESS) {
+        visit->state = VISIT_CONNECTING;
+    } else {
+        refuse_dests(roc, visit->dests + visit->answered, left);
+        close(visit->fd);
+        visit->fd = -1;
+        return false;
+    }
+    build_visit_msg(roc, visit);
+    init_reader(&visit->reader, visit->fd);
+    return true;
+}
+
+// Begin visiting the count destinations in dests, which share a port:
+// start a non-blocking connect to it on addr. Returns false if the visit
+// failed straight away.
+bool start_visit(Roc* roc, Visit* visit, int* dests, int count,
+        struct sockaddr_in addr) {
+
+    uint16_t portNo = roc->controls[dests[0]].portNo;
+    if (!portNo) {
+        return false;
+    }
+    visit->addr = addr;
+    visit->addr.sin_port = htons(portNo);
+    visit->dests = dests;
+    visit->count = count;
+    visit->answered = 0;
+    visit->keepAlive = count > 1;
+    visit->agreed = false;
+    visit->msg = NULL;
+    return open_visit_conn(roc, visit);
+}
+
+// Close visit's connection.
+void close_visit_conn(Visit* visit) {
+    free_reader(&visit->reader);
+    close(visit->fd);
+    visit->fd = -1;
+}
+
+// End visit, closing its connection if it still has one.
+void end_visit(Visit* visit) {
+    free(visit->msg);
+    if (visit->fd >= 0) {
+        close_visit_conn(visit);
+    }
+}
+
+// The poll events visit is waiting for.
+short visit_events(Visit* visit) {
+    return visit->state == VISIT_RECEIVING ? POLLIN : POLLOUT;
+}
+
+// Record that visit's next destination answered with info. Returns true
+// once every destination has.
+bool answer_dest(Roc* roc, Visit* visit, const char* info) {
+
+    int dest = visit->dests[visit->answered++];
+    TRACE1(roc, answer, dest);
+    roc->controls[dest].info = strdup(info);
+    return visit->answered == visit->count;
+}
+
+// Take the text replies already read for visit, one line per destination.
+// The first answers the keep-alive request if there was one: an echo and
+// the plane ids go out together next, otherwise the control took it for a
+// plane id and the line is its answer, and the connection is closed after
+// each destination from then on. Returns true once the visit is over.
+bool take_lines(Roc* roc, Visit* visit) {
+
+    const char* destInfo;
+    while ((destInfo = next_line(&visit->reader))) {
+        if (visit->keepAlive && !visit->agreed) {
+            if (!strcmp(destInfo, KEEP_ALIVE)) {
+                visit->agreed = true;
+                build_visit_msg(roc, visit);
+                visit->state = VISIT_SENDING;
+                return false;
+            }
+            visit->keepAlive = false;
+        }
+        if (answer_dest(roc, visit, destInfo)) {
+            return true;
+        }
+        if (!visit->keepAlive) {
+            // the control hangs up after one, so go again for the next
+            close_visit_conn(visit);
+            return !open_visit_conn(roc, visit);
+        }
+    }
+    return false;
+}
+
+// Take the binary replies already read for visit, the echoed hello then an
+// OP_INFO frame per destination. Returns true once the visit is over.
+bool take_frames(Roc* roc, Visit* visit) {
+
+    if (!visit->agreed) {
+        WireFormat format = next_format(&visit->reader);
+        if (format != WIRE_BINARY) {
+            return format != WIRE_PENDING; // control doesn't talk binary
+        }
+        visit->agreed = true;
     }
 
-    // we want separate streams (which we can close independently)
-    roc->rocOut = fdopen(sockfd, "w");
-    roc->rocIn = fdopen(dup(sockfd), "r");
+    Frame frame;
+    int got;
+    while ((got = next_frame(&visit->reader, &frame)) > 0) {
+        const char* destInfo = frame_string(&frame);
+        if (frame.op != OP_INFO || !destInfo) {
+            return true;
+        }
+        if (answer_dest(roc, visit, destInfo)) {
+            return true;
+        }
+    }
+    return got < 0;
 }
 
-// Connect to destPort, send the airplane id. Attempt to read back the info
-// and return it.
-const char* conn_to_dest(Roc* roc, const char* destPort) {
+// Move visit on as far as it will go now that its fd is ready. Returns true
+// once the visit is over - each control answered has its info set.
+bool advance_visit(Roc* roc, Visit* visit) {
+
+    if (visit->state == VISIT_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(visit->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            refuse_dests(roc, visit->dests, visit->count);
+            return true;
+        }
+        visit->state = VISIT_SENDING;
+    }
+
+    if (visit->state == VISIT_SENDING) {
+        // send plane id to control
+        ssize_t n = write(visit->fd, visit->msg + visit->sent,
+                visit->msgLen - visit->sent);
+        if (n < 0) {
+            return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+        }
+        visit->sent += n;
+        if (visit->sent < visit->msgLen) {
+            return false;
+        }
+        visit->state = VISIT_RECEIVING;
+        return false; // wait for the reply
+    }
+
+    // read back the destination info, one reply per destination
+    ssize_t n = fill_reader(&visit->reader);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    if (roc->binary ? take_frames(roc, visit) : take_lines(roc, visit)) {
+        return true;
+    }
+    return n <= 0; // hung up or failed without a full reply
+}
 
-    init_control_client(roc, destPort);
+// Order destinations by port, then by index - for use with qsort.
+int compare_dest_ports(const void* a, const void* b) {
 
-    // send plane id to control
-    fprintf(roc->rocOut, "%s\n", roc->planeId);
-    fflush(roc->rocOut);
+    const DestPort* first = a;
+    const DestPort* second = b;
+    if (first->portNo != second->portNo) {
+        return first->portNo - second->portNo;
+    }
+    return first->dest - second->dest;
+}
 
-    // read back the destination info
-    const char* destInfo = parse_str(roc->rocIn, '\n');
+// Group the count destinations in dests by port so each port is visited
+// once. Returns the indices ordered by port in *order, and the start of
+// each group in *groups, followed by count. Returns the number of groups.
+int group_dests(Roc* roc, const int* dests, int count, int** order,
+        int** groups) {
 
-    //todo validate destInfo - if invalid set to null then when printing
-    // only print if not null
+    DestPort* byPort = malloc(sizeof(DestPort) * count);
+    for (int i = 0; i < count; ++i) {
+        byPort[i].portNo = roc->controls[dests[i]].portNo;
+        byPort[i].dest = dests[i];
+    }
+    qsort(byPort, count, sizeof(DestPort), compare_dest_ports);
+
+    *order = malloc(sizeof(int) * count);
+    *groups = malloc(sizeof(int) * (count + 1));
+    int groupCount = 0;
+    for (int i = 0; i < count; ++i) {
+        (*order)[i] = byPort[i].dest;
+        if (i == 0 || byPort[i].portNo != byPort[i - 1].portNo) {
+            (*groups)[groupCount++] = i;
+        }
+    }
+    (*groups)[groupCount] = count;
 
-    return destInfo;
+    free(byPort);
+    return groupCount;
 }
 
-// Given roc, connect to each destination in the list of controls and assign
-// the control's info.
-void conn_to_dests(Roc* roc) {
+// Given roc, connect to each of the count destinations in dests and assign
+// the control's info. Destinations sharing a port are visited over one
+// connection. Up to roc->parallel ports are visited at once; one that takes
+// longer than roc->timeoutMs is given up on. Returns true if every
+// destination was visited.
+bool conn_to_dests(Roc* roc, const int* dests, int count) {
     //now roc knows all port nos for its destinations
 
-    if (roc->destCount > 0) {
-        for (int i = 0; i < roc->destCount; ++i) {
-            const char* destPort = roc->controls[i].port;
-            roc->controls[i].info = conn_to_dest(roc, destPort);
+    struct sockaddr_in addr;
+    if (count == 0) {
+        return true;
+    } else if (!resolve_localhost(&addr)) {
+        return false;
+    }
+
+    int* order;
+    int* groups;
+    int groupCount = group_dests(roc, dests, count, &order, &groups);
+
+    Visit* visits = malloc(sizeof(Visit) * roc->parallel);
+    struct pollfd* fds = malloc(sizeof(struct pollfd) * roc->parallel);
+    int active = 0;
+    int next = 0;
+
+    while (next < groupCount || active > 0) {
+
+        // keep as many visits going as we are allowed
+        while (active < roc->parallel && next < groupCount) {
+            int* dests = order + groups[next];
+            int count = groups[next + 1] - groups[next];
+            next++;
+            if (start_visit(roc, &visits[active], dests, count, addr)) {
+                active++;
+            }
+        }
+        if (active == 0) {
+            continue;
+        }
+
+        // wait for the first visit that can make progress or time out
+        long now = now_ms();
+        long wait = visits[0].deadline - now;
+        for (int i = 0; i < active; ++i) {
+            fds[i].fd = visits[i].fd;
+            fds[i].events = visit_events(&visits[i]);
+            if (visits[i].deadline - now < wait) {
+                wait = visits[i].deadline - now;
+            }
+        }
+        if (poll(fds, active, wait > 0 ? wait : 0) < 0 && errno != EINTR) {
+            break;
+        }
+
+        now = now_ms();
+        for (int i = 0; i < active; ++i) {
+            bool done = now >= visits[i].deadline;
+            if (fds[i].revents) {
+                done = advance_visit(roc, &visits[i]) || done;
+            }
+            if (done) {
+                // fill the gap with the last visit
+                end_visit(&visits[i]);
+                visits[i] = visits[--active];
+                fds[i] = fds[active];
+                --i;
+            }
+        }
+    }
+
+    free(fds);
+    free(visits);
+    free(order);
+    free(groups);
+
+    for (int i = 0; i < count; ++i) {
+        if (!roc->controls[dests[i]].info) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Visit every one of roc's destinations. A cached port that couldn't be
+// connected to is taken to be stale: it is dropped from the cache, looked
+// up again and, if mapper now gives a different port, visited there. If
+// mapper no longer knows it, it is skipped like any destination that
+// couldn't be visited.
+// Returns true if every destination was visited.
+bool visit_all(Roc* roc) {
+
+    int* dests = malloc(sizeof(int) * roc->destCount);
+    for (int i = 0; i < roc->destCount; ++i) {
+        dests[i] = i;
+    }
+    bool visitedAll = conn_to_dests(roc, dests, roc->destCount);
+    if (visitedAll || !roc->cache) {
+        free(dests);
+        return visitedAll;
+    }
+
+    // dests is reused for the stale ones, their old ports kept in ports
+    uint16_t* ports = malloc(sizeof(uint16_t) * roc->destCount);
+    int stale = 0;
+    int resolved = 0; // controls before this have their ports
+    for (int i = 0; i < roc->destCount; ++i) {
+        Control* control = &roc->controls[i];
+        if (control->cached && control->refused && !control->info) {
+            cache_forget(roc->cache, control->id);
+            ports[stale] = control->portNo;
+            dests[stale++] = i;
+            request_port(roc, control);
+        }
+        if (stale - resolved == PIPELINE_DEPTH) {
+            resolve_ports(roc, dests[resolved], i + 1, true);
+            resolved = stale;
         }
     }
+    if (stale > resolved) {
+        resolve_ports(roc, dests[resolved], roc->destCount, true);
+    }
 
+    // one the mapper no longer knows is just another failed destination
+    int moved = 0;
+    for (int i = 0; i < stale; ++i) {
+        uint16_t portNo = roc->controls[dests[i]].portNo;
+        if (portNo && portNo != ports[i]) {
+            dests[moved++] = dests[i];
+        }
+    }
+    conn_to_dests(roc, dests, moved);
+    free(ports);
+    free(dests);
+
+    for (int i = 0; i < roc->destCount; ++i) {
+        if (!roc->controls[i].info) {
+            return false;
+        }
+    }
+    return true;
 }
 
-// Print to stdout the list of controls/airports this roc has visited.
+// Print to stdout the list of controls/airports this roc has visited, in
+// the order they were given.
 void print_log(Roc* roc) {
 
     for (int i = 0; i < roc->destCount; ++i) {
-        fprintf(stdout, "%s\n", roc->controls[i].info);
+        if (roc->controls[i].info) {
+            fprintf(stdout, "%s\n", roc->controls[i].info);
+        }
     }
     fflush(stdout);
 
 }
 
+// Print to stdout the @ listing of every mapper shard merged into one, as
+// a single mapper would list them. If there is no mapper exit with code
+// MAPPER_REQ, if a shard can't be reached with code CONN_FAILED.
+void print_listing(Roc* roc) {
+
+    if (!roc->shards) {
+        exit(print_status(MAPPER_REQ));
+    }
+
+    Buffer listing;
+    init_buffer(&listing, 4096);
+    if (!gather_listing(roc->shards, &listing)) {
+        exit(print_status(CONN_FAILED));
+    }
+    fwrite(listing.data, 1, listing.len, stdout);
+    fflush(stdout);
+    free_buffer(&listing);
+}
+
+// Return arg as a whole number from 1 to max, or -1 if it isn't one.
+long parse_count(const char* arg, long max) {
+
+    char* end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno || value < 1 || value > max) {
+        return -1;
+    }
+    return value;
+}
+
+// Parse the leading command line options into options. If they are invalid
+// exit with code INV_ARGC. Returns the index of the first positional arg.
+int parse_options(int argc, char** argv, Options* options) {
+
+    options->parallel = DEFAULT_PARALLEL;
+    options->timeoutMs = DEFAULT_TIMEOUT_MS;
+    options->listAll = false;
+    options->binary = false;
+    options->cachePath = NULL;
+    options->cacheTtl = DEFAULT_CACHE_TTL;
+
+    int opt;
+    long count = 0;
+    // + stops at the first positional arg so ids are never taken as options
+    while ((opt = getopt(argc, argv, "+j:t:abc:e:")) != -1) {
+        switch (opt) {
+            case 'j':
+                count = parse_count(optarg, MAX_PARALLEL);
+                options->parallel = (int)count;
+                break;
+            case 't':
+                count = parse_count(optarg, MAX_TIMEOUT_MS);
+                options->timeoutMs = (int)count;
+                break;
+            case 'a':
+                options->listAll = true;
+                break;
+            case 'b':
+                options->binary = true;
+                break;
+            case 'c':
+                options->cachePath = optarg;
+                break;
+            case 'e':
+                count = parse_count(optarg, MAX_CACHE_TTL);
+                options->cacheTtl = (int)count;
+                break;
+            default:
+                exit(print_status(INV_ARGC));
+        }
+        if (count < 0) {
+            exit(print_status(INV_ARGC));
+        }
+    }
+    return optind;
+}
+
 int main(int argc, char** argv) {
 
-    Roc* roc = init_roc(argc, argv);
-    conn_to_dests(roc);
+    Options options;
+    int first = parse_options(argc, argv, &options);
+
+    // shift the args so the positional ones start at index 1 as usual
+    argc -= first - 1;
+    argv += first - 1;
+
+    Roc* roc = init_roc(argc, argv, &options);
+    roc->parallel = options.parallel;
+    roc->timeoutMs = options.timeoutMs;
+    if (options.listAll) {
+        print_listing(roc);
+    }
+
+    bool visitedAll = visit_all(roc);
     print_log(roc);
 
+    if (!visitedAll) {
+        return print_status(DEST_FAILED);
+    }
     return NORMAL_OP;
-}
\ No newline at end of file
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "shardRing.h"
+#include "mapperProtocol.h"
+
+#define MAX_PORT_NO 65535
+#define MIN_PORT_NO 1
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+// Return the hash of str, FNV-1a with a final mix so nearby strings like
+// the vnode names of one shard land far apart on the ring.
+static uint32_t ring_hash(const char* str) {
+
+    uint32_t hash = FNV_OFFSET;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= FNV_PRIME;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Return true if port is a valid port number.
+static bool valid_port(const char* port) {
+
+    char* end;
+    unsigned long portNo = strtoul(port, &end, 10);
+    return *port && *end == '\0' && portNo <= MAX_PORT_NO &&
+            portNo >= MIN_PORT_NO;
+}
+
+// Order ring points - for use with qsort. Ties are vanishingly rare and go
+// by position in the shard list.
+static int compare_points(const void* a, const void* b) {
+
+    const RingPoint* first = a;
+    const RingPoint* second = b;
+    if (first->point != second->point) {
+        return first->point < second->point ? -1 : 1;
+    }
+    return first->shard - second->shard;
+}
+
+// Build the ring for the shard list, a comma separated list of ports.
+// Returns NULL if any of them isn't a valid port.
+ShardRing* init_shard_ring(const char* list) {
+
+    ShardRing* ring = malloc(sizeof(ShardRing));
+    ring->count = 1;
+    for (const char* at = list; *at; ++at) {
+        ring->count += *at == ',';
+    }
+    ring->ports = malloc(sizeof(char*) * ring->count);
+
+    char* copy = strdup(list);
+    char* rest = copy;
+    for (int i = 0; i < ring->count; ++i) {
+        ring->ports[i] = strsep(&rest, ",");
+        if (!valid_port(ring->ports[i])) {
+            free(copy);
+            free(ring->ports);
+            free(ring);
+            return NULL;
+        }
+    }
+
+    ring->ringSize = ring->count * SHARD_VNODES;
+    ring->ring = malloc(sizeof(RingPoint) * ring->ringSize);
+    char name[32];
+    for (int i = 0; i < ring->count; ++i) {
+        for (int v = 0; v < SHARD_VNODES; ++v) {
+            snprintf(name, sizeof(name), "%s#%d", ring->ports[i], v);
+            ring->ring[i * SHARD_VNODES + v].point = ring_hash(name);
+            ring->ring[i * SHARD_VNODES + v].shard = i;
+        }
+    }
+    qsort(ring->ring, ring->ringSize, sizeof(RingPoint), compare_points);
+    return ring;
+}
+
+// Return the index of the shard owning id - the first point at or after
+// its hash, wrapping round.
+int shard_for(const ShardRing* ring, const char* id) {
+
+    uint32_t hash = ring_hash(id);
+    int low = 0;
+    int high = ring->ringSize;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (ring->ring[mid].point < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return ring->ring[low == ring->ringSize ? 0 : low].shard;
+}
+
+// Connect to the given shard on localhost. Returns the socket or -1.
+int connect_shard(const ShardRing* ring, int shard) {
+
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo("localhost", ring->ports[shard], &hints, &ai)) {
+        return -1;
+    }
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd >= 0 && connect(sockfd, ai->ai_addr, ai->ai_addrlen)) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(ai);
+    return sockfd;
+}
+
+// Return true if the id of entry a, an "id:port" line, sorts before b's.
+// Compares ids only - ':' would otherwise sort between digits and letters.
+static bool entry_before(const char* a, const char* b) {
+
+    while (*a == *b && *a != ':' && *a) {
+        a++;
+        b++;
+    }
+    int first = *a == ':' ? '\0' : (unsigned char)*a;
+    int second = *b == ':' ? '\0' : (unsigned char)*b;
+    return first < second;
+}
+
+// Fetch the @ listing of every shard and append them to out merged into
+// one sorted listing, as a single mapper would send it. Shards own
+// disjoint ids so nothing needs deduplicating. Returns false if a shard
+// couldn't be reached.
+bool gather_listing(const ShardRing* ring, Buffer* out) {
+
+    MsgReader* readers = malloc(sizeof(MsgReader) * ring->count);
+    const char** heads = malloc(sizeof(char*) * ring->count);
+    bool reached = true;
+
+    // ask every shard before reading any, so they all work at once
+    for (int i = 0; i < ring->count; ++i) {
+        int sockfd = connect_shard(ring, i);
+        if (sockfd < 0 || write(sockfd, "@\n", 2) != 2) {
+            reached = false;
+        } else {
+            shutdown(sockfd, SHUT_WR);
+        }
+        init_reader(&readers[i], sockfd);
+    }
+
+    for (int i = 0; i < ring->count; ++i) {
+        heads[i] = readers[i].fd >= 0 ? read_line(&readers[i]) : NULL;
+    }
+
+    // few shards, so a scan for the smallest head beats keeping a heap
+    while (true) {
+        int next = -1;
+        for (int i = 0; i < ring->count; ++i) {
+            if (heads[i] && (next < 0 || entry_before(heads[i], heads[next]))) {
+                next = i;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        append_str(out, heads[next]);
+        append_buffer(out, "\n", 1);
+        heads[next] = read_line(&readers[next]);
+    }
+
+    for (int i = 0; i < ring->count; ++i) {
+        if (readers[i].fd >= 0) {
+            close(readers[i].fd);
+        }
+        free_reader(&readers[i]);
+    }
+    free(readers);
+    free(heads);
+    return reached;
+}
@@ -0,0 +1,36 @@
+//
+// Client side routing for a cluster of mapper shards. A shard list is a
+// comma separated list of mapper ports; each shard is placed on a hash
+// ring at SHARD_VNODES points and owns the ids that hash to just before its
+// points. Adding a shard only takes over the ids next to its own points,
+// about 1 / shards of them, and every client given the same set of shards
+// routes the same way whatever order they are listed in.
+//
+
+#ifndef SRC_SHARDRING_H
+#define SRC_SHARDRING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "buffer.h"
+
+#define SHARD_VNODES 128
+
+typedef struct {
+    uint32_t point;
+    int shard;
+} RingPoint;
+
+typedef struct {
+    int count;
+    char** ports;
+    RingPoint* ring; // sorted by point
+    int ringSize;
+} ShardRing;
+
+ShardRing* init_shard_ring(const char* list);
+int shard_for(const ShardRing* ring, const char* id);
+int connect_shard(const ShardRing* ring, int shard);
+bool gather_listing(const ShardRing* ring, Buffer* out);
+
+#endif //SRC_SHARDRING_H
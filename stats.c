@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+#define CACHE_LINE 64
+
+static int nextShard; // handed out round robin as threads first count
+static __thread int ownShard = -1;
+
+// Allocate size zeroed bytes starting on a cache line of their own.
+static void* alloc_lines(size_t size) {
+
+    size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    void* data;
+    if (posix_memalign(&data, CACHE_LINE, size)) {
+        abort();
+    }
+    memset(data, 0, size);
+    return data;
+}
+
+// Return the calling thread's shard of stats.
+static StatsShard* own_shard(Stats* stats) {
+
+    if (ownShard < 0) {
+        ownShard = __atomic_fetch_add(&nextShard, 1, __ATOMIC_RELAXED) %
+                STATS_SHARDS;
+    }
+    return &stats->shards[ownShard];
+}
+
+// Create stats with the named counters and latency histograms, all zero.
+Stats* init_stats(const char* const* counterNames, int counterCount,
+        const char* const* histNames, int histCount) {
+
+    Stats* stats = malloc(sizeof(Stats));
+    stats->counterNames = counterNames;
+    stats->counterCount = counterCount;
+    stats->histNames = histNames;
+    stats->histCount = histCount;
+
+    for (int i = 0; i < STATS_SHARDS; ++i) {
+        stats->shards[i].counters = alloc_lines(sizeof(int64_t) *
+                counterCount);
+        stats->shards[i].hists = alloc_lines(sizeof(Histogram) * histCount);
+        for (int j = 0; j < histCount; ++j) {
+            init_histogram(&stats->shards[i].hists[j]);
+        }
+    }
+    return stats;
+}
+
+// Add delta to counter.
+void add_stat(Stats* stats, int counter, int64_t delta) {
+    __atomic_add_fetch(&own_shard(stats)->counters[counter], delta,
+            __ATOMIC_RELAXED);
+}
+
+// Record a latency of ns in histogram hist.
+void record_latency(Stats* stats, int hist, uint64_t ns) {
+    record_shared_value(&own_shard(stats)->hists[hist], ns);
+}
+
+// Return the monotonic clock in ns, for timing latencies.
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Append a "name value" line to out.
+void append_stat(Buffer* out, const char* name, int64_t value) {
+    char number[32];
+    snprintf(number, sizeof(number), " %lld\n", (long long)value);
+    append_str(out, name);
+    append_str(out, number);
+}
+
+// Append every counter summed over the shards to out as "name value"
+// lines, then the count and percentiles of every histogram in ns.
+void append_stats(Stats* stats, Buffer* out) {
+
+    for (int i = 0; i < stats->counterCount; ++i) {
+        int64_t total = 0;
+        for (int j = 0; j < STATS_SHARDS; ++j) {
+            total += __atomic_load_n(&stats->shards[j].counters[i],
+                    __ATOMIC_RELAXED);
+        }
+        append_stat(out, stats->counterNames[i], total);
+    }
+
+    static const double percentiles[] = {50, 99, 99.9};
+    static const char* const suffixes[] = {"p50_ns", "p99_ns", "p999_ns"};
+    Histogram* merged = malloc(sizeof(Histogram));
+    char name[96];
+
+    for (int i = 0; i < stats->histCount; ++i) {
+        init_histogram(merged);
+        for (int j = 0; j < STATS_SHARDS; ++j) {
+            merge_histogram(merged, &stats->shards[j].hists[i]);
+        }
+
+        snprintf(name, sizeof(name), "%s.count", stats->histNames[i]);
+        append_stat(out, name, merged->total);
+        for (int p = 0; p < sizeof(percentiles) / sizeof(double); ++p) {
+            snprintf(name, sizeof(name), "%s.%s", stats->histNames[i],
+                    suffixes[p]);
+            append_stat(out, name,
+                    value_at_percentile(merged, percentiles[p]));
+        }
+        snprintf(name, sizeof(name), "%s.max_ns", stats->histNames[i]);
+        append_stat(out, name, merged->max);
+    }
+    free(merged);
+}
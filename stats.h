@@ -0,0 +1,39 @@
+//
+// Runtime counters and latency histograms for a server, reported by its
+// # request. Updates go to one of STATS_SHARDS shards picked per thread,
+// each on cache lines of its own, with relaxed atomic adds - so threads
+// counting the same thing hardly ever touch the same line and nothing
+// takes a lock. A report sums the shards as they are at that moment.
+//
+
+#ifndef SRC_STATS_H
+#define SRC_STATS_H
+
+#include <stdint.h>
+#include "buffer.h"
+#include "histogram.h"
+
+#define STATS_SHARDS 16
+
+typedef struct {
+    int64_t* counters; // counters may go down, for gauges
+    Histogram* hists;
+} StatsShard;
+
+typedef struct {
+    const char* const* counterNames;
+    int counterCount;
+    const char* const* histNames;
+    int histCount;
+    StatsShard shards[STATS_SHARDS];
+} Stats;
+
+Stats* init_stats(const char* const* counterNames, int counterCount,
+        const char* const* histNames, int histCount);
+void add_stat(Stats* stats, int counter, int64_t delta);
+void record_latency(Stats* stats, int hist, uint64_t ns);
+uint64_t stats_clock(void);
+void append_stat(Buffer* out, const char* name, int64_t value);
+void append_stats(Stats* stats, Buffer* out);
+
+#endif //SRC_STATS_H
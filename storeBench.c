@@ -0,0 +1,165 @@
+//
+// Startup benchmark of the persistent airport store. Builds a store of
+// airports, then times a restart - mapping it and serving the first
+// lookup - from a cold and a warm page cache, against replaying the same
+// airports as ! registrations into an empty table, the least a
+// registration storm costs before any networking.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "airport.h"
+#include "airportStore.h"
+#include "buffer.h"
+#include "mapperProtocol.h"
+#include "rcu.h"
+
+#define DEFAULT_AIRPORTS 1000000
+#define RUNS 5
+
+// Return the current monotonic time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Look up an airport the way a ? request would, so a restart isn't done
+// until it can answer.
+static void first_lookup(AirportList list, long count) {
+
+    char id[32];
+    snprintf(id, sizeof(id), "AP%07ld", count / 2);
+    rcu_read_lock();
+    Airport* airport = get_airport(list, id);
+    if (!airport || !airport->port[0]) {
+        fprintf(stderr, "lookup failed\n");
+        exit(1);
+    }
+    rcu_read_unlock();
+}
+
+// Write count airports to a new store at path in one commit.
+static void build_store(const char* path, long count) {
+
+    AirportStore* store = open_airport_store(path);
+    if (!store) {
+        fprintf(stderr, "can't create %s\n", path);
+        exit(1);
+    }
+    char id[32];
+    char port[16];
+    for (long i = 0; i < count; ++i) {
+        snprintf(id, sizeof(id), "AP%07ld", i);
+        snprintf(port, sizeof(port), "%ld", 1024 + i % 60000);
+        if (store_airport(store, id, port, hash_airport_id(id)) < 0) {
+            fprintf(stderr, "store full at %ld airports\n", i);
+            exit(1);
+        }
+    }
+    commit_store(store);
+    close_airport_store(store);
+}
+
+// Drop the store's pages from the page cache so the next open reads it
+// from disk.
+static void drop_cache(const char* path) {
+    int fd = open(path, O_RDONLY);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Time a restart from the store at path: map it, load the table and serve
+// one lookup.
+static double restart(const char* path, long count) {
+
+    double start = now();
+    AirportStore* store = open_airport_store(path);
+    AirportList list = init_airport_list();
+    attach_airport_store(list, store);
+    first_lookup(list, count);
+    double elapsed = now() - start;
+
+    free_airport_list(list);
+    close_airport_store(store);
+    return elapsed;
+}
+
+// Time registering every airport in registrations, one ! message per
+// line, into an empty in memory table and serving one lookup.
+static double replay(Buffer* registrations, long count) {
+
+    // parse_message splits lines in place, so work on a copy
+    char* text = malloc(registrations->len);
+    memcpy(text, registrations->data, registrations->len);
+
+    double start = now();
+    AirportList list = init_airport_list();
+    char* line = text;
+    char* end = text + registrations->len;
+    while (line < end) {
+        char* newline = memchr(line, '\n', end - line);
+        *newline = '\0';
+        MapperMsg msg = parse_message(line);
+
+        Airport airport;
+        airport.id = msg.args.id;
+        airport.port = msg.args.port;
+        airport.info = NULL;
+        add_airport(list, airport);
+        line = newline + 1;
+    }
+    first_lookup(list, count);
+    double elapsed = now() - start;
+
+    free_airport_list(list);
+    free(text);
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+
+    long count = argc > 1 ? atol(argv[1]) : DEFAULT_AIRPORTS;
+
+    char path[] = "/tmp/storebenchXXXXXX";
+    close(mkstemp(path));
+
+    double start = now();
+    build_store(path, count);
+    printf("%ld airports, store built in %.1f ms\n", count,
+            (now() - start) * 1e3);
+
+    drop_cache(path);
+    printf("%-20s %9.1f ms\n", "restart, cold cache",
+            restart(path, count) * 1e3);
+
+    double best = 1e30;
+    for (int i = 0; i < RUNS; ++i) {
+        double elapsed = restart(path, count);
+        best = elapsed < best ? elapsed : best;
+    }
+    printf("%-20s %9.1f ms\n", "restart, warm cache", best * 1e3);
+
+    Buffer registrations;
+    init_buffer(&registrations, 4096);
+    char line[64];
+    for (long i = 0; i < count; ++i) {
+        snprintf(line, sizeof(line), "!AP%07ld:%ld\n", i, 1024 + i % 60000);
+        append_str(&registrations, line);
+    }
+    best = 1e30;
+    for (int i = 0; i < RUNS; ++i) {
+        double elapsed = replay(&registrations, count);
+        best = elapsed < best ? elapsed : best;
+    }
+    printf("%-20s %9.1f ms\n", "replay registrations", best * 1e3);
+
+    free_buffer(&registrations);
+    unlink(path);
+    return 0;
+}
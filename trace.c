@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "trace.h"
+
+static TraceRing* rings; // pushed onto, never removed
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey; // frees a ring up when its thread exits
+static sem_t dumpRequests; // posted by the signal handler
+static __thread TraceRing* ownRing;
+
+// Write every ring's events to trace.<pid>, one "ns thread probe a b" line
+// each, oldest first per thread. A ring being recorded into while it is
+// dumped may lose its oldest events.
+static void dump_rings(void) {
+
+    char path[32];
+    snprintf(path, sizeof(path), "trace.%d", (int)getpid());
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        return;
+    }
+
+    TraceRing* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (uint64_t i = first; i < head; ++i) {
+            TraceEvent* event = &ring->events[i % TRACE_RING_SIZE];
+            fprintf(file, "%llu %lu %s %lld %lld\n",
+                    (unsigned long long)event->ns, ring->thread,
+                    event->probe, (long long)event->args[0],
+                    (long long)event->args[1]);
+        }
+    }
+    fclose(file);
+}
+
+// Signal handler for SIGUSR2. Only wakes the dumping thread, as stdio isn't
+// safe in a handler.
+static void request_dump(int signo) {
+    sem_post(&dumpRequests);
+}
+
+// Thread function - dump the rings whenever asked.
+static void* run_dumper(void* arg) {
+
+    while (true) {
+        while (sem_wait(&dumpRequests)) {
+        }
+        dump_rings();
+    }
+    return NULL;
+}
+
+// Hand a finished thread's ring to the next new thread.
+static void release_ring(void* ring) {
+    __atomic_store_n(&((TraceRing*)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+// Set up dumping on SIGUSR2 and at exit, once per process.
+static void start_tracing(void) {
+
+    sem_init(&dumpRequests, 0, 0);
+    pthread_key_create(&ringKey, release_ring);
+
+    pthread_t threadId;
+    if (!pthread_create(&threadId, 0, run_dumper, NULL)) {
+        pthread_detach(threadId);
+    }
+    signal(SIGUSR2, request_dump);
+    atexit(dump_rings);
+}
+
+#if TRACE_RING
+// Catch SIGUSR2 from the start, so a dump asked for before the first probe
+// is hit doesn't kill the process.
+__attribute__((constructor)) static void trace_at_start(void) {
+    pthread_once(&started, start_tracing);
+}
+#endif
+
+// Return a ring for the calling thread - one a finished thread has let go
+// of, or a new one.
+static TraceRing* take_ring(void) {
+
+    pthread_once(&started, start_tracing);
+
+    TraceRing* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+        int unowned = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &unowned, 1, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(TraceRing));
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    ring->thread = (unsigned long)pthread_self();
+    pthread_setspecific(ringKey, ring);
+    return ring;
+}
+
+// Record a hit of probe with its arguments in the calling thread's ring.
+void trace_record(const char* probe, int64_t a, int64_t b) {
+
+    if (!ownRing) {
+        ownRing = take_ring();
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t head = ownRing->head;
+    TraceEvent* event = &ownRing->events[head % TRACE_RING_SIZE];
+    event->ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    event->probe = probe;
+    event->args[0] = a;
+    event->args[1] = b;
+    __atomic_store_n(&ownRing->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,109 @@
+//
+// Static tracepoints. TRACE0/1/2(provider, name, args) mark a point on a
+// hot path with up to two integer (or pointer) arguments. Each compiles to
+// a single nop plus a .note.stapsdt ELF note - the format <sys/sdt.h>
+// writes, spelled out here so the build doesn't need systemtap's headers -
+// so perf, bpftrace and friends can attach to a running binary, e.g.
+//
+//   bpftrace -e 'usdt:./mapper:mapper:lookup { @[arg1] = count(); }'
+//
+// Arguments are passed as 8 byte integers. On other targets the probes
+// compile to nothing.
+//
+// Built with TRACE_RING (make trace) every probe also records a timestamp
+// into a ring of the calling thread's recent events; SIGUSR2 dumps every
+// ring to trace.<pid> in the working directory.
+//
+
+#ifndef SRC_TRACE_H
+#define SRC_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_RING_SIZE 4096 // events kept per thread, a power of two
+
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+#define TRACE_NOTE_HEAD \
+        "990: nop\n" \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+        ".balign 4\n" \
+        ".4byte 992f-991f, 994f-993f, 3\n" \
+        "991: .asciz \"stapsdt\"\n" \
+        "992: .balign 4\n" \
+        "993: .8byte 990b\n" \
+        ".8byte _.stapsdt.base\n" \
+        ".8byte 0\n"
+#define TRACE_NOTE_TAIL \
+        "994: .balign 4\n" \
+        ".popsection\n" \
+        ".ifndef _.stapsdt.base\n" \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base," \
+        "comdat\n" \
+        ".weak _.stapsdt.base\n" \
+        ".hidden _.stapsdt.base\n" \
+        "_.stapsdt.base: .space 1\n" \
+        ".size _.stapsdt.base, 1\n" \
+        ".popsection\n" \
+        ".endif\n"
+#define TRACE_NAMES(provider, name, args) \
+        ".asciz \"" #provider "\"\n" \
+        ".asciz \"" #name "\"\n" \
+        ".asciz \"" args "\"\n"
+#define TRACE_NOTE0(provider, name) \
+        __asm__ __volatile__(TRACE_NOTE_HEAD \
+                TRACE_NAMES(provider, name, "") TRACE_NOTE_TAIL)
+#define TRACE_NOTE(provider, name, args, ...) \
+        __asm__ __volatile__(TRACE_NOTE_HEAD \
+                TRACE_NAMES(provider, name, args) TRACE_NOTE_TAIL \
+                :: __VA_ARGS__)
+#else
+#define TRACE_NOTE0(provider, name)
+#define TRACE_NOTE(provider, name, args, ...)
+#endif
+
+#define TRACE_ARG(value) ((int64_t)(intptr_t)(value))
+
+#if TRACE_RING
+#define TRACE_RECORD(provider, name, a, b) \
+        trace_record(#provider ":" #name, (a), (b))
+#else
+#define TRACE_RECORD(provider, name, a, b)
+#endif
+
+#define TRACE0(provider, name) do { \
+        TRACE_NOTE0(provider, name); \
+        TRACE_RECORD(provider, name, 0, 0); \
+    } while (0)
+
+#define TRACE1(provider, name, a) do { \
+        TRACE_NOTE(provider, name, "8@%[a0]", [a0] "nor" (TRACE_ARG(a))); \
+        TRACE_RECORD(provider, name, TRACE_ARG(a), 0); \
+    } while (0)
+
+#define TRACE2(provider, name, a, b) do { \
+        TRACE_NOTE(provider, name, "8@%[a0] 8@%[a1]", \
+                [a0] "nor" (TRACE_ARG(a)), [a1] "nor" (TRACE_ARG(b))); \
+        TRACE_RECORD(provider, name, TRACE_ARG(a), TRACE_ARG(b)); \
+    } while (0)
+
+// One recorded probe hit
+typedef struct {
+    uint64_t ns; // monotonic clock
+    const char* probe; // "provider:name"
+    int64_t args[2];
+} TraceEvent;
+
+// A thread's most recent events. Only the owning thread writes; head only
+// ever grows, and the event at head % TRACE_RING_SIZE is written before
+// head is bumped past it.
+typedef struct TraceRing {
+    struct TraceRing* next; // every ring ever made, for dumping
+    int owned; // a live thread is recording into it
+    unsigned long thread;
+    uint64_t head;
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+void trace_record(const char* probe, int64_t a, int64_t b);
+
+#endif //SRC_TRACE_H
@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "workQueue.h"
+
+// Initialise a queue that holds at least depth fds (rounded up to a power of
+// two, and at least two so a cell's seq can't be mistaken a lap later) and
+// return it, or NULL if there isn't the memory for it.
+WorkQueue* init_work_queue(unsigned depth) {
+
+    uint64_t size = 2;
+    while (size < depth) {
+        size <<= 1;
+    }
+
+    WorkQueue* queue;
+    if (posix_memalign((void**)&queue, CACHE_LINE, sizeof(WorkQueue))) {
+        return NULL;
+    }
+    queue->cells = malloc(sizeof(QueueCell) * size);
+    if (!queue->cells) {
+        free(queue);
+        return NULL;
+    }
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    sem_init(&queue->items, 0, 0);
+
+    // cell i is free for the producer claiming position i
+    for (uint64_t i = 0; i < size; ++i) {
+        queue->cells[i].seq = i;
+    }
+    return queue;
+}
+
+// Add fd to the back of the queue and wake a consumer. Returns false without
+// blocking if the queue is full.
+bool try_enqueue(WorkQueue* queue, int fd) {
+
+    uint64_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    while (true) {
+        QueueCell* cell = &queue->cells[pos & queue->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+
+        if (diff == 0) {
+            // cell is free - try to claim position pos
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->fd = fd;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                sem_post(&queue->items);
+                return true;
+            }
+            // lost the race, pos now holds the current tail
+
+        } else if (diff < 0) {
+            return false; // still holds an fd from a lap ago - full
+
+        } else {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Remove and return the fd at the front of the queue, sleeping until one is
+// available.
+int dequeue(WorkQueue* queue) {
+
+    while (sem_wait(&queue->items) && errno == EINTR) {
+    }
+
+    uint64_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    while (true) {
+        QueueCell* cell = &queue->cells[pos & queue->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                int fd = cell->fd;
+                // hand the cell back to the producer one lap ahead
+                __atomic_store_n(&cell->seq, pos + queue->mask + 1,
+                        __ATOMIC_RELEASE);
+                return fd;
+            }
+
+        } else {
+            // the semaphore promised an fd but its producer hasn't finished
+            // publishing it yet, or another consumer moved head on
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+}
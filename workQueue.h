@@ -0,0 +1,35 @@
+//
+// Bounded multi-producer multi-consumer queue of file descriptors, used to
+// hand accepted connections to a fixed pool of worker threads. Producers
+// never block: a full queue is reported so the caller can shed the load.
+//
+
+#ifndef SRC_WORKQUEUE_H
+#define SRC_WORKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <semaphore.h>
+
+#define CACHE_LINE 64
+
+// A cell's seq tells producers and consumers whose turn it is to use it
+typedef struct {
+    uint64_t seq;
+    int fd;
+} QueueCell;
+
+typedef struct WorkQueue {
+    QueueCell* cells;
+    uint64_t mask; // depth - 1, depth is a power of two
+    // producers and consumers each get their own cache line
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));
+    uint64_t head __attribute__((aligned(CACHE_LINE)));
+    sem_t items; // counts queued fds so idle consumers can sleep
+} WorkQueue;
+
+WorkQueue* init_work_queue(unsigned depth);
+bool try_enqueue(WorkQueue* queue, int fd);
+int dequeue(WorkQueue* queue);
+
+#endif //SRC_WORKQUEUE_H